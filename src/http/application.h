@@ -2,6 +2,7 @@
 #define HTTP_APPLICATION_H
 
 #include "messages.h"
+#include <functional>
 #include <list>
 
 using namespace std;
@@ -28,10 +29,24 @@ public:
  * An individual component participating, often together with other middleware components, in the
  * processing of an incoming request and the creation of a resulting response. It may create and
  * return a response without delegating to a request handler, if sufficient conditions are met.
+ *
+ * The process method runs once the request is completely received. A middleware may also subscribe
+ * to earlier and later phases of the request by overriding getPhases and the associated hooks; each
+ * subscribed hook runs once per phase, in the order of the middleware.
  */
 class Middleware {
 public:
+  enum PHASE : unsigned {
+    /// The head of the request is received.
+    HEADERS = 1u << 0u,
+    /// A part of the body of the request is received.
+    BODY_CHUNK = 1u << 1u,
+    /// The response to the request is sent.
+    COMPLETE = 1u << 2u
+  };
+
   virtual ~Middleware() = default;
+
   /**
    * @param request The request to process
    * @param handler The handler in charge of passing the request to the next middleware
@@ -39,6 +54,60 @@ public:
    */
   virtual unique_ptr<Response> process(ServerRequest &request,
                                        RequestHandler &handler) = 0;
+
+  /**
+   * @return The phases the middleware subscribes to, a combination of PHASE values
+   */
+  virtual unsigned getPhases() const {
+    return 0;
+  }
+
+  /**
+   * Called once the head of the request is received, before its body.
+   * @param request The request, without body
+   * @return A response ending the processing of the request, or nullptr to continue
+   */
+  virtual unique_ptr<Response> onHeaders(ServerRequest &request) {
+    return nullptr;
+  }
+
+  /**
+   * Called for each part of the body of the request as it is received. The part is already
+   * appended to the body of the request.
+   * @param request The request
+   * @param data The part of the body
+   * @param length The length of the part
+   * @return A response ending the processing of the request, or nullptr to continue
+   */
+  virtual unique_ptr<Response> onBodyChunk(ServerRequest &request, const char *data,
+                                           size_t length) {
+    return nullptr;
+  }
+
+  /**
+   * Called once the response to the request is sent, whichever phase produced it.
+   * @param request The request
+   * @param response The response
+   */
+  virtual void onComplete(ServerRequest &request, const Response &response) {
+  }
+};
+
+/**
+ * Processes requests created by the application rather than received from a client, for instance
+ * to refresh a cached response without delaying the request that found it stale.
+ */
+class RequestDispatcher {
+public:
+  virtual ~RequestDispatcher() = default;
+  /**
+   * Processes a request through all the middleware once the current work of the thread is done.
+   * The response is not sent to any client.
+   * @param request The request, completely received
+   * @param completion Called with the response, or nullptr if the processing failed
+   */
+  virtual void dispatch(unique_ptr<ServerRequest> request,
+                        function<void(unique_ptr<Response>)> completion) = 0;
 };
 
 typedef list<unique_ptr<Middleware>> application_middleware_t;
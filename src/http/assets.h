@@ -0,0 +1,490 @@
+#ifndef HTTP_ASSETS_H
+#define HTTP_ASSETS_H
+
+#include "application.h"
+#include "messages.h"
+#include "negotiation.h"
+#include "../utils/compression.h"
+#include "../utils/file.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+
+using namespace std;
+
+namespace http {
+/**
+ * Layout of an asset bundle file. All offsets are relative to the start of the file.
+ *
+ * The header is followed by the entries, sorted by path, then by the paths, the pre-serialized
+ * response heads, the ETags and the contents of the variants.
+ */
+namespace bundle {
+constexpr char MAGIC[8] = {'H', 'T', 'A', 'S', 'S', 'E', 'T', '1'};
+
+enum VARIANT {
+  IDENTITY = 0,
+  GZIP = 1,
+  BROTLI = 2,
+  VARIANT_COUNT = 3
+};
+
+/**
+ * @return The content coding of a variant
+ */
+inline const char *getCoding(size_t variant) {
+  switch (variant) {
+    case GZIP:
+      return "gzip";
+    case BROTLI:
+      return "br";
+    default:
+      return "identity";
+  }
+}
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t entries_offset;
+  uint64_t file_length;
+};
+
+/**
+ * A representation of an asset. Absent if its data offset is 0.
+ */
+struct Variant {
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint64_t head_offset;
+  uint64_t etag_offset;
+  uint32_t head_length;
+  uint32_t etag_length;
+};
+
+struct Entry {
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t reserved;
+  Variant variants[VARIANT_COUNT];
+};
+} // namespace bundle
+
+/**
+ * Build-time creation of an asset bundle. Each asset is stored with its identity content and its
+ * gzip and brotli variants when the codings are supported and make the content smaller. The heads
+ * of the responses are serialized in advance.
+ */
+class AssetBundleWriter {
+protected:
+  struct Asset {
+    string path;
+    string content_type;
+    string content;
+  };
+
+  vector<Asset> assets_;
+  string cache_control_;
+
+  static string makeETag(const string &content, size_t variant) {
+    auto hash = utils::hash64(content.data(), content.size());
+    static const char *digits = "0123456789abcdef";
+    string etag = "\"";
+    for (auto shift = 60; shift >= 0; shift -= 4) {
+      etag += digits[(hash >> static_cast<unsigned>(shift)) & 0xfu];
+    }
+    if (variant != bundle::IDENTITY) {
+      etag += '-';
+      etag += bundle::getCoding(variant);
+    }
+    etag += '"';
+    return etag;
+  }
+
+public:
+  /**
+   * @param cache_control The value of the Cache-Control header of the responses, if not empty
+   */
+  explicit AssetBundleWriter(string cache_control = "") : cache_control_(move(cache_control)) {
+  }
+
+  /**
+   * Guesses a content type from a file extension.
+   * @param extension The extension, with its leading dot
+   * @return The content type
+   */
+  static string guessContentType(const string &extension) {
+    static const vector<pair<string, string>> types = {
+      {".html", "text/html; charset=utf-8"},
+      {".htm", "text/html; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".mjs", "text/javascript; charset=utf-8"},
+      {".json", "application/json"},
+      {".map", "application/json"},
+      {".txt", "text/plain; charset=utf-8"},
+      {".xml", "application/xml"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".webp", "image/webp"},
+      {".avif", "image/avif"},
+      {".ico", "image/x-icon"},
+      {".woff", "font/woff"},
+      {".woff2", "font/woff2"},
+      {".ttf", "font/ttf"},
+      {".wasm", "application/wasm"},
+      {".pdf", "application/pdf"},
+      {".mp4", "video/mp4"},
+      {".webm", "video/webm"},
+    };
+    auto l_extension = utils::tolower(extension);
+    for (const auto &type : types) {
+      if (type.first == l_extension) {
+        return type.second;
+      }
+    }
+    return "application/octet-stream";
+  }
+
+  /**
+   * Adds an asset.
+   * @param path The path of the asset in the URIs, starting with '/'
+   * @param content_type The content type of the asset
+   * @param content The identity content of the asset
+   */
+  void add(string path, string content_type, string content) {
+    this->assets_.push_back({move(path), move(content_type), move(content)});
+  }
+
+  /**
+   * Adds the files of a directory and its sub-directories, with paths relative to the directory.
+   * @param directory The directory
+   * @param prefix The prefix of the paths, starting and ending with '/'
+   */
+  void addDirectory(const string &directory, const string &prefix = "/") {
+    for (const auto &entry : filesystem::recursive_directory_iterator(directory)) {
+      if (!entry.is_regular_file()) {
+        continue;
+      }
+      ifstream input(entry.path(), ios::binary);
+      string content((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+      if (!input.good() && !input.eof()) {
+        throw utils::RuntimeException("Cannot read %s", entry.path().string().c_str());
+      }
+      auto relative = filesystem::relative(entry.path(), directory).generic_string();
+      this->add(prefix + relative,
+                AssetBundleWriter::guessContentType(entry.path().extension().string()),
+                move(content));
+    }
+  }
+
+  /**
+   * Writes the bundle.
+   * @param path The path of the bundle file
+   * @throw utils::RuntimeException Thrown if the file cannot be written
+   */
+  void write(const string &path) {
+    sort(this->assets_.begin(), this->assets_.end(), [](const Asset &a, const Asset &b) {
+      return a.path < b.path;
+    });
+    for (size_t i = 1; i < this->assets_.size(); i++) {
+      if (this->assets_[i].path == this->assets_[i - 1].path) {
+        throw utils::RuntimeException("Duplicate asset %s", this->assets_[i].path.c_str());
+      }
+    }
+
+    vector<bundle::Entry> entries(this->assets_.size());
+    string strings;
+    vector<string> contents;
+    auto strings_offset = sizeof(bundle::Header) + entries.size() * sizeof(bundle::Entry);
+    for (size_t i = 0; i < this->assets_.size(); i++) {
+      const auto &asset = this->assets_[i];
+      auto &entry = entries[i];
+      memset(&entry, 0, sizeof(entry));
+      entry.path_offset = strings_offset + strings.size();
+      entry.path_length = static_cast<uint32_t>(asset.path.size());
+      strings += asset.path;
+
+      for (size_t variant = 0; variant < bundle::VARIANT_COUNT; variant++) {
+        string content;
+        if (variant == bundle::IDENTITY) {
+          content = asset.content;
+        } else {
+          auto coding = bundle::getCoding(variant);
+          if (!utils::Encoder::isSupported(coding)) {
+            continue;
+          }
+          content = utils::Encoder::compress(coding, asset.content, 9);
+          // Variants that do not save at least a tenth of the size are not worth it.
+          if (content.size() * 10 > asset.content.size() * 9) {
+            continue;
+          }
+        }
+        auto etag = AssetBundleWriter::makeETag(asset.content, variant);
+        Response response;
+        response.setHeader("Content-Type", string(asset.content_type));
+        response.setHeader("ETag", string(etag));
+        response.setHeader("Vary", "Accept-Encoding");
+        if (variant != bundle::IDENTITY) {
+          response.setHeader("Content-Encoding", bundle::getCoding(variant));
+        }
+        if (!this->cache_control_.empty()) {
+          response.setHeader("Cache-Control", string(this->cache_control_));
+        }
+        response.addBodySegment(BodySegment::fromString(string(content)));
+        const auto &head = response.serializeHead();
+
+        auto &out = entry.variants[variant];
+        out.head_offset = strings_offset + strings.size();
+        out.head_length = static_cast<uint32_t>(head.getLength());
+        strings.append(head.getData(), head.getLength());
+        out.etag_offset = strings_offset + strings.size();
+        out.etag_length = static_cast<uint32_t>(etag.size());
+        strings += etag;
+        // The data offset is known once all the strings are laid out.
+        out.data_offset = contents.size() + 1;
+        out.data_length = content.size();
+        contents.push_back(move(content));
+      }
+    }
+
+    // Contents are aligned to 8 bytes after the strings.
+    auto data_offset = (strings_offset + strings.size() + 7u) & ~static_cast<size_t>(7u);
+    strings.resize(data_offset - strings_offset, '\0');
+    vector<uint64_t> content_offsets;
+    auto offset = data_offset;
+    for (const auto &content : contents) {
+      content_offsets.push_back(offset);
+      offset += (content.size() + 7u) & ~static_cast<size_t>(7u);
+    }
+    for (auto &entry : entries) {
+      for (auto &variant : entry.variants) {
+        if (variant.data_offset != 0) {
+          variant.data_offset = content_offsets[variant.data_offset - 1];
+        }
+      }
+    }
+
+    bundle::Header header{};
+    memcpy(header.magic, bundle::MAGIC, sizeof(bundle::MAGIC));
+    header.version = 1;
+    header.count = static_cast<uint32_t>(entries.size());
+    header.entries_offset = sizeof(bundle::Header);
+    header.file_length = offset;
+
+    ofstream output(path, ios::binary | ios::trunc);
+    output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char *>(entries.data()),
+                 static_cast<streamsize>(entries.size() * sizeof(bundle::Entry)));
+    output.write(strings.data(), static_cast<streamsize>(strings.size()));
+    for (const auto &content : contents) {
+      output.write(content.data(), static_cast<streamsize>(content.size()));
+      string padding(((content.size() + 7u) & ~static_cast<size_t>(7u)) - content.size(), '\0');
+      output.write(padding.data(), static_cast<streamsize>(padding.size()));
+    }
+    if (!output) {
+      throw utils::RuntimeException("Cannot write %s", path.c_str());
+    }
+  }
+};
+
+/**
+ * Read-only asset bundle, mapped in memory at once.
+ */
+class AssetBundle {
+protected:
+  unique_ptr<utils::FileMapping> mapping_;
+  const bundle::Header *header_;
+  const bundle::Entry *entries_;
+
+  /**
+   * @return Whether a range of the file is within the bundle
+   */
+  bool contains(uint64_t offset, uint64_t length) const {
+    return offset <= this->header_->file_length && length <= this->header_->file_length - offset;
+  }
+
+  /**
+   * @return Whether the strings and the content of an entry are within the bundle
+   */
+  bool isValid(const bundle::Entry &entry) const {
+    if (!this->contains(entry.path_offset, entry.path_length) ||
+        entry.variants[bundle::IDENTITY].data_offset == 0) {
+      return false;
+    }
+    for (const auto &variant : entry.variants) {
+      if (variant.data_offset != 0 &&
+          (!this->contains(variant.data_offset, variant.data_length) ||
+           !this->contains(variant.head_offset, variant.head_length) ||
+           !this->contains(variant.etag_offset, variant.etag_length))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  /**
+   * Maps a bundle, checking that everything its entries refer to is within the file.
+   * @param path The path of the bundle file
+   * @throw utils::RuntimeException Thrown if the file is not a valid bundle
+   */
+  explicit AssetBundle(const string &path) {
+    utils::File file(path);
+    auto size = file.getSize();
+    if (size < sizeof(bundle::Header)) {
+      throw utils::RuntimeException("Invalid asset bundle %s", path.c_str());
+    }
+    this->mapping_ = make_unique<utils::FileMapping>(file, size);
+    this->header_ = reinterpret_cast<const bundle::Header *>(this->mapping_->getData());
+    if (memcmp(this->header_->magic, bundle::MAGIC, sizeof(bundle::MAGIC)) != 0 ||
+        this->header_->version != 1 || this->header_->file_length > size ||
+        this->header_->entries_offset % alignof(bundle::Entry) != 0 ||
+        !this->contains(this->header_->entries_offset,
+                        uint64_t(this->header_->count) * sizeof(bundle::Entry))) {
+      throw utils::RuntimeException("Invalid asset bundle %s", path.c_str());
+    }
+    this->entries_ = reinterpret_cast<const bundle::Entry *>(this->mapping_->getData() +
+                                                             this->header_->entries_offset);
+    for (size_t i = 0; i < this->header_->count; i++) {
+      if (!this->isValid(this->entries_[i])) {
+        throw utils::RuntimeException("Invalid entry %zu in asset bundle %s", i, path.c_str());
+      }
+    }
+  }
+
+  size_t getCount() const {
+    return this->header_->count;
+  }
+
+  const char *getData(uint64_t offset) const {
+    return this->mapping_->getData() + offset;
+  }
+
+  string_view getPath(const bundle::Entry &entry) const {
+    return string_view(this->getData(entry.path_offset), entry.path_length);
+  }
+
+  string_view getETag(const bundle::Variant &variant) const {
+    return string_view(this->getData(variant.etag_offset), variant.etag_length);
+  }
+
+  /**
+   * Finds an asset by binary search.
+   * @param path The path of the asset
+   * @return The entry of the asset, or nullptr
+   */
+  const bundle::Entry *find(string_view path) const {
+    auto begin = this->entries_;
+    auto end = this->entries_ + this->header_->count;
+    auto entry = lower_bound(begin, end, path, [this](const bundle::Entry &e, string_view p) {
+      return this->getPath(e) < p;
+    });
+    if (entry == end || this->getPath(*entry) != path) {
+      return nullptr;
+    }
+    return entry;
+  }
+};
+
+/**
+ * Serves the assets of a bundle. Lookups do not touch the file system: the pre-serialized head and
+ * the content of the negotiated variant are sent straight from the mapping. Requests for other
+ * paths are passed to the next middleware.
+ */
+class StaticAssets : public Middleware {
+protected:
+  shared_ptr<const AssetBundle> bundle_;
+  string index_;
+
+  static bool matchesETag(const ServerRequest &request, string_view etag) {
+    for (const auto &line : request.getHeader("If-None-Match")) {
+      for (const auto &candidate : utils::split(line, ',')) {
+        auto trimmed = utils::trim(candidate);
+        // Weak comparison.
+        if (trimmed.rfind("W/", 0) == 0) {
+          trimmed = trimmed.substr(2);
+        }
+        if (trimmed == "*" || trimmed == etag) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+public:
+  /**
+   * @param bundle The bundle
+   * @param index The asset served for paths ending with '/'
+   */
+  explicit StaticAssets(shared_ptr<const AssetBundle> bundle, string index = "index.html")
+    : bundle_(move(bundle)), index_(move(index)) {
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    auto head_only = request.getMethod() == Request::Method::METHOD::HEAD;
+    if (!head_only && request.getMethod() != Request::Method::METHOD::GET) {
+      return handler.handle(request);
+    }
+    string path;
+    for (const auto &segment : request.getUri().getPath()) {
+      path += '/';
+      path += segment;
+    }
+    if (path.empty()) {
+      path += '/';
+    }
+    if (path.back() == '/') {
+      path += this->index_;
+    }
+    auto entry = this->bundle_->find(path);
+    if (!entry) {
+      return handler.handle(request);
+    }
+
+    auto variant = &entry->variants[bundle::IDENTITY];
+    if (entry->variants[bundle::GZIP].data_offset != 0 ||
+        entry->variants[bundle::BROTLI].data_offset != 0) {
+      vector<string> available;
+      for (auto candidate : {bundle::BROTLI, bundle::GZIP}) {
+        if (entry->variants[candidate].data_offset != 0) {
+          available.emplace_back(bundle::getCoding(candidate));
+        }
+      }
+      auto coding = AcceptEncoding(request).select(available);
+      for (auto candidate : {bundle::BROTLI, bundle::GZIP}) {
+        if (coding == bundle::getCoding(candidate)) {
+          variant = &entry->variants[candidate];
+        }
+      }
+    }
+
+    if (request.hasHeader("If-None-Match") &&
+        StaticAssets::matchesETag(request, this->bundle_->getETag(*variant))) {
+      auto response = make_unique<Response>(Response::Status::NOT_MODIFIED);
+      response->setHeader("ETag", string(this->bundle_->getETag(*variant)));
+      response->setHeader("Vary", "Accept-Encoding");
+      return response;
+    }
+
+    auto response = make_unique<Response>();
+    if (!head_only) {
+      response->addBodySegment(BodySegment::fromMemory(
+        this->bundle_, this->bundle_->getData(variant->data_offset), variant->data_length));
+    }
+    // The head announces the length of the content, even for a HEAD request.
+    response->setSerializedHead(BodySegment::fromMemory(
+      this->bundle_, this->bundle_->getData(variant->head_offset), variant->head_length));
+    return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_ASSETS_H
@@ -0,0 +1,94 @@
+#ifndef HTTP_ASYNC_H
+#define HTTP_ASYNC_H
+
+#include "application.h"
+#include "../net/event_loop.h"
+#include "../utils/task.h"
+
+using namespace std;
+
+namespace http {
+typedef utils::Task<unique_ptr<Response>> response_task_t;
+
+/**
+ * A request handler producing its response asynchronously.
+ */
+class AsyncRequestHandler {
+public:
+  virtual ~AsyncRequestHandler() = default;
+  /**
+   * @param request The request to process
+   * @return A task producing the response
+   */
+  virtual response_task_t handleAsync(ServerRequest &request) = 0;
+};
+
+/**
+ * A middleware written as a coroutine. Awaiting the events of the worker's event loop (socket
+ * readiness, timers or offloaded work, see net::EventLoop) suspends the request and frees the
+ * worker for other clients; the request then resumes on the same worker.
+ *
+ * The middleware must be reached asynchronously: every middleware preceding it in the server must
+ * be asynchronous as well. A synchronous caller, such as a synchronous middleware or a Router,
+ * cannot wait for the middleware without blocking the worker, so the request fails instead.
+ */
+class AsyncMiddleware : public Middleware {
+public:
+  /**
+   * @param request The request to process
+   * @param handler The handler in charge of passing the request to the next middleware
+   * @return A task producing the response
+   */
+  virtual response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) = 0;
+
+  /**
+   * @throw utils::RuntimeException Thrown as the middleware is reached synchronously
+   */
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    throw utils::RuntimeException("Asynchronous middleware reached from a synchronous caller");
+  }
+};
+
+/**
+ * Runs a blocking request handler on an executor, so that it does not occupy the worker and delay
+ * the other clients of the worker. The request is suspended meanwhile, and the response is handed
+ * back to the worker. Requests are answered with 503 Service Unavailable if the executor is
+ * saturated, and are not processed if they are cancelled before a thread of the executor is free.
+ */
+class Offload : public AsyncMiddleware {
+protected:
+  utils::Executor &executor_;
+  shared_ptr<RequestHandler> handler_;
+
+public:
+  /**
+   * @param executor The executor, which must outlive the middleware
+   * @param handler The blocking handler, called from the executor's threads
+   */
+  Offload(utils::Executor &executor, shared_ptr<RequestHandler> handler)
+    : executor_(executor), handler_(move(handler)) {
+  }
+
+  response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) override {
+    auto &blocking_handler = *this->handler_;
+    auto submitted = false;
+    try {
+      co_return co_await net::EventLoop::require().offload(this->executor_, [&] {
+        submitted = true;
+        // The request may be cancelled while it waits for a thread of the executor.
+        request.getCancellation().throwIfCancelled();
+        return blocking_handler.handle(request);
+      });
+    } catch (...) {
+      if (submitted) {
+        throw;
+      }
+    }
+    auto response = make_unique<Response>(Response::Status::SERVICE_UNAVAILABLE);
+    response->setHeader("Retry-After", "1");
+    co_return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_ASYNC_H
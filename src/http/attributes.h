@@ -0,0 +1,269 @@
+#ifndef HTTP_ATTRIBUTES_H
+#define HTTP_ATTRIBUTES_H
+
+#include "../utils/exception.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace http {
+/**
+ * Storage of the typed attributes of a request. Each attribute key owns a dense slot ID, so an
+ * attribute is found by indexing instead of a lookup by name. The values of the first slots live
+ * in the instance itself, and small values are stored inline in their slot.
+ */
+class AttributeSlots {
+public:
+  /// Number of slots stored in the instance, further slots are allocated on demand.
+  static constexpr size_t INLINE_SLOT_COUNT = 8;
+  /// Maximum size of a value stored in its slot, larger values are allocated.
+  static constexpr size_t SLOT_SIZE = 64;
+
+  /**
+   * Allocates a new slot ID.
+   */
+  static size_t registerSlot() {
+    static atomic<size_t> next_slot(0);
+    return next_slot++;
+  }
+
+protected:
+  struct Operations {
+    void (*destroy)(void *storage);
+    void (*copy)(void *destination, const void *source);
+    void (*move)(void *destination, void *source);
+  };
+
+  template<typename T>
+  struct OperationsOf {
+    static constexpr bool INLINE = sizeof(T) <= SLOT_SIZE && alignof(T) <= alignof(max_align_t);
+
+    static T *get(void *storage) {
+      if constexpr (INLINE) {
+        return launder(reinterpret_cast<T *>(storage));
+      } else {
+        return *reinterpret_cast<T **>(storage);
+      }
+    }
+
+    template<typename... Args>
+    static void construct(void *storage, Args &&... args) {
+      if constexpr (INLINE) {
+        new(storage) T(forward<Args>(args)...);
+      } else {
+        *reinterpret_cast<T **>(storage) = new T(forward<Args>(args)...);
+      }
+    }
+
+    static void destroy(void *storage) {
+      if constexpr (INLINE) {
+        OperationsOf::get(storage)->~T();
+      } else {
+        delete OperationsOf::get(storage);
+      }
+    }
+
+    static void copy(void *destination, const void *source) {
+      if constexpr (is_copy_constructible_v<T>) {
+        OperationsOf::construct(destination, *OperationsOf::get(const_cast<void *>(source)));
+      } else {
+        throw utils::RuntimeException("Attribute cannot be copied");
+      }
+    }
+
+    /**
+     * Moves a value to an empty storage, leaving the source storage empty.
+     */
+    static void move(void *destination, void *source) {
+      if constexpr (INLINE) {
+        OperationsOf::construct(destination, std::move(*OperationsOf::get(source)));
+        OperationsOf::destroy(source);
+      } else {
+        *reinterpret_cast<T **>(destination) = OperationsOf::get(source);
+      }
+    }
+
+    static inline const Operations OPERATIONS = {&OperationsOf::destroy, &OperationsOf::copy,
+                                                 &OperationsOf::move};
+  };
+
+  struct Slot {
+    alignas(max_align_t) unsigned char storage[SLOT_SIZE];
+    /// Null if the slot is empty.
+    const Operations *operations = nullptr;
+
+    Slot() = default;
+
+    Slot(const Slot &other) {
+      if (other.operations) {
+        other.operations->copy(this->storage, other.storage);
+        this->operations = other.operations;
+      }
+    }
+
+    Slot(Slot &&other) noexcept {
+      if (other.operations) {
+        other.operations->move(this->storage, other.storage);
+        this->operations = other.operations;
+        other.operations = nullptr;
+      }
+    }
+
+    Slot &operator=(const Slot &other) = delete;
+
+    ~Slot() {
+      this->reset();
+    }
+
+    void reset() {
+      if (this->operations) {
+        auto operations = this->operations;
+        this->operations = nullptr;
+        operations->destroy(this->storage);
+      }
+    }
+  };
+
+  array<Slot, INLINE_SLOT_COUNT> slots_;
+  /// Allocated individually, as values may not be relocated.
+  vector<unique_ptr<Slot>> overflow_slots_;
+
+  Slot *findSlot(size_t id) {
+    if (id < INLINE_SLOT_COUNT) {
+      return &this->slots_[id];
+    }
+    id -= INLINE_SLOT_COUNT;
+    return id < this->overflow_slots_.size() ? this->overflow_slots_[id].get() : nullptr;
+  }
+
+  const Slot *findSlot(size_t id) const {
+    return const_cast<AttributeSlots *>(this)->findSlot(id);
+  }
+
+  Slot &getSlot(size_t id) {
+    while (id >= INLINE_SLOT_COUNT + this->overflow_slots_.size()) {
+      this->overflow_slots_.push_back(make_unique<Slot>());
+    }
+    return *this->findSlot(id);
+  }
+
+public:
+  AttributeSlots() = default;
+
+  AttributeSlots(const AttributeSlots &other) : slots_(other.slots_) {
+    for (const auto &slot : other.overflow_slots_) {
+      this->overflow_slots_.push_back(make_unique<Slot>(*slot));
+    }
+  }
+
+  AttributeSlots(AttributeSlots &&other) noexcept
+    : slots_(std::move(other.slots_)), overflow_slots_(std::move(other.overflow_slots_)) {
+  }
+
+  AttributeSlots &operator=(const AttributeSlots &other) = delete;
+
+  /**
+   * @param id The slot ID
+   * @return Whether the slot holds a value
+   */
+  bool has(size_t id) const {
+    auto slot = this->findSlot(id);
+    return slot && slot->operations;
+  }
+
+  /**
+   * @tparam T The type of the value, which must be the type of the slot
+   * @param id The slot ID
+   * @return The value of the slot, or nullptr
+   */
+  template<typename T>
+  T *find(size_t id) {
+    auto slot = this->findSlot(id);
+    if (!slot || !slot->operations) {
+      return nullptr;
+    }
+    return OperationsOf<T>::get(slot->storage);
+  }
+
+  /**
+   * Replaces the value of a slot.
+   * @tparam T The type of the value, which must be the type of the slot
+   * @param id The slot ID
+   * @param args The arguments of the constructor of the value
+   * @return The value
+   */
+  template<typename T, typename... Args>
+  T &emplace(size_t id, Args &&... args) {
+    auto &slot = this->getSlot(id);
+    slot.reset();
+    OperationsOf<T>::construct(slot.storage, forward<Args>(args)...);
+    slot.operations = &OperationsOf<T>::OPERATIONS;
+    return *OperationsOf<T>::get(slot.storage);
+  }
+
+  /**
+   * Destroys the value of a slot.
+   * @param id The slot ID
+   */
+  void reset(size_t id) {
+    auto slot = this->findSlot(id);
+    if (slot) {
+      slot->reset();
+    }
+  }
+
+  /**
+   * Destroys the values of all the slots.
+   */
+  void clear() {
+    for (auto &slot : this->slots_) {
+      slot.reset();
+    }
+    for (auto &slot : this->overflow_slots_) {
+      slot->reset();
+    }
+  }
+};
+
+/**
+ * The key of a typed attribute of a request. Keys are meant to be created once, as static members
+ * or globals: each key permanently owns a slot in every request.
+ * @tparam T The type of the values of the attribute
+ */
+template<typename T>
+class AttributeKey {
+protected:
+  size_t slot_;
+  string name_;
+
+public:
+  /**
+   * @param name The name of the attribute, for diagnostics
+   */
+  explicit AttributeKey(string name = "") : slot_(AttributeSlots::registerSlot()),
+                                            name_(move(name)) {
+  }
+
+  AttributeKey(const AttributeKey &other) = delete;
+  AttributeKey &operator=(const AttributeKey &other) = delete;
+
+  size_t getSlot() const {
+    return this->slot_;
+  }
+
+  const string &getName() const {
+    return this->name_;
+  }
+};
+} // namespace http
+
+#endif //HTTP_ATTRIBUTES_H
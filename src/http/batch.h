@@ -0,0 +1,173 @@
+#ifndef HTTP_BATCH_H
+#define HTTP_BATCH_H
+
+#include "async.h"
+#include <chrono>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+
+using namespace std;
+
+namespace http {
+/**
+ * A component processing several requests at once, for instance to look up their keys with a
+ * single call to a backend.
+ */
+class BatchRequestHandler {
+public:
+  virtual ~BatchRequestHandler() = default;
+  /**
+   * @param requests The requests to process
+   * @return The responses, in the order of the requests. A null response passes the request to
+   *  the next middleware
+   */
+  virtual vector<unique_ptr<Response>> handleBatch(span<ServerRequest *> requests) = 0;
+};
+
+/**
+ * Groups the requests reaching the middleware on a worker and passes them to a batch handler. A
+ * batch gathers the requests of an iteration of the worker's event loop, or of a time window, up to
+ * a maximum size. Each request is suspended until its batch is processed, then resumes with its
+ * own response.
+ *
+ * The batch handler runs on the workers, possibly on several of them at the same time.
+ */
+class Batching : public AsyncMiddleware {
+protected:
+  struct Entry {
+    ServerRequest *request;
+    unique_ptr<Response> response;
+    exception_ptr exception;
+    coroutine_handle<> handle;
+  };
+
+  /**
+   * The requests waiting for a worker's next batch.
+   */
+  struct Batch {
+    vector<Entry *> entries;
+    /// Identifies the current batch, so that a batch is only flushed once.
+    uint64_t id = 0;
+  };
+
+  class BatchAwaiter {
+  protected:
+    Batching &batching_;
+    Entry entry_;
+
+  public:
+    BatchAwaiter(Batching &batching, ServerRequest &request)
+      : batching_(batching), entry_{&request, nullptr, nullptr, nullptr} {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+      this->entry_.handle = handle;
+      this->batching_.add(this->entry_);
+    }
+
+    unique_ptr<Response> await_resume() {
+      if (this->entry_.exception) {
+        rethrow_exception(this->entry_.exception);
+      }
+      return move(this->entry_.response);
+    }
+  };
+
+  shared_ptr<BatchRequestHandler> handler_;
+  chrono::microseconds window_;
+  size_t max_batch_size_;
+  mutex lock_;
+  unordered_map<net::EventLoop *, Batch> batches_;
+
+  void add(Entry &entry) {
+    auto &loop = net::EventLoop::require();
+    this->lock_.lock();
+    auto &batch = this->batches_[&loop];
+    batch.entries.push_back(&entry);
+    auto size = batch.entries.size();
+    auto id = batch.id;
+    this->lock_.unlock();
+    auto flush = [this, &loop, id] {
+      this->flush(loop, id);
+    };
+    if (size == this->max_batch_size_ || (size == 1 && this->window_.count() == 0)) {
+      loop.defer(move(flush));
+    } else if (size == 1) {
+      loop.addTimer(this->window_, move(flush));
+    }
+  }
+
+  void flush(net::EventLoop &loop, uint64_t id) {
+    this->lock_.lock();
+    auto &batch = this->batches_[&loop];
+    if (batch.id != id) {
+      this->lock_.unlock();
+      return;
+    }
+    auto entries = move(batch.entries);
+    batch.entries.clear();
+    batch.id++;
+    this->lock_.unlock();
+
+    vector<ServerRequest *> requests;
+    requests.reserve(entries.size());
+    for (auto entry : entries) {
+      requests.push_back(entry->request);
+    }
+    for (size_t begin = 0; begin < entries.size(); begin += this->max_batch_size_) {
+      auto count = min(this->max_batch_size_, entries.size() - begin);
+      try {
+        auto responses = this->handler_->handleBatch(span(requests).subspan(begin, count));
+        if (responses.size() != count) {
+          throw utils::RuntimeException("Batch handler returned %zu responses for %zu requests",
+                                        responses.size(), count);
+        }
+        for (size_t i = 0; i < count; i++) {
+          entries[begin + i]->response = move(responses[i]);
+        }
+      } catch (...) {
+        for (size_t i = 0; i < count; i++) {
+          entries[begin + i]->exception = current_exception();
+        }
+      }
+    }
+    // Resuming a request may destroy its entry.
+    vector<coroutine_handle<>> handles;
+    handles.reserve(entries.size());
+    for (auto entry : entries) {
+      handles.push_back(entry->handle);
+    }
+    for (auto handle : handles) {
+      handle.resume();
+    }
+  }
+
+public:
+  /**
+   * @param handler The batch handler
+   * @param window The time a batch waits for requests, 0 to only gather the requests of an
+   *  iteration of the event loop
+   * @param max_batch_size The maximum number of requests in a batch
+   */
+  explicit Batching(shared_ptr<BatchRequestHandler> handler,
+                    chrono::microseconds window = chrono::microseconds(0),
+                    size_t max_batch_size = 64)
+    : handler_(move(handler)), window_(window), max_batch_size_(max_batch_size) {
+  }
+
+  response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) override {
+    auto response = co_await BatchAwaiter(*this, request);
+    if (!response) {
+      response = co_await handler.handleAsync(request);
+    }
+    co_return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_BATCH_H
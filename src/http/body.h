@@ -0,0 +1,160 @@
+#ifndef HTTP_BODY_H
+#define HTTP_BODY_H
+
+#include "../utils/file.h"
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace http {
+/**
+ * A contiguous range of bytes of a message body held outside of the body stream. The bytes are
+ * either a memory region or a region of an open file, kept alive by a shared owner so that
+ * segments can be sliced and sent without copying the data.
+ */
+class BodySegment {
+protected:
+  shared_ptr<const void> owner_;
+  const char *data_;
+  const utils::File *file_;
+  size_t offset_;
+  size_t length_;
+
+  BodySegment(shared_ptr<const void> &&owner, const char *data, const utils::File *file,
+              size_t offset, size_t length)
+    : owner_(move(owner)), data_(data), file_(file), offset_(offset), length_(length) {
+  }
+
+public:
+  /**
+   * Creates a segment owning a string.
+   * @param buffer The content of the segment
+   */
+  static BodySegment fromString(string &&buffer) {
+    return BodySegment::fromBuffer(make_shared<const string>(move(buffer)));
+  }
+
+  /**
+   * Creates a segment sharing a buffer.
+   * @param buffer The content of the segment
+   */
+  static BodySegment fromBuffer(shared_ptr<const string> buffer) {
+    auto data = buffer->data();
+    auto length = buffer->size();
+    return BodySegment(move(buffer), data, nullptr, 0, length);
+  }
+
+  /**
+   * Creates a segment for a memory region.
+   * @param owner The object keeping the memory region alive
+   * @param data The start of the region
+   * @param length The length of the region
+   */
+  static BodySegment fromMemory(shared_ptr<const void> owner, const char *data, size_t length) {
+    return BodySegment(move(owner), data, nullptr, 0, length);
+  }
+
+  /**
+   * Creates a segment for a region of a file.
+   * @param file The file
+   * @param offset The start of the region in the file
+   * @param length The length of the region
+   */
+  static BodySegment fromFile(shared_ptr<const utils::File> file, size_t offset, size_t length) {
+    auto file_ptr = file.get();
+    return BodySegment(move(file), nullptr, file_ptr, offset, length);
+  }
+
+  /**
+   * Creates a segment for a whole file.
+   * @param file The file
+   */
+  static BodySegment fromFile(shared_ptr<const utils::File> file) {
+    auto length = file->getSize();
+    return BodySegment::fromFile(move(file), 0, length);
+  }
+
+  /**
+   * @return Whether the bytes of the segment are in a file
+   */
+  bool isFile() const {
+    return this->file_ != nullptr;
+  }
+
+  /**
+   * @return The start of the memory region, nullptr for a file segment
+   */
+  const char *getData() const {
+    return this->data_;
+  }
+
+  /**
+   * @return The file of the segment, nullptr for a memory segment
+   */
+  const utils::File *getFile() const {
+    return this->file_;
+  }
+
+  /**
+   * @return The start of the region in the file, 0 for a memory segment
+   */
+  size_t getOffset() const {
+    return this->offset_;
+  }
+
+  size_t getLength() const {
+    return this->length_;
+  }
+
+  /**
+   * Creates a segment for a part of this segment, sharing the same owner.
+   * @param offset The start of the part, relative to the segment
+   * @param length The length of the part, truncated to the end of the segment
+   * @return The new segment
+   * @throw out_of_range Thrown if the offset is beyond the end of the segment
+   */
+  BodySegment slice(size_t offset, size_t length) const {
+    if (offset > this->length_) {
+      throw out_of_range("Segment slice out of range");
+    }
+    length = min(length, this->length_ - offset);
+    if (this->isFile()) {
+      return BodySegment(shared_ptr<const void>(this->owner_), nullptr, this->file_,
+                         this->offset_ + offset, length);
+    }
+    return BodySegment(shared_ptr<const void>(this->owner_), this->data_ + offset, nullptr, 0,
+                       length);
+  }
+};
+
+typedef vector<BodySegment> body_segments_t;
+
+/**
+ * Slices a list of segments.
+ * @param segments The segments of a body
+ * @param offset The start of the range, relative to the body
+ * @param length The length of the range
+ * @param out The output container for the segments covering the range
+ */
+inline void sliceBodySegments(const body_segments_t &segments, size_t offset, size_t length,
+                              body_segments_t &out) {
+  for (const auto &segment : segments) {
+    if (length == 0) {
+      break;
+    }
+    if (offset >= segment.getLength()) {
+      offset -= segment.getLength();
+      continue;
+    }
+    out.push_back(segment.slice(offset, length));
+    length -= out.back().getLength();
+    offset = 0;
+  }
+}
+} // namespace http
+
+#endif //HTTP_BODY_H
@@ -0,0 +1,343 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include "application.h"
+#include "messages.h"
+#include "../utils/lru.h"
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+namespace http {
+/**
+ * Decides which requests and responses may be cached, for how long, and under which key.
+ */
+class CachePolicy {
+protected:
+  chrono::seconds ttl_;
+  chrono::seconds stale_ttl_;
+  vector<string> vary_;
+
+  /**
+   * Parses a delta-seconds directive value.
+   */
+  static bool parseSeconds(const string &value, chrono::seconds &out) {
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+      return false;
+    }
+    try {
+      out = chrono::seconds(stoll(value));
+    } catch (out_of_range &) {
+      return false;
+    }
+    return true;
+  }
+
+public:
+  /**
+   * @param ttl The time a response is fresh, unless the response specifies a max-age
+   * @param stale_ttl The time a response may be served once stale while it is refreshed, unless
+   *  the response specifies a stale-while-revalidate directive
+   */
+  explicit CachePolicy(chrono::seconds ttl = chrono::seconds(60),
+                       chrono::seconds stale_ttl = chrono::seconds(30))
+    : ttl_(ttl), stale_ttl_(stale_ttl) {
+  }
+
+  /**
+   * Adds a request header whose value selects between different cached responses for the same
+   * URI. Responses varying on other headers are not cached.
+   * @param name The name of the header
+   */
+  void addVaryHeader(const string &name) {
+    this->vary_.push_back(utils::tolower(name));
+  }
+
+  /**
+   * @return Whether a response to the request may be looked up and stored
+   */
+  bool isCacheable(const ServerRequest &request) const {
+    if (request.getMethod() != Request::Method::METHOD::GET ||
+        request.getState() != ServerRequest::STATE::BODY ||
+        request.hasHeader("Authorization")) {
+      return false;
+    }
+    if (request.hasHeader("Cache-Control")) {
+      for (const auto &line : request.getHeader("Cache-Control")) {
+        if (utils::tolower(line).find("no-store") != string::npos) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @return The key of the responses to the request
+   */
+  string makeKey(const ServerRequest &request) const {
+    string key = static_cast<const char *>(request.getMethod());
+    key += ' ';
+    key += string(request.getUri());
+    for (const auto &name : this->vary_) {
+      key += '\n';
+      key += name;
+      key += ':';
+      if (request.hasHeader(name)) {
+        for (const auto &value : request.getHeader(name)) {
+          key += value;
+          key += ',';
+        }
+      }
+    }
+    return key;
+  }
+
+  /**
+   * @return Whether responses with a status may be cached
+   */
+  static bool isStatusCacheable(const Response::Status &status) {
+    switch (int(status)) {
+      case Response::Status::OK:
+      case Response::Status::NON_AUTHORITATIVE_INFORMATION:
+      case Response::Status::NO_CONTENT:
+      case Response::Status::MOVED_PERMANENTLY:
+      case Response::Status::NOT_FOUND:
+      case Response::Status::GONE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * @return Whether a response only varies on request headers that are part of the keys
+   */
+  bool isVaryCovered(const Response &response) const {
+    if (!response.hasHeader("Vary")) {
+      return true;
+    }
+    for (const auto &line : response.getHeader("Vary")) {
+      for (const auto &name : utils::split(utils::tolower(line), ',')) {
+        auto trimmed = utils::trim(name);
+        if (trimmed == "*" ||
+            find(this->vary_.begin(), this->vary_.end(), trimmed) == this->vary_.end()) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Computes how long a response may be cached.
+   * @param response The response
+   * @param ttl The output for the time the response is fresh
+   * @param stale_ttl The output for the time the response may be served once stale
+   * @return Whether the response may be stored
+   */
+  bool getLifetime(const Response &response, chrono::seconds &ttl,
+                   chrono::seconds &stale_ttl) const {
+    if (!CachePolicy::isStatusCacheable(response.getStatus()) ||
+        response.hasHeader("Set-Cookie") || !this->isVaryCovered(response)) {
+      return false;
+    }
+    ttl = this->ttl_;
+    stale_ttl = this->stale_ttl_;
+    if (!response.hasHeader("Cache-Control")) {
+      return true;
+    }
+    auto shared_max_age = false;
+    for (const auto &line : response.getHeader("Cache-Control")) {
+      for (const auto &directive : utils::split(utils::tolower(line), ',')) {
+        auto trimmed = utils::trim(directive);
+        auto equal = trimmed.find('=');
+        auto name = trimmed.substr(0, equal);
+        auto value = equal == string::npos ? string() : trimmed.substr(equal + 1);
+        if (name == "no-store" || name == "no-cache" || name == "private") {
+          return false;
+        }
+        if (name == "s-maxage") {
+          if (!CachePolicy::parseSeconds(value, ttl)) {
+            return false;
+          }
+          shared_max_age = true;
+        } else if (name == "max-age" && !shared_max_age) {
+          if (!CachePolicy::parseSeconds(value, ttl)) {
+            return false;
+          }
+        } else if (name == "stale-while-revalidate") {
+          if (!CachePolicy::parseSeconds(value, stale_ttl)) {
+            return false;
+          }
+        }
+      }
+    }
+    return ttl.count() > 0;
+  }
+};
+
+/**
+ * A response as stored by a cache, with its head already serialized.
+ */
+struct CachedResponse {
+  Response::Status status;
+  BodySegment head;
+  body_segments_t body;
+  chrono::steady_clock::time_point fresh_until;
+  chrono::steady_clock::time_point stale_until;
+  /// Set while a refresh of the entry is in progress.
+  mutable atomic<bool> refreshing;
+  size_t cost;
+
+  CachedResponse(Response::Status status, BodySegment &&head, body_segments_t &&body)
+    : status(status), head(move(head)), body(move(body)), refreshing(false), cost(0) {
+  }
+
+  /**
+   * Creates a response sharing the head and the body of the entry.
+   */
+  unique_ptr<Response> makeResponse() const {
+    auto response = make_unique<Response>(this->status);
+    response->setBodySegments(body_segments_t(this->body));
+    response->setSerializedHead(BodySegment(this->head));
+    return response;
+  }
+};
+
+/**
+ * Caches the responses of the next middleware in memory. Entries are kept in a lock-striped LRU
+ * bounded by their size. Hits are answered without running the next middleware and reuse the
+ * serialized head and the body buffers of the entry. A stale entry keeps being served while a
+ * single copy of a request refreshes it in the background, once the request is answered: the
+ * copy goes through the middleware of the server again (see RequestDispatcher).
+ *
+ * Responses with a file-backed body are not cached, as they are already sent without copy.
+ */
+class ResponseCache : public Middleware {
+protected:
+  typedef shared_ptr<const CachedResponse> entry_t;
+  /// The stale entry refreshed by a copy of a request.
+  inline static const AttributeKey<entry_t> REFRESHED_ENTRY{"_refreshed_entry"};
+  CachePolicy policy_;
+  utils::ShardedLruCache<string, entry_t> entries_;
+  size_t max_entry_size_;
+
+  /**
+   * Stores a response if the policy allows it.
+   * @return Whether the response was stored
+   */
+  bool store(const string &key, Response &response) {
+    chrono::seconds ttl, stale_ttl;
+    if (!this->policy_.getLifetime(response, ttl, stale_ttl)) {
+      return false;
+    }
+    size_t body_length = 0;
+    for (const auto &segment : response.toBodySegments()) {
+      if (segment.isFile()) {
+        return false;
+      }
+      body_length += segment.getLength();
+    }
+    if (body_length > this->max_entry_size_) {
+      return false;
+    }
+    auto head = response.serializeHead();
+    auto entry = make_shared<CachedResponse>(response.getStatus(), move(head),
+                                             body_segments_t(response.getBodySegments()));
+    auto now = chrono::steady_clock::now();
+    entry->fresh_until = now + ttl;
+    entry->stale_until = entry->fresh_until + stale_ttl;
+    entry->cost = sizeof(CachedResponse) + key.size() + entry->head.getLength() + body_length;
+    return this->entries_.put(key, entry, entry->cost);
+  }
+
+  /**
+   * Refreshes a stale entry once the request that found it is answered, by dispatching a copy of
+   * the request through the middleware of the server again. The entry is dropped instead if the
+   * request is not processed by a server, so that the next request replaces it.
+   */
+  void refresh(const string &key, const entry_t &entry, const ServerRequest &request) {
+    auto dispatcher = request.getDispatcher();
+    if (!dispatcher) {
+      this->entries_.erase(key, entry);
+      return;
+    }
+    auto copy = make_unique<ServerRequest>(request);
+    copy->emplaceAttribute(REFRESHED_ENTRY, entry);
+    // The flag is also reset if a middleware preceding the cache answers the copy.
+    dispatcher->dispatch(move(copy), [entry](unique_ptr<Response>) {
+      entry->refreshing = false;
+    });
+  }
+
+  /**
+   * Runs the rest of the middleware on a request refreshing a stale entry, and replaces the entry.
+   */
+  unique_ptr<Response> processRefresh(const string &key, const entry_t &entry,
+                                      ServerRequest &request, RequestHandler &handler) {
+    unique_ptr<Response> response;
+    try {
+      response = handler.handle(request);
+    } catch (...) {
+      this->entries_.erase(key, entry);
+      throw;
+    }
+    if (!response || !this->store(key, *response)) {
+      this->entries_.erase(key, entry);
+    }
+    return response;
+  }
+
+public:
+  /**
+   * @param capacity The maximum memory used by the entries in bytes
+   * @param policy The caching policy
+   * @param max_entry_size The maximum size of a cached body in bytes
+   * @param shard_count The number of independently locked parts of the cache
+   */
+  explicit ResponseCache(size_t capacity = 64u << 20u, CachePolicy policy = CachePolicy(),
+                         size_t max_entry_size = 1u << 20u, size_t shard_count = 16)
+    : policy_(move(policy)), entries_(capacity, shard_count), max_entry_size_(max_entry_size) {
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    if (!this->policy_.isCacheable(request)) {
+      return handler.handle(request);
+    }
+    auto key = this->policy_.makeKey(request);
+    if (auto refreshed = request.findAttribute(REFRESHED_ENTRY)) {
+      return this->processRefresh(key, *refreshed, request, handler);
+    }
+    entry_t entry;
+    if (this->entries_.get(key, entry)) {
+      auto now = chrono::steady_clock::now();
+      if (now < entry->fresh_until) {
+        return entry->makeResponse();
+      }
+      if (now < entry->stale_until) {
+        if (!entry->refreshing.exchange(true)) {
+          this->refresh(key, entry, request);
+        }
+        return entry->makeResponse();
+      }
+      this->entries_.erase(key, entry);
+    }
+    auto response = handler.handle(request);
+    if (response) {
+      this->store(key, *response);
+    }
+    return response;
+  }
+
+  /**
+   * @return The memory used by the entries in bytes
+   */
+  size_t getSize() const {
+    return this->entries_.getCost();
+  }
+};
+} // namespace http
+
+#endif //HTTP_CACHE_H
@@ -0,0 +1,127 @@
+#ifndef HTTP_CANCELLATION_H
+#define HTTP_CANCELLATION_H
+
+#include "../utils/exception.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+using namespace std;
+
+namespace http {
+/**
+ * Tells whether the response to a request is still awaited. A request is cancelled once its
+ * client disconnects, or once its deadline is passed. Middleware, and work offloaded from it, can
+ * check the cancellation to stop processing a request early.
+ *
+ * The cancellation can be checked from any thread.
+ */
+class Cancellation {
+public:
+  typedef chrono::steady_clock clock_t;
+
+  enum class REASON {
+    NONE,
+    DISCONNECTED,
+    DEADLINE_EXCEEDED
+  };
+
+protected:
+  /// Updated when the deadline is found passed, hence mutable.
+  mutable atomic<REASON> reason_;
+  /// The deadline, as a count of clock ticks.
+  atomic<clock_t::rep> deadline_;
+
+  static constexpr clock_t::rep NO_DEADLINE = numeric_limits<clock_t::rep>::max();
+
+public:
+  Cancellation() : reason_(REASON::NONE), deadline_(NO_DEADLINE) {
+  }
+
+  Cancellation(const Cancellation &other) = delete;
+  Cancellation &operator=(const Cancellation &other) = delete;
+
+  /**
+   * @return Whether the request is cancelled
+   */
+  bool isCancelled() const {
+    return this->getReason() != REASON::NONE;
+  }
+
+  /**
+   * @return The reason of the cancellation, NONE if the request is not cancelled
+   */
+  REASON getReason() const {
+    auto reason = this->reason_.load(memory_order_acquire);
+    if (reason == REASON::NONE && this->hasDeadline() && clock_t::now() >= this->getDeadline()) {
+      this->reason_.compare_exchange_strong(reason, REASON::DEADLINE_EXCEEDED);
+      return this->reason_.load(memory_order_acquire);
+    }
+    return reason;
+  }
+
+  /**
+   * @throw utils::RuntimeException Thrown if the request is cancelled
+   */
+  void throwIfCancelled() const {
+    switch (this->getReason()) {
+      case REASON::NONE:
+        return;
+      case REASON::DISCONNECTED:
+        throw utils::RuntimeException("Client disconnected");
+      case REASON::DEADLINE_EXCEEDED:
+        throw utils::RuntimeException("Request deadline exceeded");
+    }
+  }
+
+  /**
+   * Cancels the request, unless it is already cancelled.
+   */
+  void cancel(REASON reason) {
+    auto none = REASON::NONE;
+    this->reason_.compare_exchange_strong(none, reason, memory_order_acq_rel);
+  }
+
+  bool hasDeadline() const {
+    return this->deadline_.load(memory_order_relaxed) != NO_DEADLINE;
+  }
+
+  /**
+   * @return The deadline of the request, time_point::max() if there is none
+   */
+  clock_t::time_point getDeadline() const {
+    return clock_t::time_point(clock_t::duration(this->deadline_.load(memory_order_relaxed)));
+  }
+
+  /**
+   * @return The time left before the deadline, zero once it is passed
+   */
+  clock_t::duration getRemaining() const {
+    auto deadline = this->getDeadline();
+    auto now = clock_t::now();
+    return deadline > now ? deadline - now : clock_t::duration::zero();
+  }
+
+  /**
+   * Sets the deadline of the request, unless it has an earlier one.
+   */
+  void setDeadline(clock_t::time_point deadline) {
+    auto ticks = deadline.time_since_epoch().count();
+    auto current = this->deadline_.load(memory_order_relaxed);
+    while (ticks < current && !this->deadline_.compare_exchange_weak(current, ticks)) {
+    }
+  }
+
+  /**
+   * Makes the cancellation reusable for another request. The previous request must not be
+   * processed anymore.
+   */
+  void reset() {
+    this->reason_ = REASON::NONE;
+    this->deadline_ = NO_DEADLINE;
+  }
+};
+} // namespace http
+
+#endif //HTTP_CANCELLATION_H
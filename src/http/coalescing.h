@@ -0,0 +1,222 @@
+#ifndef HTTP_COALESCING_H
+#define HTTP_COALESCING_H
+
+#include "async.h"
+#include "cache.h"
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace http {
+/**
+ * Coalesces identical concurrent requests: while a request is processed by the next middleware,
+ * the requests with the same key, as given by a cache policy, wait for it instead of reaching the
+ * next middleware. They then share its response, whose serialized head and body buffers are shared
+ * rather than copied. The waiting requests are suspended, and resume on their own workers.
+ *
+ * The response is shared as long as it is not specific to the client (Set-Cookie, private or
+ * no-store), has a cacheable status, and does not vary on request headers the policy does not
+ * vary on, such as Accept-Encoding when a compression middleware follows. Otherwise, the waiting
+ * requests are processed separately. Requests for ranges are never coalesced. If the first
+ * request fails, the waiting requests fail as well, unless it was cancelled, in which case one of
+ * them is processed in its stead.
+ *
+ * The middleware is shared by the workers.
+ */
+class Coalescing : public AsyncMiddleware {
+protected:
+  enum class OUTCOME {
+    PENDING,
+    SHARED,
+    NOT_SHAREABLE,
+    FAILED,
+    CANCELLED
+  };
+
+  struct Waiter {
+    net::EventLoop *loop;
+    coroutine_handle<> handle;
+  };
+
+  /**
+   * The processing of a request awaited by identical requests.
+   */
+  struct Flight {
+    mutex lock;
+    OUTCOME outcome = OUTCOME::PENDING;
+    shared_ptr<const CachedResponse> response;
+    exception_ptr exception;
+    vector<Waiter> waiters;
+  };
+
+  struct Shard {
+    mutex lock;
+    unordered_map<string, shared_ptr<Flight>> flights;
+  };
+
+  class FlightAwaiter {
+  protected:
+    Flight &flight_;
+
+  public:
+    explicit FlightAwaiter(Flight &flight) : flight_(flight) {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    bool await_suspend(coroutine_handle<> handle) {
+      lock_guard<mutex> guard(this->flight_.lock);
+      if (this->flight_.outcome != OUTCOME::PENDING) {
+        return false;
+      }
+      this->flight_.waiters.push_back({&net::EventLoop::require(), handle});
+      return true;
+    }
+
+    OUTCOME await_resume() const {
+      return this->flight_.outcome;
+    }
+  };
+
+  CachePolicy policy_;
+  vector<Shard> shards_;
+
+  Shard &getShard(const string &key) {
+    return this->shards_[hash<string>()(key) % this->shards_.size()];
+  }
+
+  /**
+   * Finds the flight of a key, or starts one.
+   * @return The flight, and whether it was started
+   */
+  pair<shared_ptr<Flight>, bool> join(const string &key) {
+    auto &shard = this->getShard(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto &flight = shard.flights[key];
+    if (flight) {
+      return {flight, false};
+    }
+    flight = make_shared<Flight>();
+    return {flight, true};
+  }
+
+  /**
+   * Ends a flight and resumes the requests waiting for it.
+   */
+  void land(const string &key, Flight &flight, OUTCOME outcome,
+            shared_ptr<const CachedResponse> response, exception_ptr exception) {
+    // Requests arriving from now on start a new flight.
+    auto &shard = this->getShard(key);
+    shard.lock.lock();
+    shard.flights.erase(key);
+    shard.lock.unlock();
+
+    flight.lock.lock();
+    flight.outcome = outcome;
+    flight.response = move(response);
+    flight.exception = move(exception);
+    auto waiters = move(flight.waiters);
+    flight.lock.unlock();
+    for (const auto &waiter : waiters) {
+      auto handle = waiter.handle;
+      waiter.loop->post([handle] {
+        handle.resume();
+      });
+    }
+  }
+
+  /**
+   * @return Whether a response may be given to other clients, whose requests only match the first
+   *  one on the headers the policy varies on
+   */
+  bool isShareable(const Response &response) const {
+    if (!CachePolicy::isStatusCacheable(response.getStatus()) ||
+        response.hasHeader("Set-Cookie") || !this->policy_.isVaryCovered(response)) {
+      return false;
+    }
+    if (response.hasHeader("Cache-Control")) {
+      for (const auto &line : response.getHeader("Cache-Control")) {
+        auto directives = utils::tolower(line);
+        if (directives.find("private") != string::npos ||
+            directives.find("no-store") != string::npos) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Processes a request with the next middleware for the requests waiting for it.
+   */
+  response_task_t lead(const string &key, Flight &flight, ServerRequest &request,
+                       AsyncRequestHandler &handler) {
+    unique_ptr<Response> response;
+    try {
+      response = co_await handler.handleAsync(request);
+    } catch (...) {
+      this->land(key, flight, request.getCancellation().isCancelled() ? OUTCOME::CANCELLED
+                                                                      : OUTCOME::FAILED,
+                 nullptr, current_exception());
+      throw;
+    }
+    if (!response) {
+      this->land(key, flight, OUTCOME::FAILED, nullptr, nullptr);
+    } else if (!this->isShareable(*response)) {
+      this->land(key, flight, OUTCOME::NOT_SHAREABLE, nullptr, nullptr);
+    } else {
+      response->toBodySegments();
+      auto head = response->serializeHead();
+      this->land(key, flight, OUTCOME::SHARED,
+                 make_shared<CachedResponse>(response->getStatus(), move(head),
+                                             body_segments_t(response->getBodySegments())),
+                 nullptr);
+    }
+    co_return response;
+  }
+
+public:
+  /**
+   * @param policy The policy deciding which requests are coalesced, and their keys
+   * @param shard_count The number of independently locked parts of the table of the requests in
+   *  progress
+   */
+  explicit Coalescing(CachePolicy policy = CachePolicy(), size_t shard_count = 16)
+    : policy_(move(policy)), shards_(max<size_t>(shard_count, 1)) {
+  }
+
+  response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) override {
+    // Partial responses depend on the requested ranges, which are not part of the key.
+    if (!this->policy_.isCacheable(request) || request.hasHeader("Range")) {
+      co_return co_await handler.handleAsync(request);
+    }
+    auto key = this->policy_.makeKey(request);
+    while (true) {
+      auto [flight, leader] = this->join(key);
+      if (leader) {
+        co_return co_await this->lead(key, *flight, request, handler);
+      }
+      switch (co_await FlightAwaiter(*flight)) {
+        case OUTCOME::SHARED:
+          co_return flight->response->makeResponse();
+        case OUTCOME::NOT_SHAREABLE:
+          co_return co_await handler.handleAsync(request);
+        case OUTCOME::FAILED:
+          if (flight->exception) {
+            rethrow_exception(flight->exception);
+          }
+          co_return nullptr;
+        default:
+          // The first request was cancelled, another one takes over.
+          break;
+      }
+    }
+  }
+};
+} // namespace http
+
+#endif //HTTP_COALESCING_H
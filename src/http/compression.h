@@ -0,0 +1,313 @@
+#ifndef HTTP_COMPRESSION_H
+#define HTTP_COMPRESSION_H
+
+#include "application.h"
+#include "messages.h"
+#include "negotiation.h"
+#include "../utils/compression.h"
+#include "../utils/lru.h"
+#include <cstring>
+
+using namespace std;
+
+namespace http {
+/**
+ * Compresses the bodies of the responses of the next middleware according to the Accept-Encoding
+ * header of the request. Bodies are fed to a streaming encoder segment by segment, file-backed
+ * segments in chunks, and the output is split in segments, so that no buffer holds a whole body.
+ *
+ * The compressed bodies of responses that may be stored by shared caches are kept in a
+ * lock-striped LRU, keyed by the coding, the request (its method, its URI and the headers the
+ * response varies on) and the strong ETag of the response, or a hash of its content if it has
+ * none. Hot responses are thus compressed once. The content of bodies without a strong ETag is
+ * kept with their compressed body, and compared with the body of the response on a hit, so that
+ * hash collisions cannot serve another body. File-backed bodies are only compressed if the result
+ * can be kept, so that a strong ETag and a size within the limit of an entry are required: the
+ * others are sent as they are, without copy.
+ */
+class Compression : public Middleware {
+protected:
+  static constexpr size_t CHUNK_SIZE = 64u << 10u;
+
+  struct Entry {
+    /// The uncompressed body, if no strong ETag identifies it.
+    string source;
+    body_segments_t body;
+  };
+
+  typedef shared_ptr<const Entry> entry_t;
+  vector<string> codings_;
+  size_t min_size_;
+  int level_;
+  utils::ShardedLruCache<string, entry_t> entries_;
+  size_t max_entry_size_;
+
+  /**
+   * @return The lower-cased values of a header joined by commas, empty if the header is absent
+   */
+  static string getValues(const Response &response, const string &name) {
+    string values;
+    if (response.hasHeader(name)) {
+      for (const auto &value : response.getHeader(name)) {
+        if (!values.empty()) {
+          values += ',';
+        }
+        values += utils::tolower(value);
+      }
+    }
+    return values;
+  }
+
+  static bool isCompressible(const Response &response) {
+    if (!response.hasHeader("Content-Type") || response.getHeader("Content-Type").empty()) {
+      return false;
+    }
+    auto type = utils::tolower(response.getHeader("Content-Type").front());
+    type = utils::trim(type.substr(0, type.find(';')));
+    if (type.rfind("text/", 0) == 0) {
+      return true;
+    }
+    static const vector<string> suffixes = {"json", "javascript", "xml", "wasm", "x-font-ttf",
+                                            "vnd.ms-fontobject"};
+    for (const auto &suffix : suffixes) {
+      if (type.size() > suffix.size() &&
+          type.compare(type.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        auto separator = type[type.size() - suffix.size() - 1];
+        if (separator == '/' || separator == '+') {
+          return true;
+        }
+      }
+    }
+    return type == "image/svg+xml" || type == "image/x-icon";
+  }
+
+  /**
+   * @return Whether the compressed body of the response may be shared between requests
+   */
+  static bool isShareable(const Response &response) {
+    if (response.hasHeader("Set-Cookie")) {
+      return false;
+    }
+    auto cache_control = Compression::getValues(response, "Cache-Control");
+    return cache_control.find("no-store") == string::npos &&
+           cache_control.find("private") == string::npos;
+  }
+
+  static bool isFileBacked(const Response &response) {
+    for (const auto &segment : response.getBodySegments()) {
+      if (segment.isFile()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool hasStrongETag(const Response &response) {
+    return response.hasHeader("ETag") && !response.getHeader("ETag").empty() &&
+           response.getHeader("ETag").front().rfind("W/", 0) != 0;
+  }
+
+  /**
+   * @return The key of the compressed body, empty if the response varies on the whole request or
+   *  the key cannot be computed without reading files
+   */
+  static string makeKey(const string &coding, const ServerRequest &request,
+                        const Response &response) {
+    auto vary = Compression::getValues(response, "Vary");
+    if (vary.find('*') != string::npos) {
+      return "";
+    }
+    string key = coding;
+    key += ' ';
+    key += static_cast<const char *>(request.getMethod());
+    key += ' ';
+    key += string(request.getUri());
+    for (const auto &name : utils::split(vary, ',')) {
+      auto trimmed = utils::trim(name);
+      // The coding is already part of the key.
+      if (trimmed.empty() || trimmed == "accept-encoding") {
+        continue;
+      }
+      key += '\n';
+      key += trimmed;
+      key += ':';
+      if (request.hasHeader(trimmed)) {
+        for (const auto &value : request.getHeader(trimmed)) {
+          key += value;
+          key += ',';
+        }
+      }
+    }
+    key += '\n';
+    if (Compression::hasStrongETag(response)) {
+      return key + response.getHeader("ETag").front();
+    }
+    if (Compression::isFileBacked(response)) {
+      return "";
+    }
+    for (const auto &segment : response.getBodySegments()) {
+      key += to_string(utils::hash64(segment.getData(), segment.getLength()));
+      key += ':';
+      key += to_string(segment.getLength());
+      key += ',';
+    }
+    return key;
+  }
+
+  /**
+   * @return Whether a body held in memory is made of some content
+   */
+  static bool isEqual(const body_segments_t &body, const string &content) {
+    size_t offset = 0;
+    for (const auto &segment : body) {
+      if (segment.getLength() > content.size() - offset ||
+          memcmp(segment.getData(), content.data() + offset, segment.getLength()) != 0) {
+        return false;
+      }
+      offset += segment.getLength();
+    }
+    return offset == content.size();
+  }
+
+  /**
+   * Compresses a body.
+   * @return The compressed body
+   */
+  body_segments_t compress(const string &coding, const body_segments_t &body) const {
+    auto encoder = utils::Encoder::create(coding, this->level_);
+    body_segments_t output;
+    string chunk;
+    auto flush = [&output, &chunk](bool force) {
+      if (chunk.size() >= CHUNK_SIZE || (force && !chunk.empty())) {
+        output.push_back(BodySegment::fromString(move(chunk)));
+        chunk = string();
+      }
+    };
+    unique_ptr<char[]> buffer;
+    for (const auto &segment : body) {
+      if (!segment.isFile()) {
+        for (size_t offset = 0; offset < segment.getLength(); offset += CHUNK_SIZE) {
+          auto length = min(CHUNK_SIZE, segment.getLength() - offset);
+          encoder->write(segment.getData() + offset, length, chunk);
+          flush(false);
+        }
+        continue;
+      }
+      if (!buffer) {
+        buffer = make_unique<char[]>(CHUNK_SIZE);
+      }
+      for (size_t offset = 0; offset < segment.getLength();) {
+        auto length = min(CHUNK_SIZE, segment.getLength() - offset);
+        auto read = segment.getFile()->read(buffer.get(), length, segment.getOffset() + offset);
+        if (read == 0) {
+          throw utils::RuntimeException("Unexpected end of %s",
+                                        segment.getFile()->getPath().c_str());
+        }
+        encoder->write(buffer.get(), read, chunk);
+        flush(false);
+        offset += read;
+      }
+    }
+    encoder->finish(chunk);
+    flush(true);
+    return output;
+  }
+
+public:
+  /**
+   * @param min_size The minimum size of a body to compress it in bytes
+   * @param level The compression level, -1 for the default level of each coding
+   * @param capacity The maximum memory used by the kept compressed bodies in bytes
+   * @param max_entry_size The maximum size of a kept compressed body in bytes
+   */
+  explicit Compression(size_t min_size = 1024, int level = -1, size_t capacity = 16u << 20u,
+                       size_t max_entry_size = 1u << 20u)
+    : min_size_(min_size), level_(level), entries_(capacity), max_entry_size_(max_entry_size) {
+    // Preferred codings first.
+    for (const auto &coding : {"br", "gzip"}) {
+      if (utils::Encoder::isSupported(coding)) {
+        this->codings_.emplace_back(coding);
+      }
+    }
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    auto response = handler.handle(request);
+    if (!response || this->codings_.empty() ||
+        request.getMethod() == Request::Method::METHOD::HEAD ||
+        (response->getStatus() != Response::Status::OK &&
+         response->getStatus() != Response::Status::NON_AUTHORITATIVE_INFORMATION) ||
+        response->hasHeader("Content-Encoding") || response->hasHeader("Content-Range") ||
+        !Compression::isCompressible(*response)) {
+      return response;
+    }
+    if (Compression::getValues(*response, "Cache-Control").find("no-transform") != string::npos) {
+      return response;
+    }
+    // The representation depends on the request even when it is not compressed.
+    if (Compression::getValues(*response, "Vary").find("accept-encoding") == string::npos) {
+      response->setAddedHeader("Vary", "Accept-Encoding");
+    }
+    if (response->getBodyLength() < this->min_size_) {
+      return response;
+    }
+    auto coding = AcceptEncoding(request).select(this->codings_);
+    if (coding == "identity") {
+      return response;
+    }
+
+    auto key = Compression::isShareable(*response)
+               ? Compression::makeKey(coding, request, *response) : "";
+    if (Compression::isFileBacked(*response) &&
+        (key.empty() || response->getBodyLength() > this->max_entry_size_)) {
+      // Compressed for each request otherwise, instead of being sent without copy.
+      return response;
+    }
+    auto verified = Compression::hasStrongETag(*response);
+    entry_t entry;
+    if (key.empty() || !this->entries_.get(key, entry) ||
+        (!verified && !Compression::isEqual(response->getBodySegments(), entry->source))) {
+      auto created = make_shared<Entry>();
+      created->body = this->compress(coding, response->getBodySegments());
+      if (!key.empty()) {
+        if (!verified) {
+          created->source.reserve(response->getBodyLength());
+          for (const auto &segment : response->getBodySegments()) {
+            created->source.append(segment.getData(), segment.getLength());
+          }
+        }
+        size_t cost = sizeof(Entry) + key.size() + created->source.size();
+        for (const auto &segment : created->body) {
+          cost += sizeof(BodySegment) + segment.getLength();
+        }
+        if (cost <= this->max_entry_size_) {
+          this->entries_.put(key, created, cost);
+        }
+      }
+      entry = move(created);
+    }
+
+    response->setBodySegments(body_segments_t(entry->body));
+    response->setHeader("Content-Encoding", string(coding));
+    if (response->hasHeader("ETag") && !response->getHeader("ETag").empty()) {
+      // A strong validator identifies the bytes of one representation.
+      auto etag = response->getHeader("ETag").front();
+      if (etag.size() >= 2 && etag.back() == '"') {
+        etag.insert(etag.size() - 1, "-" + coding);
+        response->setHeader("ETag", move(etag));
+      }
+    }
+    response->unsetHeader("Accept-Ranges");
+    return response;
+  }
+
+  /**
+   * @return The memory used by the kept compressed bodies in bytes
+   */
+  size_t getSize() const {
+    return this->entries_.getCost();
+  }
+};
+} // namespace http
+
+#endif //HTTP_COMPRESSION_H
@@ -0,0 +1,261 @@
+#ifndef HTTP_CONCURRENCY_H
+#define HTTP_CONCURRENCY_H
+
+#include "async.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+using namespace std;
+
+namespace http {
+/**
+ * Limits the number of requests processed at the same time by the next middleware, the limit
+ * adapting to their latency with a gradient algorithm: the limit grows while the recent latency of
+ * the requests stays within a tolerance of the minimum latency, and shrinks in proportion when the
+ * latency rises above it, as requests start queuing for resources. This keeps the server near
+ * the concurrency that maximizes its throughput as the cost of the requests changes.
+ *
+ * Requests exceeding the limit wait in a bounded queue, in order of arrival, or are answered with
+ * 503 Service Unavailable once the queue is full. Cancelled requests leave the queue without being
+ * processed, as soon as a slot is freed or another request arrives. The middleware is shared by
+ * the workers.
+ */
+class ConcurrencyLimiter : public AsyncMiddleware {
+protected:
+  struct Waiter {
+    net::EventLoop *loop;
+    coroutine_handle<> handle;
+    const Cancellation *cancellation;
+    bool admitted;
+  };
+
+  class AdmissionAwaiter {
+  protected:
+    ConcurrencyLimiter &limiter_;
+    Waiter waiter_;
+
+  public:
+    AdmissionAwaiter(ConcurrencyLimiter &limiter, const Cancellation &cancellation)
+      : limiter_(limiter), waiter_{nullptr, nullptr, &cancellation, false} {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    bool await_suspend(coroutine_handle<> handle) {
+      this->waiter_.loop = &net::EventLoop::require();
+      this->waiter_.handle = handle;
+      return this->limiter_.enqueue(this->waiter_);
+    }
+
+    /**
+     * @return Whether the request was admitted
+     */
+    bool await_resume() const {
+      return this->waiter_.admitted;
+    }
+  };
+
+  /// The number of samples of a window of the minimum latency.
+  static constexpr size_t WINDOW_SIZE = 1000;
+
+  size_t min_limit_;
+  size_t max_limit_;
+  size_t max_queue_size_;
+  atomic<size_t> limit_;
+  atomic<size_t> in_flight_;
+  mutex lock_;
+  deque<Waiter *> waiters_;
+  /// The ratio of the minimum latency above which latency is considered rising.
+  double tolerance_;
+  double estimated_limit_;
+  /// Recent average latency in seconds, 0 before the first sample.
+  double latency_;
+  double window_min_latency_;
+  double previous_min_latency_;
+  size_t window_samples_;
+
+  bool tryAcquire() {
+    auto in_flight = this->in_flight_.load();
+    while (in_flight < this->limit_.load()) {
+      if (this->in_flight_.compare_exchange_weak(in_flight, in_flight + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Admits a request immediately if the limit allows it and no request waits, or queues it unless
+   * the queue is full.
+   * @return Whether the request waits
+   */
+  bool enqueue(Waiter &waiter) {
+    lock_guard<mutex> guard(this->lock_);
+    this->removeCancelled();
+    // Slots are only released with the lock held, so none can be missed, nor taken from the
+    // waiting requests.
+    if (this->waiters_.empty() && this->tryAcquire()) {
+      waiter.admitted = true;
+      return false;
+    }
+    if (this->waiters_.size() >= this->max_queue_size_) {
+      return false;
+    }
+    this->waiters_.push_back(&waiter);
+    return true;
+  }
+
+  /**
+   * Resumes the cancelled waiting requests, without admitting them. The lock must be held.
+   */
+  void removeCancelled() {
+    auto cancelled = stable_partition(this->waiters_.begin(), this->waiters_.end(),
+                                      [](const Waiter *waiter) {
+                                        return !waiter->cancellation->isCancelled();
+                                      });
+    for (auto position = cancelled; position != this->waiters_.end(); ++position) {
+      auto handle = (*position)->handle;
+      (*position)->loop->post([handle] {
+        handle.resume();
+      });
+    }
+    this->waiters_.erase(cancelled, this->waiters_.end());
+  }
+
+  /**
+   * Resumes the waiting requests while the limit allows it. The lock must be held.
+   */
+  void admitWaiters() {
+    while (!this->waiters_.empty() && this->tryAcquire()) {
+      auto waiter = this->waiters_.front();
+      this->waiters_.pop_front();
+      waiter->admitted = true;
+      auto handle = waiter->handle;
+      waiter->loop->post([handle] {
+        handle.resume();
+      });
+    }
+  }
+
+  /**
+   * Frees the slot of a request that was not processed.
+   */
+  void release() {
+    lock_guard<mutex> guard(this->lock_);
+    this->in_flight_--;
+    this->removeCancelled();
+    this->admitWaiters();
+  }
+
+  /**
+   * Frees the slot of a processed request, updating the limit with its latency.
+   */
+  void release(chrono::steady_clock::duration latency) {
+    lock_guard<mutex> guard(this->lock_);
+    this->in_flight_--;
+    this->update(chrono::duration<double>(latency).count());
+    this->removeCancelled();
+    this->admitWaiters();
+  }
+
+  /**
+   * Updates the limit with the latency of a request. The lock must be held.
+   * @param latency The latency in seconds
+   */
+  void update(double latency) {
+    this->latency_ = this->latency_ == 0 ? latency : this->latency_ * 0.9 + latency * 0.1;
+    // The minimum latency is measured over two windows of samples, so that it follows lasting
+    // changes of the cost of the requests.
+    this->window_min_latency_ = min(this->window_min_latency_, latency);
+    if (++this->window_samples_ == WINDOW_SIZE) {
+      this->previous_min_latency_ = this->window_min_latency_;
+      this->window_min_latency_ = numeric_limits<double>::infinity();
+      this->window_samples_ = 0;
+    }
+    auto min_latency = min(this->previous_min_latency_, this->window_min_latency_);
+    auto gradient = clamp(this->tolerance_ * min_latency / this->latency_, 0.5, 1.0);
+    // The limit is not grown while it is not reached, as the latency tells nothing about it.
+    if (gradient == 1.0 && static_cast<double>(this->in_flight_ * 2) < this->estimated_limit_) {
+      return;
+    }
+    // Headroom allowing the limit to grow while the latency is stable.
+    auto headroom = sqrt(this->estimated_limit_);
+    auto limit = this->estimated_limit_ * gradient + headroom;
+    this->estimated_limit_ = clamp(this->estimated_limit_ * 0.8 + limit * 0.2,
+                                   static_cast<double>(this->min_limit_),
+                                   static_cast<double>(this->max_limit_));
+    this->limit_ = static_cast<size_t>(this->estimated_limit_);
+  }
+
+public:
+  /**
+   * @param initial_limit The limit before latency is measured
+   * @param min_limit The minimum limit
+   * @param max_limit The maximum limit
+   * @param max_queue_size The maximum number of requests waiting for the limit, 0 to reject them
+   *  immediately
+   * @param tolerance The ratio of the minimum latency up to which the limit may grow
+   */
+  explicit ConcurrencyLimiter(size_t initial_limit = 20, size_t min_limit = 1,
+                              size_t max_limit = 1000, size_t max_queue_size = 0,
+                              double tolerance = 2)
+    : min_limit_(min_limit), max_limit_(max_limit), max_queue_size_(max_queue_size),
+      limit_(initial_limit), in_flight_(0), tolerance_(tolerance),
+      estimated_limit_(static_cast<double>(initial_limit)), latency_(0),
+      window_min_latency_(numeric_limits<double>::infinity()),
+      previous_min_latency_(numeric_limits<double>::infinity()), window_samples_(0) {
+  }
+
+  /**
+   * @return The current limit
+   */
+  size_t getLimit() const {
+    return this->limit_;
+  }
+
+  /**
+   * @return The number of requests being processed
+   */
+  size_t getInFlight() const {
+    return this->in_flight_;
+  }
+
+  response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) override {
+    if (!co_await AdmissionAwaiter(*this, request.getCancellation())) {
+      if (request.getCancellation().isCancelled()) {
+        co_return nullptr;
+      }
+      auto response = make_unique<Response>(Response::Status::SERVICE_UNAVAILABLE);
+      response->setHeader("Retry-After", "1");
+      co_return response;
+    }
+    // The request may be cancelled once admitted, before it is resumed.
+    if (request.getCancellation().isCancelled()) {
+      this->release();
+      co_return nullptr;
+    }
+    auto start = chrono::steady_clock::now();
+    unique_ptr<Response> response;
+    exception_ptr exception;
+    try {
+      response = co_await handler.handleAsync(request);
+    } catch (...) {
+      exception = current_exception();
+    }
+    this->release(chrono::steady_clock::now() - start);
+    if (exception) {
+      rethrow_exception(exception);
+    }
+    co_return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_CONCURRENCY_H
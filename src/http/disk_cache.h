@@ -0,0 +1,469 @@
+#ifndef HTTP_DISK_CACHE_H
+#define HTTP_DISK_CACHE_H
+
+#include "application.h"
+#include "cache.h"
+#include "messages.h"
+#include "../utils/file.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <shared_mutex>
+
+using namespace std;
+
+namespace http {
+/**
+ * Persistent store of serialized responses. Responses are appended to memory-mapped segment files
+ * of a fixed capacity. When the current segment is full a new one is created and the oldest
+ * segments are deleted past a maximum count. An open addressing hash table indexes the records in
+ * memory; it is rebuilt by scanning the segments when the store is opened, so the stored
+ * responses survive restarts.
+ */
+class DiskCacheStore {
+public:
+  /**
+   * A segment file and its mapping.
+   */
+  struct Segment {
+    uint32_t generation;
+    string path;
+    shared_ptr<utils::File> file;
+    unique_ptr<utils::FileMapping> mapping;
+    /// End of the reserved records.
+    size_t end;
+  };
+
+  /**
+   * Header of a record, followed by the key, the head and the body of the response.
+   */
+  struct Record {
+    uint32_t state;
+    uint32_t key_length;
+    uint64_t hash;
+    /// Length of the record including its header and padding.
+    uint64_t length;
+    uint64_t head_length;
+    uint64_t body_length;
+    /// Expiration time in seconds since the epoch.
+    int64_t fresh_until;
+    uint32_t status;
+    uint32_t reserved;
+
+    const char *getKey() const {
+      return reinterpret_cast<const char *>(this + 1);
+    }
+
+    const char *getHead() const {
+      return this->getKey() + this->key_length;
+    }
+
+    const char *getBody() const {
+      return this->getHead() + this->head_length;
+    }
+  };
+
+  /**
+   * A record found in the store, valid as long as the segment is held.
+   */
+  struct Hit {
+    shared_ptr<const Segment> segment;
+    const Record *record;
+  };
+
+protected:
+  static constexpr char SEGMENT_MAGIC[8] = {'H', 'T', 'C', 'A', 'C', 'H', 'E', '1'};
+  static constexpr size_t SEGMENT_HEADER_SIZE = 64;
+  static constexpr uint32_t RECORD_RESERVED = 0x52534556u;
+  static constexpr uint32_t RECORD_COMMITTED = 0x434f4d54u;
+  static constexpr uint64_t EMPTY_SLOT = 0;
+  static constexpr uint64_t DELETED_SLOT = 1;
+
+  /**
+   * Entry of the index. Offsets are in units of 8 bytes, records being aligned.
+   */
+  struct Slot {
+    uint64_t hash;
+    uint32_t generation;
+    uint32_t offset;
+  };
+
+  string directory_;
+  size_t segment_capacity_;
+  size_t max_segments_;
+  mutable shared_mutex lock_;
+  deque<shared_ptr<Segment>> segments_;
+  vector<Slot> index_;
+  size_t used_slots_;
+
+  static uint64_t hashKey(const string &key) {
+    auto hash = utils::hash64(key.data(), key.size());
+    // Reserved values mark empty and deleted slots.
+    return hash <= DELETED_SLOT ? hash + 2 : hash;
+  }
+
+  static size_t align(size_t length) {
+    return (length + 7u) & ~static_cast<size_t>(7u);
+  }
+
+  static int64_t now() {
+    return chrono::duration_cast<chrono::seconds>(
+      chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * Finds a segment given its generation. The store must be locked.
+   */
+  shared_ptr<Segment> findSegment(uint32_t generation) const {
+    if (this->segments_.empty() || generation < this->segments_.front()->generation) {
+      return nullptr;
+    }
+    auto index = generation - this->segments_.front()->generation;
+    if (index >= this->segments_.size()) {
+      return nullptr;
+    }
+    return this->segments_[index];
+  }
+
+  /**
+   * Finds the index slot of a key. The store must be locked.
+   * @return The slot, or nullptr
+   */
+  const Slot *findSlot(const string &key, uint64_t hash, const Record *&record) const {
+    if (this->index_.empty()) {
+      return nullptr;
+    }
+    auto mask = this->index_.size() - 1;
+    for (auto i = hash & mask;; i = (i + 1) & mask) {
+      const auto &slot = this->index_[i];
+      if (slot.hash == EMPTY_SLOT) {
+        return nullptr;
+      }
+      if (slot.hash != hash) {
+        continue;
+      }
+      auto segment = this->findSegment(slot.generation);
+      if (!segment) {
+        continue;
+      }
+      record = reinterpret_cast<const Record *>(segment->mapping->getData() +
+                                                static_cast<size_t>(slot.offset) * 8u);
+      if (record->key_length == key.size() &&
+          memcmp(record->getKey(), key.data(), key.size()) == 0) {
+        return &slot;
+      }
+    }
+  }
+
+  /**
+   * Indexes a record, replacing any previous record with the same key. The store must be locked.
+   */
+  void indexRecord(const string &key, uint32_t generation, size_t offset, uint64_t hash) {
+    if ((this->used_slots_ + 1) * 2 > this->index_.size()) {
+      this->rehash(max<size_t>(this->index_.size() * 2, 1024));
+    }
+    const Record *previous;
+    auto existing = const_cast<Slot *>(this->findSlot(key, hash, previous));
+    if (existing) {
+      existing->generation = generation;
+      existing->offset = static_cast<uint32_t>(offset / 8u);
+      return;
+    }
+    auto mask = this->index_.size() - 1;
+    auto i = hash & mask;
+    while (this->index_[i].hash != EMPTY_SLOT && this->index_[i].hash != DELETED_SLOT) {
+      i = (i + 1) & mask;
+    }
+    if (this->index_[i].hash == EMPTY_SLOT) {
+      this->used_slots_++;
+    }
+    this->index_[i] = {hash, generation, static_cast<uint32_t>(offset / 8u)};
+  }
+
+  /**
+   * Rebuilds the index with a new size, dropping deleted slots and slots of deleted segments.
+   */
+  void rehash(size_t size) {
+    vector<Slot> previous(size, Slot{EMPTY_SLOT, 0, 0});
+    previous.swap(this->index_);
+    this->used_slots_ = 0;
+    auto mask = size - 1;
+    for (const auto &slot : previous) {
+      if (slot.hash <= DELETED_SLOT || !this->findSegment(slot.generation)) {
+        continue;
+      }
+      auto i = slot.hash & mask;
+      while (this->index_[i].hash != EMPTY_SLOT) {
+        i = (i + 1) & mask;
+      }
+      this->index_[i] = slot;
+      this->used_slots_++;
+    }
+  }
+
+  /**
+   * Creates or opens a segment file.
+   */
+  shared_ptr<Segment> openSegment(uint32_t generation) {
+    auto segment = make_shared<Segment>();
+    segment->generation = generation;
+    segment->path = this->directory_ + "/" + to_string(generation) + ".seg";
+    segment->file = make_shared<utils::File>(segment->path, true);
+    char magic[sizeof(SEGMENT_MAGIC)];
+    auto valid = segment->file->getSize() >= this->segment_capacity_ &&
+                 segment->file->read(magic, sizeof(magic), 0) == sizeof(magic) &&
+                 memcmp(magic, SEGMENT_MAGIC, sizeof(magic)) == 0;
+    // New or unrecognized files are emptied.
+    if (!valid) {
+      segment->file->resize(0);
+      segment->file->resize(this->segment_capacity_);
+    }
+    segment->mapping = make_unique<utils::FileMapping>(*segment->file,
+                                                       segment->file->getSize(), true);
+    if (!valid) {
+      memcpy(segment->mapping->getData(), SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    }
+    segment->end = SEGMENT_HEADER_SIZE;
+    return segment;
+  }
+
+  /**
+   * Indexes the committed records of a segment loaded from disk.
+   */
+  void scanSegment(Segment &segment) {
+    auto data = segment.mapping->getData();
+    auto capacity = segment.mapping->getLength();
+    auto now = DiskCacheStore::now();
+    while (segment.end + sizeof(Record) <= capacity) {
+      auto record = reinterpret_cast<const Record *>(data + segment.end);
+      if ((record->state != RECORD_RESERVED && record->state != RECORD_COMMITTED) ||
+          record->length < sizeof(Record) || record->length > capacity - segment.end ||
+          record->key_length + record->head_length + record->body_length >
+          record->length - sizeof(Record)) {
+        break;
+      }
+      if (record->state == RECORD_COMMITTED && record->fresh_until > now) {
+        this->indexRecord(string(record->getKey(), record->key_length), segment.generation,
+                          segment.end, record->hash);
+      }
+      segment.end += record->length;
+    }
+  }
+
+  /**
+   * Starts a new segment, deleting the oldest ones if necessary. The store must be locked.
+   */
+  void rotate() {
+    auto generation = this->segments_.empty() ? 0 : this->segments_.back()->generation + 1;
+    this->segments_.push_back(this->openSegment(generation));
+    if (this->segments_.size() > this->max_segments_) {
+      while (this->segments_.size() > this->max_segments_) {
+        error_code error;
+        filesystem::remove(this->segments_.front()->path, error);
+        this->segments_.pop_front();
+      }
+      this->rehash(this->index_.size());
+    }
+  }
+
+public:
+  /**
+   * Opens a store, loading the segments already in the directory.
+   * @param directory The directory of the segment files, created if necessary
+   * @param segment_capacity The size of a segment file in bytes
+   * @param max_segments The maximum number of segment files
+   * @throw utils::SystemException Thrown if a segment cannot be opened
+   */
+  explicit DiskCacheStore(string directory, size_t segment_capacity = 64u << 20u,
+                          size_t max_segments = 8)
+    : directory_(move(directory)), segment_capacity_(segment_capacity),
+      max_segments_(max(max_segments, static_cast<size_t>(1))), used_slots_(0) {
+    filesystem::create_directories(this->directory_);
+    vector<uint32_t> generations;
+    for (const auto &entry : filesystem::directory_iterator(this->directory_)) {
+      if (entry.path().extension() != ".seg") {
+        continue;
+      }
+      try {
+        generations.push_back(static_cast<uint32_t>(stoul(entry.path().stem().string())));
+      } catch (exception &) {
+      }
+    }
+    sort(generations.begin(), generations.end());
+    // Only keeps the most recent contiguous generations, as segments are found by generation,
+    // leaving room for a new segment.
+    auto first = generations.size();
+    while (first > 0 && generations.size() - first + 1 < this->max_segments_ &&
+           (first == generations.size() || generations[first - 1] + 1 == generations[first])) {
+      first--;
+    }
+    for (size_t i = 0; i < first; i++) {
+      error_code error;
+      filesystem::remove(this->directory_ + "/" + to_string(generations[i]) + ".seg", error);
+    }
+    generations.erase(generations.begin(), generations.begin() + first);
+    for (auto generation : generations) {
+      this->segments_.push_back(this->openSegment(generation));
+      this->scanSegment(*this->segments_.back());
+    }
+    // Records are only appended to a new segment, older ones may end with unfinished records.
+    this->rotate();
+  }
+
+  DiskCacheStore(const DiskCacheStore &other) = delete;
+  DiskCacheStore &operator=(const DiskCacheStore &other) = delete;
+
+  /**
+   * Looks up a fresh record.
+   * @param key The key of the record
+   * @param hit The output for the record
+   * @return Whether a fresh record exists
+   */
+  bool get(const string &key, Hit &hit) const {
+    auto hash = DiskCacheStore::hashKey(key);
+    shared_lock<shared_mutex> guard(this->lock_);
+    const Record *record;
+    auto slot = this->findSlot(key, hash, record);
+    if (!slot || record->fresh_until <= DiskCacheStore::now()) {
+      return false;
+    }
+    hit.segment = this->findSegment(slot->generation);
+    hit.record = record;
+    return true;
+  }
+
+  /**
+   * Appends a record. The data is copied to the mapping without holding the lock.
+   * @param key The key of the record
+   * @param status The status of the response
+   * @param head The serialized head of the response
+   * @param body The segments of the body, in memory
+   * @param fresh_until The expiration time in seconds since the epoch
+   * @return Whether the record was stored
+   */
+  bool put(const string &key, int status, const BodySegment &head, const body_segments_t &body,
+           int64_t fresh_until) {
+    size_t body_length = 0;
+    for (const auto &segment : body) {
+      if (segment.isFile()) {
+        return false;
+      }
+      body_length += segment.getLength();
+    }
+    auto length = DiskCacheStore::align(sizeof(Record) + key.size() + head.getLength() +
+                                        body_length);
+    if (length > this->segment_capacity_ - SEGMENT_HEADER_SIZE) {
+      return false;
+    }
+    auto hash = DiskCacheStore::hashKey(key);
+
+    shared_ptr<Segment> segment;
+    size_t offset;
+    {
+      unique_lock<shared_mutex> guard(this->lock_);
+      if (this->segments_.back()->end + length > this->segments_.back()->mapping->getLength()) {
+        this->rotate();
+      }
+      segment = this->segments_.back();
+      offset = segment->end;
+      segment->end += length;
+      auto record = reinterpret_cast<Record *>(segment->mapping->getData() + offset);
+      record->length = length;
+      record->state = RECORD_RESERVED;
+    }
+
+    auto record = reinterpret_cast<Record *>(segment->mapping->getData() + offset);
+    record->key_length = static_cast<uint32_t>(key.size());
+    record->hash = hash;
+    record->head_length = head.getLength();
+    record->body_length = body_length;
+    record->fresh_until = fresh_until;
+    record->status = static_cast<uint32_t>(status);
+    record->reserved = 0;
+    auto data = const_cast<char *>(record->getKey());
+    memcpy(data, key.data(), key.size());
+    data += key.size();
+    memcpy(data, head.getData(), head.getLength());
+    data += head.getLength();
+    for (const auto &part : body) {
+      memcpy(data, part.getData(), part.getLength());
+      data += part.getLength();
+    }
+
+    unique_lock<shared_mutex> guard(this->lock_);
+    record->state = RECORD_COMMITTED;
+    // The segment may have been deleted while the record was written.
+    if (this->findSegment(segment->generation) != segment) {
+      return false;
+    }
+    this->indexRecord(key, segment->generation, offset, hash);
+    return true;
+  }
+};
+
+/**
+ * Second-tier cache for the responses of the next middleware, kept on disk by a DiskCacheStore.
+ * Hits are sent straight from the segment files: the head and small bodies from the mapping,
+ * larger bodies with sendfile. To be placed after a ResponseCache, which does not keep the
+ * file-backed bodies of this tier in memory.
+ */
+class DiskCache : public Middleware {
+protected:
+  CachePolicy policy_;
+  DiskCacheStore store_;
+  size_t sendfile_threshold_;
+
+public:
+  /**
+   * @param directory The directory of the segment files
+   * @param policy The caching policy
+   * @param segment_capacity The size of a segment file in bytes
+   * @param max_segments The maximum number of segment files
+   * @param sendfile_threshold The body length from which bodies are sent with sendfile
+   */
+  explicit DiskCache(const string &directory, CachePolicy policy = CachePolicy(),
+                     size_t segment_capacity = 64u << 20u, size_t max_segments = 8,
+                     size_t sendfile_threshold = 16u << 10u)
+    : policy_(move(policy)), store_(directory, segment_capacity, max_segments),
+      sendfile_threshold_(sendfile_threshold) {
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    if (!this->policy_.isCacheable(request)) {
+      return handler.handle(request);
+    }
+    auto key = this->policy_.makeKey(request);
+    DiskCacheStore::Hit hit;
+    if (this->store_.get(key, hit)) {
+      auto record = hit.record;
+      auto response = make_unique<Response>(
+        static_cast<Response::Status::STATUS>(record->status));
+      if (record->body_length >= this->sendfile_threshold_) {
+        auto offset = static_cast<size_t>(record->getBody() - hit.segment->mapping->getData());
+        response->addBodySegment(
+          BodySegment::fromFile(hit.segment->file, offset, record->body_length));
+      } else if (record->body_length > 0) {
+        response->addBodySegment(
+          BodySegment::fromMemory(hit.segment, record->getBody(), record->body_length));
+      }
+      response->setSerializedHead(
+        BodySegment::fromMemory(move(hit.segment), record->getHead(), record->head_length));
+      return response;
+    }
+
+    auto response = handler.handle(request);
+    chrono::seconds ttl, stale_ttl;
+    if (response && this->policy_.getLifetime(*response, ttl, stale_ttl)) {
+      const auto &body = response->toBodySegments();
+      const auto &head = response->serializeHead();
+      auto fresh_until = chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch() + ttl).count();
+      this->store_.put(key, response->getStatus(), head, body, fresh_until);
+    }
+    return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_DISK_CACHE_H
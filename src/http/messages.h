@@ -1,12 +1,18 @@
 #ifndef HTTP_MESSAGES_H
 #define HTTP_MESSAGES_H
 
+#include "attributes.h"
+#include "body.h"
+#include "cancellation.h"
+#include "parameters.h"
 #include "uri.h"
 #include "../utils/exception.h"
 #include "../net/sockets.h"
 #include <any>
+#include <algorithm>
 #include <map>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -60,22 +66,25 @@ public:
   }
 
   const map<string, header_value_t> &getHeaders() const {
+    this->loadHeaders();
     return this->headers_;
   }
 
   bool hasHeader(const string &name) const {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     return this->headers_.count(l_name) > 0;
   }
 
   const header_value_t &getHeader(const string &name) const {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     return this->headers_.at(l_name);
   }
 
   string getHeaderLine(const string &name) const {
     auto l_name = utils::tolower(name);
-    ostringstream line(l_name);
+    ostringstream line(l_name, ios_base::ate);
     line << ':';
 
     auto first = true;
@@ -90,31 +99,40 @@ public:
   }
 
   void setAddedHeader(const string &name, string &&value) {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     this->headers_[l_name].push_back(move(value));
+    this->headersChanged();
   }
 
   void setAddedHeader(const string &name, header_value_t &&value) {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     auto &stored_value = this->headers_[l_name];
     stored_value.reserve(stored_value.size() + value.size());
     stored_value.insert(stored_value.end(), value.begin(), value.end());
+    this->headersChanged();
   }
 
   void setHeader(const string &name, string &&value) {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     this->headers_[l_name].clear();
     this->setAddedHeader(l_name, move(value));
   }
 
   void setHeader(const string &name, header_value_t &&value) {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     this->headers_[l_name] = move(value);
+    this->headersChanged();
   }
 
   void unsetHeader(const string &name) {
+    this->loadHeaders();
     auto l_name = utils::tolower(name);
     this->headers_.erase(l_name);
+    this->headersChanged();
   }
 
   stringstream &getBody() {
@@ -141,7 +159,7 @@ public:
 
 protected:
   ProtocolVersion protocol_version_;
-  map<string, header_value_t> headers_;
+  mutable map<string, header_value_t> headers_;
   stringstream body_;
 
   Message() : protocol_version_(0u, 0u) {
@@ -151,6 +169,27 @@ protected:
   explicit Message(ProtocolVersion protocol_version) : protocol_version_(protocol_version) {
     this->body_.exceptions(stringstream::failbit);
   }
+
+  Message(const Message &other) : protocol_version_(other.protocol_version_),
+                                  headers_((other.loadHeaders(), other.headers_)),
+                                  body_(other.body_.str(), ios_base::in | ios_base::out |
+                                                           ios_base::ate) {
+    this->body_.exceptions(stringstream::failbit);
+  }
+
+  Message(Message &&other) = default;
+
+  /**
+   * Called before any access to the headers, allows them to be loaded lazily.
+   */
+  virtual void loadHeaders() const {
+  }
+
+  /**
+   * Called after any modification of the headers.
+   */
+  virtual void headersChanged() {
+  }
 };
 
 class Request : public Message {
@@ -224,6 +263,18 @@ public:
       throw runtime_error("Invalid value");
     }
 
+    METHOD getValue() const {
+      return this->value_;
+    }
+
+    bool operator==(const Method &other) const {
+      return this->value_ == other.value_;
+    }
+
+    bool operator!=(const Method &other) const {
+      return this->value_ != other.value_;
+    }
+
   protected:
     METHOD value_;
   };
@@ -235,6 +286,13 @@ public:
     : Message(protocol_version), method_(method) {
   }
 
+  Request(const Request &other) : Message(other), method_(other.method_), uri_(other.uri_) {
+  }
+
+  Request(Request &&other) noexcept
+    : Message(move(other)), method_(other.method_), uri_(move(other.uri_)) {
+  }
+
   const Method &getMethod() const {
     return this->method_;
   }
@@ -249,20 +307,35 @@ public:
 
   void setUri(Uri &&uri, bool preserveHost = false) {
     this->uri_ = move(uri);
+    this->query_parameters_.reset();
+  }
+
+  /**
+   * @return The parameters of the query of the URI, indexed on first access
+   */
+  const Parameters &getQueryParameters() const {
+    if (!this->query_parameters_) {
+      this->query_parameters_.emplace(this->uri_.getQuery());
+    }
+    return *this->query_parameters_;
   }
 
   void clear() override {
     Message::clear();
     this->method_ = Method::METHOD::GET;
     this->uri_.clear();
+    this->query_parameters_.reset();
   }
 
 protected:
   Method method_;
   Uri uri_;
+  /// Views into the URI, so never copied along with it.
+  mutable optional<Parameters> query_parameters_;
 };
 
 class HTTPServer;
+class RequestDispatcher;
 
 class ServerRequest : public Request {
   friend HTTPServer;
@@ -286,10 +359,76 @@ public:
   ), state_(STATE::INVALID) {
   }
 
+  /**
+   * Copies the message, the state and the client address of a request, for instance to process it
+   * again apart from its client. The attributes are not copied, and the copy has its own
+   * cancellation, without deadline.
+   */
+  ServerRequest(const ServerRequest &other) : Request(other), state_(other.state_),
+                                              client_address_(other.client_address_),
+                                              dispatcher_(other.dispatcher_) {
+  }
+
   STATE getState() const {
     return this->state_;
   }
 
+  /**
+   * @param key The key of a typed attribute
+   * @return Whether the request has a value for the attribute
+   */
+  template<typename T>
+  bool hasAttribute(const AttributeKey<T> &key) const {
+    return this->attribute_slots_.has(key.getSlot());
+  }
+
+  /**
+   * @param key The key of a typed attribute
+   * @return The value of the attribute, or nullptr
+   */
+  template<typename T>
+  T *findAttribute(const AttributeKey<T> &key) {
+    return this->attribute_slots_.find<T>(key.getSlot());
+  }
+
+  /**
+   * @param key The key of a typed attribute
+   * @return The value of the attribute
+   * @throw out_of_range Thrown if the request has no value for the attribute
+   */
+  template<typename T>
+  T &getAttribute(const AttributeKey<T> &key) {
+    auto value = this->attribute_slots_.find<T>(key.getSlot());
+    if (!value) {
+      throw out_of_range("No value for attribute " + key.getName());
+    }
+    return *value;
+  }
+
+  /**
+   * Replaces the value of a typed attribute, constructing it in place.
+   * @param key The key of the attribute
+   * @param args The arguments of the constructor of the value
+   * @return The value
+   */
+  template<typename T, typename... Args>
+  T &emplaceAttribute(const AttributeKey<T> &key, Args &&... args) {
+    return this->attribute_slots_.emplace<T>(key.getSlot(), forward<Args>(args)...);
+  }
+
+  template<typename T>
+  void setAttribute(const AttributeKey<T> &key, T &&value) {
+    this->attribute_slots_.emplace<T>(key.getSlot(), move(value));
+  }
+
+  template<typename T>
+  void unsetAttribute(const AttributeKey<T> &key) {
+    this->attribute_slots_.reset(key.getSlot());
+  }
+
+  /**
+   * @return The attributes set by name, a slower alternative to typed attributes
+   */
   map<string, any> &getAttributes() {
     return this->attributes_;
   }
@@ -314,17 +453,64 @@ public:
     return this->client_address_;
   }
 
+  /**
+   * @return The dispatcher of the server processing the request, or nullptr if the request is
+   *  not processed by a server
+   */
+  RequestDispatcher *getDispatcher() const {
+    return this->dispatcher_;
+  }
+
+  /**
+   * @return The cancellation of the request, which can be checked from any thread
+   */
+  Cancellation &getCancellation() {
+    return this->cancellation_;
+  }
+
+  const Cancellation &getCancellation() const {
+    return this->cancellation_;
+  }
+
+  /**
+   * Returns the parameters of an application/x-www-form-urlencoded body, indexed on first access.
+   * @return The parameters, empty if the body is not form data or is not completely received
+   */
+  const Parameters &getFormParameters() {
+    static const Parameters empty;
+    if (this->form_parameters_) {
+      return *this->form_parameters_;
+    }
+    if (this->state_ != STATE::BODY) {
+      return empty;
+    }
+    if (this->hasHeader("Content-Type") && !this->getHeader("Content-Type").empty() &&
+        utils::tolower(this->getHeader("Content-Type").front())
+          .rfind("application/x-www-form-urlencoded", 0) == 0) {
+      this->form_parameters_.emplace(this->body_.str());
+    } else {
+      this->form_parameters_.emplace();
+    }
+    return *this->form_parameters_;
+  }
+
   void clear() override {
     Request::clear();
     this->state_ = STATE::INVALID;
     this->attributes_.clear();
+    this->attribute_slots_.clear();
     this->client_address_.clear();
+    this->form_parameters_.reset();
+    this->cancellation_.reset();
   }
 
   void clear(bool preserveClientAddress) {
     Request::clear();
     this->state_ = STATE::INVALID;
     this->attributes_.clear();
+    this->attribute_slots_.clear();
+    this->form_parameters_.reset();
+    this->cancellation_.reset();
     if (!preserveClientAddress) {
       this->client_address_.clear();
     }
@@ -333,7 +519,11 @@ public:
 protected:
   STATE state_;
   map<string, any> attributes_;
+  AttributeSlots attribute_slots_;
   string client_address_;
+  optional<Parameters> form_parameters_;
+  Cancellation cancellation_;
+  RequestDispatcher *dispatcher_ = nullptr;
 };
 
 class Response : public Message {
@@ -581,25 +771,160 @@ public:
   void setStatus(Status status) {
     this->reason_phrase_ = string(status);
     this->status_ = move(status);
+    this->headersChanged();
   }
 
   void setStatus(Status status, string &&reason_phrase) {
     this->status_ = move(status);
     this->reason_phrase_ = move(reason_phrase);
+    this->headersChanged();
   }
 
   const string &getReasonPhrase() const {
     return this->reason_phrase_;
   }
 
+  /**
+   * Body segments replace the body stream when they are set: they are sent as is, allowing
+   * file-backed and shared bodies to be sent without copy.
+   * @return Whether the body is made of segments
+   */
+  bool hasBodySegments() const {
+    return !this->body_segments_.empty();
+  }
+
+  const body_segments_t &getBodySegments() const {
+    return this->body_segments_;
+  }
+
+  void setBodySegments(body_segments_t &&segments) {
+    this->body_segments_ = move(segments);
+    this->headersChanged();
+  }
+
+  void addBodySegment(BodySegment &&segment) {
+    this->body_segments_.push_back(move(segment));
+    this->headersChanged();
+  }
+
+  /**
+   * Moves the content of the body stream to a body segment, unless the body is already made of
+   * segments.
+   * @return The segments of the body
+   */
+  const body_segments_t &toBodySegments() {
+    if (this->body_segments_.empty()) {
+      auto content = this->body_.str();
+      if (!content.empty()) {
+        this->body_segments_.push_back(BodySegment::fromString(move(content)));
+      }
+      stringstream().swap(this->body_);
+      this->body_.exceptions(stringstream::failbit);
+    }
+    return this->body_segments_;
+  }
+
+  /**
+   * Converts the body stream to segments if necessary.
+   * @return The length of the body in bytes
+   */
+  size_t getBodyLength() {
+    size_t length = 0;
+    for (const auto &segment : this->toBodySegments()) {
+      length += segment.getLength();
+    }
+    return length;
+  }
+
+  /**
+   * Serializes the status line and the headers, Content-Length being set from the body. The result
+   * is kept until the response is modified.
+   * @return The head of the response
+   */
+  const BodySegment &serializeHead() {
+    if (this->serialized_head_) {
+      return *this->serialized_head_;
+    }
+    this->setHeader("Content-Length", to_string(this->getBodyLength()));
+
+    string head = this->getProtocolVersion();
+    head += " ";
+    head += to_string(this->getStatus());
+    head += " ";
+    head += this->getReasonPhrase();
+    head += "\r\n";
+    for (const auto &header : this->headers_) {
+      head += header.first + ":";
+      auto first = true;
+      for (const auto &value : header.second) {
+        if (!first) {
+          head += ',';
+        }
+        head += value;
+        first = false;
+      }
+      head += "\r\n";
+    }
+    head += "\r\n";
+    this->serialized_head_ = BodySegment::fromString(move(head));
+    return *this->serialized_head_;
+  }
+
+  /**
+   * Sets an already serialized head, which must match the status and the body of the response.
+   * The headers are parsed from it only if they are accessed.
+   * @param head The head, as produced by serializeHead()
+   */
+  void setSerializedHead(BodySegment &&head) {
+    this->headers_.clear();
+    this->serialized_head_ = move(head);
+    this->headers_loaded_ = false;
+  }
+
+  bool hasSerializedHead() const {
+    return this->serialized_head_.has_value();
+  }
+
   void clear() override {
     Message::clear();
     this->setStatus(Status::OK);
+    this->body_segments_.clear();
+    this->serialized_head_.reset();
+    this->headers_loaded_ = true;
   }
 
 protected:
   Status status_;
   string reason_phrase_;
+  body_segments_t body_segments_;
+  optional<BodySegment> serialized_head_;
+  mutable bool headers_loaded_ = true;
+
+  void loadHeaders() const override {
+    if (this->headers_loaded_) {
+      return;
+    }
+    this->headers_loaded_ = true;
+    auto data = this->serialized_head_->getData();
+    auto end = data + this->serialized_head_->getLength();
+    // Skips the status line.
+    auto line = find(data, end, '\n') + 1;
+    while (line < end) {
+      auto line_end = find(line, end, '\n');
+      if (line_end == end || line_end - line <= 1) {
+        break;
+      }
+      auto colon = find(line, line_end, ':');
+      if (colon != line_end) {
+        this->headers_[string(line, colon)].emplace_back(colon + 1, line_end - 1);
+      }
+      line = line_end + 1;
+    }
+  }
+
+  void headersChanged() override {
+    this->serialized_head_.reset();
+  }
 };
 
 } // namespace http
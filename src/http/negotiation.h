@@ -0,0 +1,104 @@
+#ifndef HTTP_NEGOTIATION_H
+#define HTTP_NEGOTIATION_H
+
+#include "messages.h"
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace http {
+/**
+ * Selection of a content coding according to the Accept-Encoding header of a request.
+ */
+class AcceptEncoding {
+protected:
+  vector<pair<string, double>> codings_;
+  bool present_;
+
+  /**
+   * @return The quality of a coding, -1 if the header does not mention it
+   */
+  double findQuality(const string &coding) const {
+    double wildcard = -1;
+    for (const auto &entry : this->codings_) {
+      if (entry.first == coding) {
+        return entry.second;
+      }
+      if (entry.first == "*") {
+        wildcard = entry.second;
+      }
+    }
+    return wildcard;
+  }
+
+public:
+  explicit AcceptEncoding(const Message &request) : present_(request.hasHeader("Accept-Encoding")) {
+    if (!this->present_) {
+      return;
+    }
+    for (const auto &line : request.getHeader("Accept-Encoding")) {
+      for (const auto &element : utils::split(line, ',')) {
+        auto parameters = utils::split(element, ';');
+        if (parameters.empty()) {
+          continue;
+        }
+        auto coding = utils::tolower(utils::trim(parameters[0]));
+        if (coding.empty()) {
+          continue;
+        }
+        double quality = 1;
+        for (size_t i = 1; i < parameters.size(); i++) {
+          auto parameter = utils::trim(parameters[i]);
+          if (parameter.size() > 2 && (parameter[0] == 'q' || parameter[0] == 'Q') &&
+              parameter[1] == '=') {
+            try {
+              quality = stod(parameter.substr(2));
+            } catch (exception &) {
+              quality = 0;
+            }
+          }
+        }
+        this->codings_.emplace_back(move(coding), quality);
+      }
+    }
+  }
+
+  /**
+   * @param coding The name of a content coding
+   * @return Whether the coding is acceptable
+   */
+  bool accepts(const string &coding) const {
+    if (coding == "identity") {
+      // Identity is acceptable unless explicitly excluded.
+      auto quality = this->findQuality(coding);
+      return quality != 0;
+    }
+    return this->findQuality(coding) > 0;
+  }
+
+  /**
+   * Selects the preferred coding among the available ones.
+   * @param available The available codings, the server's preferred ones first
+   * @return The coding with the highest quality, the first one on ties, or "identity" if none is
+   *  acceptable
+   */
+  string select(const vector<string> &available) const {
+    string selected = "identity";
+    double selected_quality = 0;
+    if (!this->present_) {
+      return selected;
+    }
+    for (const auto &coding : available) {
+      auto quality = this->findQuality(coding);
+      if (quality > selected_quality) {
+        selected = coding;
+        selected_quality = quality;
+      }
+    }
+    return selected;
+  }
+};
+} // namespace http
+
+#endif //HTTP_NEGOTIATION_H
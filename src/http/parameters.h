@@ -0,0 +1,189 @@
+#ifndef HTTP_PARAMETERS_H
+#define HTTP_PARAMETERS_H
+
+#include "uri.h"
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace http {
+/**
+ * The parameters of a query string or of an application/x-www-form-urlencoded body. The boundaries
+ * of the parameters are indexed on first access, and a value is only decoded the first time it is
+ * read; values that need no decoding are views into the source.
+ */
+class Parameters {
+protected:
+  struct Entry {
+    string_view key;
+    string_view value;
+    /// Whether the value still contains percent-encoded octets or '+'.
+    bool encoded;
+  };
+
+  string owned_;
+  string_view source_;
+  bool owning_;
+  mutable vector<Entry> entries_;
+  mutable bool indexed_;
+  /// Decoded keys and values, in a container that does not move its elements.
+  mutable deque<string> decoded_;
+
+  static bool isEncoded(string_view str) {
+    return str.find_first_of("%+") != string_view::npos;
+  }
+
+  string_view decode(string_view str) const {
+    string decoded;
+    decoded.reserve(str.size());
+    Uri::decode(str, decoded, true);
+    this->decoded_.push_back(move(decoded));
+    return this->decoded_.back();
+  }
+
+  void index() const {
+    auto source = this->source_;
+    size_t start = 0;
+    while (start < source.size()) {
+      auto end = source.find('&', start);
+      if (end == string_view::npos) {
+        end = source.size();
+      }
+      auto pair = source.substr(start, end - start);
+      start = end + 1;
+      if (pair.empty()) {
+        continue;
+      }
+      auto equal = pair.find('=');
+      auto key = pair.substr(0, equal);
+      auto value = equal == string_view::npos ? string_view() : pair.substr(equal + 1);
+      if (Parameters::isEncoded(key)) {
+        // Keys are compared on every lookup, so they are decoded once.
+        key = this->decode(key);
+      }
+      this->entries_.push_back({key, value, Parameters::isEncoded(value)});
+    }
+    this->indexed_ = true;
+  }
+
+  vector<Entry> &getEntries() const {
+    if (!this->indexed_) {
+      this->index();
+    }
+    return this->entries_;
+  }
+
+  string_view getValue(Entry &entry) const {
+    if (entry.encoded) {
+      entry.value = this->decode(entry.value);
+      entry.encoded = false;
+    }
+    return entry.value;
+  }
+
+public:
+  /**
+   * Creates empty parameters.
+   */
+  Parameters() : owning_(false), indexed_(false) {
+  }
+
+  /**
+   * @param source The encoded parameters, which must outlive the instance
+   */
+  explicit Parameters(string_view source) : source_(source), owning_(false), indexed_(false) {
+  }
+
+  /**
+   * @param source The encoded parameters, owned by the instance
+   */
+  explicit Parameters(string &&source) : owned_(move(source)), owning_(true), indexed_(false) {
+    this->source_ = this->owned_;
+  }
+
+  Parameters(const Parameters &other)
+    : owned_(other.owned_), source_(other.source_), owning_(other.owning_), indexed_(false) {
+    if (this->owning_) {
+      this->source_ = this->owned_;
+    }
+  }
+
+  Parameters &operator=(const Parameters &other) {
+    if (this != &other) {
+      this->owned_ = other.owned_;
+      this->owning_ = other.owning_;
+      this->source_ = this->owning_ ? string_view(this->owned_) : other.source_;
+      this->entries_.clear();
+      this->decoded_.clear();
+      this->indexed_ = false;
+    }
+    return *this;
+  }
+
+  /**
+   * @param name The decoded name of a parameter
+   * @return Whether the parameter is present
+   */
+  bool has(string_view name) const {
+    for (const auto &entry : this->getEntries()) {
+      if (entry.key == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @param name The decoded name of a parameter
+   * @param default_value The value returned if the parameter is absent
+   * @return The decoded value of the first occurrence of the parameter, valid as long as the
+   *  instance and its source are
+   */
+  string_view get(string_view name, string_view default_value = string_view()) const {
+    for (auto &entry : this->getEntries()) {
+      if (entry.key == name) {
+        return this->getValue(entry);
+      }
+    }
+    return default_value;
+  }
+
+  /**
+   * @param name The decoded name of a parameter
+   * @return The decoded values of all the occurrences of the parameter
+   */
+  vector<string_view> getAll(string_view name) const {
+    vector<string_view> values;
+    for (auto &entry : this->getEntries()) {
+      if (entry.key == name) {
+        values.push_back(this->getValue(entry));
+      }
+    }
+    return values;
+  }
+
+  /**
+   * @return The decoded names of the parameters, in order, with duplicates
+   */
+  vector<string_view> getNames() const {
+    vector<string_view> names;
+    for (const auto &entry : this->getEntries()) {
+      names.push_back(entry.key);
+    }
+    return names;
+  }
+
+  size_t size() const {
+    return this->getEntries().size();
+  }
+
+  bool empty() const {
+    return this->getEntries().empty();
+  }
+};
+} // namespace http
+
+#endif //HTTP_PARAMETERS_H
@@ -0,0 +1,135 @@
+#ifndef HTTP_PIPELINE_H
+#define HTTP_PIPELINE_H
+
+#include "application.h"
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+namespace http {
+class AsyncMiddleware;
+
+/**
+ * A chain of middleware composed at compile time. The middleware are stored by value and each hop
+ * is a direct, non-virtual call to the next middleware's process method with a handler of a final
+ * type, so that the compiler can inline the whole chain.
+ *
+ * The pipeline is itself a middleware: it can be the only middleware of a server, or a part of a
+ * runtime-configured list. Its last middleware delegates to the handler the pipeline received.
+ * It subscribes to the phases of its middleware and runs their hooks in order. As the hops are
+ * synchronous, asynchronous middleware cannot be part of a pipeline.
+ * @tparam Ms The types of the middleware, in processing order
+ */
+template<typename... Ms>
+class Pipeline : public Middleware {
+  static_assert((is_base_of_v<Middleware, Ms> && ...), "Pipeline elements must be Middleware");
+  static_assert(!(is_base_of_v<AsyncMiddleware, Ms> || ...),
+                "Asynchronous middleware must be added to the server, not to a pipeline");
+
+protected:
+  tuple<Ms...> middleware_;
+
+  /**
+   * Passes a request to the I-th middleware of the pipeline.
+   */
+  template<size_t I>
+  class Stage final : public RequestHandler {
+  protected:
+    Pipeline &pipeline_;
+    RequestHandler &next_;
+
+  public:
+    Stage(Pipeline &pipeline, RequestHandler &next) : pipeline_(pipeline), next_(next) {
+    }
+
+    unique_ptr<Response> handle(ServerRequest &request) override {
+      return this->pipeline_.template processFrom<I>(request, this->next_);
+    }
+  };
+
+  template<size_t I>
+  unique_ptr<Response> processFrom(ServerRequest &request, RequestHandler &next) {
+    if constexpr (I == sizeof...(Ms)) {
+      return next.handle(request);
+    } else {
+      typedef tuple_element_t<I, tuple<Ms...>> middleware_t;
+      Stage<I + 1> stage(*this, next);
+      // Qualified call, bypassing the virtual dispatch.
+      return std::get<I>(this->middleware_).middleware_t::process(request, stage);
+    }
+  }
+
+  template<size_t... Is>
+  unsigned getPhases(index_sequence<Is...>) const {
+    return (0u | ... | std::get<Is>(this->middleware_).getPhases());
+  }
+
+  /**
+   * Runs a hook on the middleware subscribing to its phase, until one of them returns a response.
+   */
+  template<size_t I = 0, typename Hook>
+  unique_ptr<Response> runHook(unsigned phase, const Hook &hook) {
+    if constexpr (I == sizeof...(Ms)) {
+      return nullptr;
+    } else {
+      auto &middleware = std::get<I>(this->middleware_);
+      if (middleware.getPhases() & phase) {
+        auto response = hook(middleware);
+        if (response) {
+          return response;
+        }
+      }
+      return this->runHook<I + 1>(phase, hook);
+    }
+  }
+
+public:
+  Pipeline() = default;
+
+  explicit Pipeline(Ms &&... middleware) : middleware_(move(middleware)...) {
+  }
+
+  /**
+   * @return The I-th middleware of the pipeline
+   */
+  template<size_t I>
+  auto &get() {
+    return std::get<I>(this->middleware_);
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    return this->processFrom<0>(request, handler);
+  }
+
+  unsigned getPhases() const override {
+    return this->getPhases(index_sequence_for<Ms...>());
+  }
+
+  unique_ptr<Response> onHeaders(ServerRequest &request) override {
+    return this->runHook(HEADERS, [&request](auto &middleware) {
+      typedef remove_reference_t<decltype(middleware)> middleware_t;
+      return middleware.middleware_t::onHeaders(request);
+    });
+  }
+
+  unique_ptr<Response> onBodyChunk(ServerRequest &request, const char *data,
+                                   size_t length) override {
+    return this->runHook(BODY_CHUNK, [&request, data, length](auto &middleware) {
+      typedef remove_reference_t<decltype(middleware)> middleware_t;
+      return middleware.middleware_t::onBodyChunk(request, data, length);
+    });
+  }
+
+  void onComplete(ServerRequest &request, const Response &response) override {
+    this->runHook(COMPLETE, [&request, &response](auto &middleware) {
+      typedef remove_reference_t<decltype(middleware)> middleware_t;
+      middleware.middleware_t::onComplete(request, response);
+      return unique_ptr<Response>();
+    });
+  }
+};
+} // namespace http
+
+#endif //HTTP_PIPELINE_H
@@ -0,0 +1,374 @@
+#ifndef HTTP_PRIORITY_H
+#define HTTP_PRIORITY_H
+
+#include "async.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string_view>
+
+using namespace std;
+
+namespace http {
+/**
+ * Limits the number of requests processed at the same time by the next middleware, and schedules
+ * the waiting requests by priority. Requests are sorted into priority classes by rules on their
+ * path, headers or client address, as soon as their head is received. Each class has its own
+ * queue, and a freed slot goes to the waiting request of a class chosen by weighted round-robin
+ * among the classes with waiting requests: a class with a weight ten times higher is served ten
+ * times more often under saturation.
+ *
+ * A request is answered with 503 Service Unavailable when the queue of its class is full, before
+ * its body is read if possible, so giving low-priority classes small queues sheds their work
+ * first. Cancelled requests leave their queue without being processed or taking a slot, as soon
+ * as a slot is freed or another request arrives.
+ *
+ * The middleware is shared by the workers, and must be configured before the server runs.
+ */
+class PriorityScheduler : public AsyncMiddleware {
+public:
+  /**
+   * The index of the priority class of a request, set once its head is received.
+   */
+  inline static const AttributeKey<size_t> PRIORITY_CLASS{"priority_class"};
+
+protected:
+  struct Waiter {
+    net::EventLoop *loop;
+    coroutine_handle<> handle;
+    const Cancellation *cancellation;
+    bool admitted;
+  };
+
+  struct PriorityClass {
+    string name;
+    int weight;
+    size_t max_queue_size;
+    deque<Waiter *> queue;
+    /// The current weight of the class in the smooth weighted round-robin.
+    int current_weight;
+  };
+
+  struct Rule {
+    function<bool(const ServerRequest &)> matches;
+    size_t priority_class;
+  };
+
+  class AdmissionAwaiter {
+  protected:
+    PriorityScheduler &scheduler_;
+    size_t priority_class_;
+    Waiter waiter_;
+
+  public:
+    AdmissionAwaiter(PriorityScheduler &scheduler, size_t priority_class,
+                     const Cancellation &cancellation)
+      : scheduler_(scheduler), priority_class_(priority_class),
+        waiter_{nullptr, nullptr, &cancellation, false} {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    bool await_suspend(coroutine_handle<> handle) {
+      this->waiter_.loop = &net::EventLoop::require();
+      this->waiter_.handle = handle;
+      return this->scheduler_.enqueue(this->priority_class_, this->waiter_);
+    }
+
+    /**
+     * @return Whether the request was admitted
+     */
+    bool await_resume() const {
+      return this->waiter_.admitted;
+    }
+  };
+
+  size_t max_concurrency_;
+  size_t in_flight_;
+  vector<PriorityClass> classes_;
+  vector<Rule> rules_;
+  size_t default_class_;
+  mutex lock_;
+
+  /**
+   * Admits a request immediately if a slot is free and no request waits, or queues it unless its
+   * queue is full.
+   * @return Whether the request waits
+   */
+  bool enqueue(size_t priority_class, Waiter &waiter) {
+    lock_guard<mutex> guard(this->lock_);
+    this->removeCancelled();
+    if (this->in_flight_ < this->max_concurrency_ && !this->hasWaiters()) {
+      this->in_flight_++;
+      waiter.admitted = true;
+      return false;
+    }
+    auto &queue = this->classes_[priority_class].queue;
+    if (queue.size() >= this->classes_[priority_class].max_queue_size) {
+      return false;
+    }
+    queue.push_back(&waiter);
+    return true;
+  }
+
+  /**
+   * Resumes the cancelled waiting requests, without admitting them. The lock must be held.
+   */
+  void removeCancelled() {
+    for (auto &priority_class : this->classes_) {
+      auto &queue = priority_class.queue;
+      auto cancelled = stable_partition(queue.begin(), queue.end(), [](const Waiter *waiter) {
+        return !waiter->cancellation->isCancelled();
+      });
+      for (auto position = cancelled; position != queue.end(); ++position) {
+        auto handle = (*position)->handle;
+        (*position)->loop->post([handle] {
+          handle.resume();
+        });
+      }
+      queue.erase(cancelled, queue.end());
+    }
+  }
+
+  /**
+   * The lock must be held.
+   */
+  bool hasWaiters() const {
+    for (const auto &priority_class : this->classes_) {
+      if (!priority_class.queue.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Chooses the class of the next request admitted, with a smooth weighted round-robin among the
+   * classes with waiting requests. The lock must be held.
+   * @return The class, or nullptr if no request waits
+   */
+  PriorityClass *selectClass() {
+    PriorityClass *selected = nullptr;
+    auto total_weight = 0;
+    for (auto &priority_class : this->classes_) {
+      if (priority_class.queue.empty()) {
+        continue;
+      }
+      priority_class.current_weight += priority_class.weight;
+      total_weight += priority_class.weight;
+      if (!selected || priority_class.current_weight > selected->current_weight) {
+        selected = &priority_class;
+      }
+    }
+    if (selected) {
+      selected->current_weight -= total_weight;
+    }
+    return selected;
+  }
+
+  /**
+   * Frees the slot of a request, giving it to a waiting request if any.
+   */
+  void release() {
+    lock_guard<mutex> guard(this->lock_);
+    this->in_flight_--;
+    this->removeCancelled();
+    while (this->in_flight_ < this->max_concurrency_) {
+      auto priority_class = this->selectClass();
+      if (!priority_class) {
+        break;
+      }
+      auto waiter = priority_class->queue.front();
+      priority_class->queue.pop_front();
+      this->in_flight_++;
+      waiter->admitted = true;
+      auto handle = waiter->handle;
+      waiter->loop->post([handle] {
+        handle.resume();
+      });
+    }
+  }
+
+  /**
+   * @return Whether the queue of a class is full while no slot is free
+   */
+  bool isSaturated(size_t priority_class) {
+    lock_guard<mutex> guard(this->lock_);
+    this->removeCancelled();
+    return this->in_flight_ >= this->max_concurrency_ &&
+           this->classes_[priority_class].queue.size() >=
+           this->classes_[priority_class].max_queue_size;
+  }
+
+  static unique_ptr<Response> makeOverloadedResponse() {
+    auto response = make_unique<Response>(Response::Status::SERVICE_UNAVAILABLE);
+    response->setHeader("Retry-After", "1");
+    return response;
+  }
+
+public:
+  /**
+   * Creates a scheduler with a single class, "default", to which more classes can be added.
+   * @param max_concurrency The maximum number of requests processed at the same time
+   * @param max_queue_size The maximum number of requests of the default class waiting
+   * @param weight The weight of the default class
+   */
+  explicit PriorityScheduler(size_t max_concurrency, size_t max_queue_size = 128, int weight = 10)
+    : max_concurrency_(max(max_concurrency, size_t(1))), in_flight_(0), default_class_(0) {
+    this->addClass("default", weight, max_queue_size);
+  }
+
+  /**
+   * @param name The name of the class
+   * @param weight The share of the slots the class gets under saturation, relative to the other
+   *  classes
+   * @param max_queue_size The maximum number of requests of the class waiting, 0 to shed them
+   *  under saturation
+   * @return The index of the class
+   */
+  size_t addClass(string name, int weight, size_t max_queue_size) {
+    if (weight <= 0) {
+      throw utils::RuntimeException("Invalid priority class weight");
+    }
+    this->classes_.push_back({move(name), weight, max_queue_size, {}, 0});
+    return this->classes_.size() - 1;
+  }
+
+  /**
+   * @param name The name of a class
+   * @return The index of the class
+   * @throw out_of_range Thrown if there is no such class
+   */
+  size_t getClass(const string &name) const {
+    for (size_t i = 0; i < this->classes_.size(); i++) {
+      if (this->classes_[i].name == name) {
+        return i;
+      }
+    }
+    throw out_of_range("Unknown priority class " + name);
+  }
+
+  /**
+   * Sets the class of the requests matching no rule.
+   */
+  void setDefaultClass(size_t priority_class) {
+    this->default_class_ = priority_class;
+  }
+
+  /**
+   * Adds a rule sorting requests into a class. Rules are tried in the order they are added, and
+   * the first matching one applies.
+   * @param matches Tells whether a request, of which only the head is received, matches the rule
+   * @param priority_class The class of the requests matching the rule
+   */
+  void addRule(function<bool(const ServerRequest &)> matches, size_t priority_class) {
+    this->rules_.push_back({move(matches), priority_class});
+  }
+
+  /**
+   * Sorts the requests whose path starts with a prefix into a class.
+   * @param prefix The prefix, percent-encoded
+   */
+  void addRouteRule(string prefix, size_t priority_class) {
+    this->addRule([prefix = move(prefix)](const ServerRequest &request) {
+      return request.getUri().getRawPath().substr(0, prefix.size()) == prefix;
+    }, priority_class);
+  }
+
+  /**
+   * Sorts the requests having a header into a class.
+   * @param value The value of the header, or an empty string for any value
+   */
+  void addHeaderRule(string name, string value, size_t priority_class) {
+    this->addRule([name = move(name), value = move(value)](const ServerRequest &request) {
+      if (!request.hasHeader(name)) {
+        return false;
+      }
+      const auto &values = request.getHeader(name);
+      return value.empty() || find(values.begin(), values.end(), value) != values.end();
+    }, priority_class);
+  }
+
+  /**
+   * Sorts the requests of the clients whose address starts with a prefix into a class.
+   * @param prefix The prefix of the address, such as "10.0."
+   */
+  void addClientRule(string prefix, size_t priority_class) {
+    this->addRule([prefix = move(prefix)](const ServerRequest &request) {
+      return request.getClientAddress().compare(0, prefix.size(), prefix) == 0;
+    }, priority_class);
+  }
+
+  /**
+   * @return The class of a request, according to the rules
+   */
+  size_t classify(const ServerRequest &request) const {
+    for (const auto &rule : this->rules_) {
+      if (rule.matches(request)) {
+        return rule.priority_class;
+      }
+    }
+    return this->default_class_;
+  }
+
+  size_t getInFlight() {
+    lock_guard<mutex> guard(this->lock_);
+    return this->in_flight_;
+  }
+
+  /**
+   * @return The number of requests of a class waiting
+   */
+  size_t getQueueSize(size_t priority_class) {
+    lock_guard<mutex> guard(this->lock_);
+    return this->classes_[priority_class].queue.size();
+  }
+
+  unsigned getPhases() const override {
+    return Middleware::HEADERS;
+  }
+
+  unique_ptr<Response> onHeaders(ServerRequest &request) override {
+    auto priority_class = this->classify(request);
+    request.emplaceAttribute(PRIORITY_CLASS, priority_class);
+    // Sheds the request before its body is read.
+    if (this->isSaturated(priority_class)) {
+      return PriorityScheduler::makeOverloadedResponse();
+    }
+    return nullptr;
+  }
+
+  response_task_t processAsync(ServerRequest &request, AsyncRequestHandler &handler) override {
+    auto priority_class = request.hasAttribute(PRIORITY_CLASS)
+                          ? request.getAttribute(PRIORITY_CLASS) : this->classify(request);
+    if (!co_await AdmissionAwaiter(*this, priority_class, request.getCancellation())) {
+      if (request.getCancellation().isCancelled()) {
+        co_return nullptr;
+      }
+      co_return PriorityScheduler::makeOverloadedResponse();
+    }
+    // The request may be cancelled once admitted, before it is resumed.
+    if (request.getCancellation().isCancelled()) {
+      this->release();
+      co_return nullptr;
+    }
+    unique_ptr<Response> response;
+    exception_ptr exception;
+    try {
+      response = co_await handler.handleAsync(request);
+    } catch (...) {
+      exception = current_exception();
+    }
+    this->release();
+    if (exception) {
+      rethrow_exception(exception);
+    }
+    co_return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_PRIORITY_H
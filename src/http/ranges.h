@@ -0,0 +1,268 @@
+#ifndef HTTP_RANGES_H
+#define HTTP_RANGES_H
+
+#include "application.h"
+#include "messages.h"
+#include <algorithm>
+#include <atomic>
+#include <random>
+
+using namespace std;
+
+namespace http {
+/**
+ * A range of bytes of a representation, bounds included.
+ */
+struct ByteRange {
+  size_t first;
+  size_t last;
+
+  size_t getLength() const {
+    return this->last - this->first + 1;
+  }
+
+  /**
+   * @param complete_length The length of the representation
+   * @return The value of a Content-Range header for the range
+   */
+  string toContentRange(size_t complete_length) const {
+    return "bytes " + to_string(this->first) + "-" + to_string(this->last) + "/" +
+           to_string(complete_length);
+  }
+
+  /**
+   * Parses the value of a Range header.
+   * @param value The value of the header
+   * @param complete_length The length of the representation
+   * @param out The output container for the satisfiable ranges, in the requested order
+   * @return False if the value is not a valid byte ranges specifier and must be ignored
+   */
+  static bool parse(const string &value, size_t complete_length, vector<ByteRange> &out) {
+    auto start = value.find_first_not_of(" \t");
+    if (start == string::npos || value.size() - start < 6 ||
+        utils::tolower(value.substr(start, 6)) != "bytes=") {
+      return false;
+    }
+    auto position = start + 6;
+    auto empty = true;
+    while (position <= value.size()) {
+      auto end = value.find(',', position);
+      if (end == string::npos) {
+        end = value.size();
+      }
+      auto spec_start = value.find_first_not_of(" \t", position);
+      auto spec_end = value.find_last_not_of(" \t", end - 1);
+      position = end + 1;
+      // Empty list elements are allowed.
+      if (spec_start == string::npos || spec_start >= end || spec_end < spec_start) {
+        continue;
+      }
+      empty = false;
+      auto dash = value.find('-', spec_start);
+      if (dash == string::npos || dash > spec_end) {
+        return false;
+      }
+      size_t first, last;
+      if (dash == spec_start) { // Suffix range.
+        size_t suffix_length;
+        if (!ByteRange::parseNumber(value, dash + 1, spec_end + 1, suffix_length)) {
+          return false;
+        }
+        if (suffix_length == 0 || complete_length == 0) {
+          continue;
+        }
+        first = complete_length - min(suffix_length, complete_length);
+        last = complete_length - 1;
+      } else {
+        if (!ByteRange::parseNumber(value, spec_start, dash, first)) {
+          return false;
+        }
+        last = complete_length - 1;
+        if (dash != spec_end) {
+          if (!ByteRange::parseNumber(value, dash + 1, spec_end + 1, last)) {
+            return false;
+          }
+          if (last < first) {
+            return false;
+          }
+          last = min(last, complete_length - 1);
+        }
+        if (first >= complete_length) {
+          continue;
+        }
+      }
+      out.push_back({first, last});
+    }
+    return !empty;
+  }
+
+  /**
+   * Sorts and merges overlapping or adjacent ranges.
+   * @param ranges The ranges
+   */
+  static void coalesce(vector<ByteRange> &ranges) {
+    if (ranges.size() < 2) {
+      return;
+    }
+    sort(ranges.begin(), ranges.end(), [](const ByteRange &a, const ByteRange &b) {
+      return a.first < b.first;
+    });
+    size_t merged = 0;
+    for (size_t i = 1; i < ranges.size(); i++) {
+      if (ranges[i].first <= ranges[merged].last + 1) {
+        ranges[merged].last = max(ranges[merged].last, ranges[i].last);
+      } else {
+        ranges[++merged] = ranges[i];
+      }
+    }
+    ranges.resize(merged + 1);
+  }
+
+protected:
+  static bool parseNumber(const string &value, size_t begin, size_t end, size_t &out) {
+    if (begin >= end) {
+      return false;
+    }
+    out = 0;
+    for (auto i = begin; i < end; i++) {
+      auto c = value[i];
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      auto digit = static_cast<size_t>(c - '0');
+      if (out > (SIZE_MAX - digit) / 10) {
+        return false;
+      }
+      out = out * 10 + digit;
+    }
+    return true;
+  }
+};
+
+/**
+ * Answers requests with a Range header by sending only the requested parts of the 200 responses
+ * produced by the next middleware. The parts are slices of the response's body segments: files are
+ * sent from the right offsets and buffers are never copied.
+ */
+class RangeRequests : public Middleware {
+protected:
+  size_t max_ranges_;
+
+  /**
+   * Evaluates the If-Range precondition.
+   * @return Whether the ranges may be sent
+   */
+  static bool matchesIfRange(const ServerRequest &request, const Response &response) {
+    if (!request.hasHeader("If-Range")) {
+      return true;
+    }
+    auto condition = utils::trim(request.getHeader("If-Range").front());
+    // Entity tag, only a strong comparison is allowed.
+    if (!condition.empty() && (condition[0] == '"' || condition.rfind("W/", 0) == 0)) {
+      if (condition[0] != '"' || !response.hasHeader("ETag")) {
+        return false;
+      }
+      return response.getHeader("ETag").front() == condition;
+    }
+    // HTTP-date, must be an exact match.
+    if (!response.hasHeader("Last-Modified")) {
+      return false;
+    }
+    return response.getHeader("Last-Modified").front() == condition;
+  }
+
+  static string makeBoundary() {
+    static atomic<unsigned long long> counter{random_device{}()};
+    auto value = counter.fetch_add(0x9E3779B97F4A7C15ull, memory_order_relaxed);
+    // Mixes the bits of the counter so that consecutive boundaries do not look alike.
+    value = (value ^ (value >> 30u)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27u)) * 0x94D049BB133111EBull;
+    value ^= value >> 31u;
+    static const char *digits = "0123456789abcdef";
+    string boundary(16, '0');
+    for (auto &c : boundary) {
+      c = digits[value & 0xfu];
+      value >>= 4u;
+    }
+    return boundary;
+  }
+
+  static void setMultipartBody(Response &response, const vector<ByteRange> &ranges,
+                               size_t complete_length) {
+    auto boundary = RangeRequests::makeBoundary();
+    string content_type;
+    if (response.hasHeader("Content-Type")) {
+      content_type = "\r\nContent-Type: " + response.getHeader("Content-Type").front();
+    }
+    body_segments_t segments;
+    for (const auto &range : ranges) {
+      segments.push_back(BodySegment::fromString(
+        "\r\n--" + boundary + content_type + "\r\nContent-Range: " +
+        range.toContentRange(complete_length) + "\r\n\r\n"));
+      sliceBodySegments(response.getBodySegments(), range.first, range.getLength(), segments);
+    }
+    segments.push_back(BodySegment::fromString("\r\n--" + boundary + "--\r\n"));
+    response.setBodySegments(move(segments));
+    response.setHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+  }
+
+public:
+  /**
+   * @param max_ranges The maximum number of ranges sent in a response, a request asking for more
+   *  distinct ranges gets the whole representation
+   */
+  explicit RangeRequests(size_t max_ranges = 16) : max_ranges_(max_ranges) {
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    auto response = handler.handle(request);
+    // Response headers are not inspected unless necessary, as they may be loaded lazily.
+    if (!response || !request.hasHeader("Range") ||
+        request.getMethod() != Request::Method::METHOD::GET ||
+        response->getStatus() != Response::Status::OK ||
+        response->hasHeader("Content-Range") ||
+        !RangeRequests::matchesIfRange(request, *response)) {
+      return response;
+    }
+
+    string value;
+    for (const auto &line : request.getHeader("Range")) {
+      if (!value.empty()) {
+        value += ',';
+      }
+      value += line;
+    }
+    auto complete_length = response->getBodyLength();
+    vector<ByteRange> ranges;
+    if (!ByteRange::parse(value, complete_length, ranges)) {
+      return response;
+    }
+    if (ranges.empty()) {
+      auto unsatisfiable = make_unique<Response>(Response::Status::RANGE_NOT_SATISFIABLE);
+      unsatisfiable->setHeader("Content-Range", "bytes */" + to_string(complete_length));
+      return unsatisfiable;
+    }
+    if (ranges.size() > this->max_ranges_) {
+      ByteRange::coalesce(ranges);
+      if (ranges.size() > this->max_ranges_) {
+        return response;
+      }
+    }
+
+    response->setStatus(Response::Status::PARTIAL_CONTENT);
+    response->setHeader("Accept-Ranges", "bytes");
+    if (ranges.size() == 1) {
+      body_segments_t segments;
+      sliceBodySegments(response->getBodySegments(), ranges[0].first, ranges[0].getLength(),
+                        segments);
+      response->setBodySegments(move(segments));
+      response->setHeader("Content-Range", ranges[0].toContentRange(complete_length));
+    } else {
+      RangeRequests::setMultipartBody(*response, ranges, complete_length);
+    }
+    return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_RANGES_H
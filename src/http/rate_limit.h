@@ -0,0 +1,181 @@
+#ifndef HTTP_RATE_LIMIT_H
+#define HTTP_RATE_LIMIT_H
+
+#include "application.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace http {
+/**
+ * Limits the rate of the requests of each client with a token bucket, rejecting the requests
+ * exceeding it with 429 Too Many Requests as soon as their head is received, before their body is
+ * read. Clients are identified by their address, or by the value of a header such as an API key.
+ *
+ * The buckets are stored in a hash table split in shards of fixed size, without locks: a bucket is
+ * represented by a single timestamp updated atomically, the time at which it will be full again
+ * (the generic cell rate algorithm). A bucket that is full is equivalent to no bucket, so its
+ * entry is reused for another client when needed, and idle clients expire without a sweep. When
+ * the entries a client may use are all taken by active clients, the client takes over the one of
+ * the least active, so that memory stays bounded whatever the number of clients.
+ *
+ * The clients are identified by a 64-bit hash of their key. The middleware is shared by the
+ * workers.
+ */
+class RateLimiter : public Middleware {
+protected:
+  struct Entry {
+    /// The hash of the key of the client, 0 for an entry never used.
+    atomic<uint64_t> key;
+    /// The time at which the bucket is full, in nanoseconds since the creation of the limiter.
+    atomic<int64_t> full_at;
+  };
+
+  /// The number of consecutive entries of a shard a client may use.
+  static constexpr size_t MAX_PROBES = 8;
+
+  int64_t interval_;
+  /// The time the bucket takes to fill up entirely.
+  int64_t burst_duration_;
+  string key_header_;
+  size_t shard_count_;
+  size_t shard_size_;
+  unique_ptr<unique_ptr<Entry[]>[]> shards_;
+  chrono::steady_clock::time_point start_;
+
+  int64_t now() const {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - this->start_)
+      .count();
+  }
+
+  /**
+   * @return The key identifying the client of a request
+   */
+  string_view getKey(const ServerRequest &request) const {
+    if (!this->key_header_.empty() && request.hasHeader(this->key_header_) &&
+        !request.getHeader(this->key_header_).empty()) {
+      return request.getHeader(this->key_header_).front();
+    }
+    // The port of the client is ignored.
+    string_view address = request.getClientAddress();
+    return address.substr(0, address.rfind(':'));
+  }
+
+  /**
+   * Finds the entry of a client, or assigns one to it.
+   */
+  Entry &findEntry(uint64_t key, int64_t now) {
+    auto &shard = this->shards_[key % this->shard_count_];
+    auto first = static_cast<size_t>(key / this->shard_count_);
+    Entry *reusable = nullptr;
+    Entry *least_active = nullptr;
+    for (size_t i = 0; i < MAX_PROBES; i++) {
+      auto &entry = shard[(first + i) % this->shard_size_];
+      auto entry_key = entry.key.load(memory_order_acquire);
+      if (entry_key == 0 &&
+          (entry.key.compare_exchange_strong(entry_key, key, memory_order_acq_rel) ||
+           entry_key == key)) {
+        return entry;
+      }
+      if (entry_key == key) {
+        return entry;
+      }
+      auto full_at = entry.full_at.load(memory_order_relaxed);
+      if (full_at <= now) {
+        if (!reusable) {
+          reusable = &entry;
+        }
+      } else if (!least_active || full_at < least_active->full_at.load(memory_order_relaxed)) {
+        least_active = &entry;
+      }
+    }
+    // Another client may take the entry meanwhile, and share it for a moment.
+    auto entry = reusable ? reusable : least_active;
+    entry->key.store(key, memory_order_release);
+    return *entry;
+  }
+
+public:
+  /**
+   * @param rate The number of requests per second allowed for a client
+   * @param burst The number of requests a client may send at once
+   * @param key_header A header identifying the clients, instead of their address for the requests
+   *  having it, or an empty string
+   * @param capacity The number of clients tracked at the same time
+   * @param shard_count The number of shards of the table
+   */
+  explicit RateLimiter(double rate, double burst = 1, string key_header = "",
+                       size_t capacity = 1u << 18u, size_t shard_count = 64)
+    : key_header_(move(key_header)), shard_count_(max<size_t>(shard_count, 1)),
+      start_(chrono::steady_clock::now()) {
+    if (rate <= 0 || burst < 1) {
+      throw utils::RuntimeException("Invalid rate limit");
+    }
+    this->interval_ = static_cast<int64_t>(1e9 / rate);
+    this->burst_duration_ = static_cast<int64_t>(this->interval_ * burst);
+    this->shard_size_ = max(capacity / this->shard_count_, MAX_PROBES);
+    this->shards_ = make_unique<unique_ptr<Entry[]>[]>(this->shard_count_);
+    for (size_t i = 0; i < this->shard_count_; i++) {
+      // Value-initialized, so the entries are unused and their buckets full.
+      this->shards_[i] = make_unique<Entry[]>(this->shard_size_);
+    }
+  }
+
+  unsigned getPhases() const override {
+    return Middleware::HEADERS;
+  }
+
+  /**
+   * Takes a token from the bucket of the client of a request.
+   * @param request The request
+   * @param retry_after Set to the time before the request would be allowed, if it is not
+   * @return Whether the request is allowed
+   */
+  bool tryAcquire(const ServerRequest &request, chrono::seconds *retry_after = nullptr) {
+    auto key = hash<string_view>()(this->getKey(request));
+    // 0 marks unused entries.
+    if (key == 0) {
+      key = 1;
+    }
+    auto now = this->now();
+    auto &entry = this->findEntry(key, now);
+    auto full_at = entry.full_at.load(memory_order_relaxed);
+    while (true) {
+      auto next_full_at = max(full_at, now) + this->interval_;
+      if (next_full_at - now > this->burst_duration_) {
+        if (retry_after) {
+          *retry_after = chrono::seconds(static_cast<int64_t>(
+            ceil(static_cast<double>(next_full_at - now - this->burst_duration_) / 1e9)));
+        }
+        return false;
+      }
+      if (entry.full_at.compare_exchange_weak(full_at, next_full_at, memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+  unique_ptr<Response> onHeaders(ServerRequest &request) override {
+    chrono::seconds retry_after(0);
+    if (this->tryAcquire(request, &retry_after)) {
+      return nullptr;
+    }
+    auto response = make_unique<Response>(Response::Status::TOO_MANY_REQUESTS);
+    response->setHeader("Retry-After", to_string(max<int64_t>(retry_after.count(), 1)));
+    return response;
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    return handler.handle(request);
+  }
+};
+} // namespace http
+
+#endif //HTTP_RATE_LIMIT_H
@@ -0,0 +1,346 @@
+#ifndef HTTP_ROUTER_H
+#define HTTP_ROUTER_H
+
+#include "application.h"
+#include "messages.h"
+#include <array>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+namespace http {
+/**
+ * The values captured by the route matching a request, available as the Router::PARAMETERS
+ * attribute of the request. Values are views into the path of the
+ * request and names are views into the patterns of the router, so that matching does not copy.
+ */
+class RouteParameters {
+  friend class Router;
+protected:
+  vector<pair<string_view, string_view>> parameters_;
+  string_view wildcard_name_;
+  string_view wildcard_;
+  bool has_wildcard_ = false;
+
+public:
+  /**
+   * @param name The name of a parameter, without its ':' or '*' prefix
+   * @return Whether the route captured the parameter
+   */
+  bool has(string_view name) const {
+    if (this->has_wildcard_ && this->wildcard_name_ == name) {
+      return true;
+    }
+    for (const auto &parameter : this->parameters_) {
+      if (parameter.first == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @param name The name of a parameter, without its ':' or '*' prefix
+   * @return The value of the parameter, valid as long as the request and the router are
+   * @throw out_of_range Thrown if the route did not capture the parameter
+   */
+  string_view get(string_view name) const {
+    if (this->has_wildcard_ && this->wildcard_name_ == name) {
+      return this->wildcard_;
+    }
+    for (const auto &parameter : this->parameters_) {
+      if (parameter.first == name) {
+        return parameter.second;
+      }
+    }
+    throw out_of_range("Unknown route parameter");
+  }
+
+  const vector<pair<string_view, string_view>> &getParameters() const {
+    return this->parameters_;
+  }
+};
+
+/**
+ * Dispatches requests to middleware according to their method and path. Routes are stored in a
+ * radix tree over path segments: consecutive static segments shared by routes are stored once, in
+ * a single node, and the children of a node are indexed by their first segment. Finding a route
+ * thus costs a few lookups per segment of the path, whatever the number of routes.
+ *
+ * A route pattern is a path whose segments may be:
+ *  - a static segment, matched exactly;
+ *  - a parameter ":name", matching any one segment;
+ *  - a wildcard "*name", as the last segment, matching the remaining segments, if any.
+ * Static segments take precedence over parameters, which take precedence over wildcards.
+ *
+ * The middleware of the matching route receives the next handler of the router, so it can pass
+ * the request on. It is called synchronously, so it cannot be an asynchronous middleware. Requests
+ * matching no route are passed to the next middleware, and requests matching a route only for
+ * other methods are answered with 405 Method Not Allowed.
+ */
+class Router : public Middleware {
+public:
+  inline static const AttributeKey<RouteParameters> PARAMETERS{"route_parameters"};
+
+protected:
+  static constexpr size_t METHOD_COUNT = static_cast<size_t>(Request::Method::METHOD::CONNECT) + 1;
+  typedef array<shared_ptr<Middleware>, METHOD_COUNT> targets_t;
+
+  struct Node {
+    /// Static segments matched by the node, empty for the root and parameter nodes.
+    vector<string> label;
+    /// The first segment of the label, viewed by the key of the node in its parent.
+    string key;
+    unordered_map<string_view, unique_ptr<Node>> children;
+    unique_ptr<Node> parameter;
+    string parameter_name;
+    targets_t targets;
+    /// Targets of a wildcard following the node.
+    targets_t wildcard_targets;
+    string wildcard_name;
+  };
+
+  Node root_;
+
+  static size_t getIndex(const Request::Method &method) {
+    return static_cast<size_t>(method.getValue());
+  }
+
+  static bool isEmpty(const targets_t &targets) {
+    for (const auto &target : targets) {
+      if (target) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @return The target of a method, GET targets also handling HEAD
+   */
+  static Middleware *findTarget(const targets_t &targets, const Request::Method &method) {
+    auto &target = targets[Router::getIndex(method)];
+    if (!target && method == Request::Method::METHOD::HEAD) {
+      return targets[Router::getIndex(Request::Method::METHOD::GET)].get();
+    }
+    return target.get();
+  }
+
+  static void setTarget(targets_t &targets, const Request::Method &method,
+                        shared_ptr<Middleware> &&target, const string &pattern) {
+    auto &slot = targets[Router::getIndex(method)];
+    if (slot) {
+      throw utils::RuntimeException("Duplicate route %s %s",
+                                    static_cast<const char *>(method), pattern.c_str());
+    }
+    slot = move(target);
+  }
+
+  /**
+   * Inserts static segments below a node, splitting existing nodes sharing a prefix with them.
+   * @return The node matching the last segment
+   */
+  static Node *insertStatic(Node *node, const vector<string> &segments, size_t begin,
+                            size_t end) {
+    while (begin < end) {
+      auto position = node->children.find(segments[begin]);
+      if (position == node->children.end()) {
+        auto child = make_unique<Node>();
+        child->label.assign(segments.begin() + begin, segments.begin() + end);
+        child->key = child->label.front();
+        auto result = child.get();
+        node->children.emplace(result->key, move(child));
+        return result;
+      }
+      auto child = position->second.get();
+      size_t common = 0;
+      while (common < child->label.size() && begin + common < end &&
+             child->label[common] == segments[begin + common]) {
+        common++;
+      }
+      if (common < child->label.size()) {
+        // Splits the child at the end of the common prefix.
+        auto split = make_unique<Node>();
+        split->label.assign(child->label.begin(), child->label.begin() + common);
+        split->key = split->label.front();
+        auto suffix = move(position->second);
+        node->children.erase(position);
+        suffix->label.erase(suffix->label.begin(), suffix->label.begin() + common);
+        suffix->key = suffix->label.front();
+        auto suffix_key = string_view(suffix->key);
+        split->children.emplace(suffix_key, move(suffix));
+        child = split.get();
+        node->children.emplace(child->key, move(split));
+      }
+      node = child;
+      begin += common;
+    }
+    return node;
+  }
+
+  /**
+   * Finds the route matching the segments of a path from a node, backtracking when a more specific
+   * branch leads nowhere.
+   * @param allowed The output for the methods of the routes matching the path with other methods
+   * @return The target, or nullptr
+   */
+  static Middleware *match(const Node &node, const Request::Method &method,
+                           const vector<string_view> &path, size_t index,
+                           RouteParameters &parameters, targets_t const *&allowed) {
+    if (index == path.size()) {
+      if (auto target = Router::findTarget(node.targets, method)) {
+        return target;
+      }
+      if (!allowed && !Router::isEmpty(node.targets)) {
+        allowed = &node.targets;
+      }
+    } else {
+      auto position = node.children.find(path[index]);
+      if (position != node.children.end()) {
+        const auto &child = *position->second;
+        auto length = child.label.size();
+        if (index + length <= path.size() &&
+            equal(child.label.begin(), child.label.end(), path.begin() + index)) {
+          auto target = Router::match(child, method, path, index + length, parameters, allowed);
+          if (target) {
+            return target;
+          }
+        }
+      }
+      if (node.parameter) {
+        parameters.parameters_.emplace_back(node.parameter_name, path[index]);
+        auto target = Router::match(*node.parameter, method, path, index + 1, parameters,
+                                    allowed);
+        if (target) {
+          return target;
+        }
+        parameters.parameters_.pop_back();
+      }
+    }
+    if (!Router::isEmpty(node.wildcard_targets)) {
+      if (auto target = Router::findTarget(node.wildcard_targets, method)) {
+        parameters.has_wildcard_ = true;
+        parameters.wildcard_name_ = node.wildcard_name;
+        // Segments are contiguous, in the target or in the decoded path.
+        if (index < path.size()) {
+          parameters.wildcard_ = string_view(
+            path[index].data(), path.back().data() + path.back().size() - path[index].data());
+        }
+        return target;
+      }
+      if (!allowed) {
+        allowed = &node.wildcard_targets;
+      }
+    }
+    return nullptr;
+  }
+
+public:
+  /**
+   * Adds a route.
+   * @param method The method of the requests handled by the route
+   * @param pattern The pattern of the paths handled by the route
+   * @param target The middleware processing the matching requests
+   * @return The router
+   * @throw utils::RuntimeException Thrown if the pattern is invalid or conflicts with another route
+   */
+  Router &add(const Request::Method &method, const string &pattern,
+              shared_ptr<Middleware> target) {
+    auto segments = utils::split(pattern, '/');
+    auto node = &this->root_;
+    size_t begin = 0;
+    for (size_t i = 0; i <= segments.size(); i++) {
+      auto end_of_static = i == segments.size() || segments[i][0] == ':' || segments[i][0] == '*';
+      if (!end_of_static) {
+        continue;
+      }
+      node = Router::insertStatic(node, segments, begin, i);
+      begin = i + 1;
+      if (i == segments.size()) {
+        Router::setTarget(node->targets, method, move(target), pattern);
+        return *this;
+      }
+      auto name = segments[i].substr(1);
+      if (segments[i][0] == '*') {
+        if (i + 1 != segments.size()) {
+          throw utils::RuntimeException("Wildcard not at the end of route %s", pattern.c_str());
+        }
+        if (!Router::isEmpty(node->wildcard_targets) && node->wildcard_name != name) {
+          throw utils::RuntimeException("Conflicting wildcard names in route %s",
+                                        pattern.c_str());
+        }
+        node->wildcard_name = move(name);
+        Router::setTarget(node->wildcard_targets, method, move(target), pattern);
+        return *this;
+      }
+      if (name.empty()) {
+        throw utils::RuntimeException("Unnamed parameter in route %s", pattern.c_str());
+      }
+      if (!node->parameter) {
+        node->parameter = make_unique<Node>();
+        node->parameter_name = move(name);
+      } else if (node->parameter_name != name) {
+        throw utils::RuntimeException("Conflicting parameter names in route %s", pattern.c_str());
+      }
+      node = node->parameter.get();
+    }
+    return *this;
+  }
+
+  Router &get(const string &pattern, shared_ptr<Middleware> target) {
+    return this->add(Request::Method::METHOD::GET, pattern, move(target));
+  }
+
+  Router &post(const string &pattern, shared_ptr<Middleware> target) {
+    return this->add(Request::Method::METHOD::POST, pattern, move(target));
+  }
+
+  Router &put(const string &pattern, shared_ptr<Middleware> target) {
+    return this->add(Request::Method::METHOD::PUT, pattern, move(target));
+  }
+
+  Router &patch(const string &pattern, shared_ptr<Middleware> target) {
+    return this->add(Request::Method::METHOD::PATCH, pattern, move(target));
+  }
+
+  Router &del(const string &pattern, shared_ptr<Middleware> target) {
+    return this->add(Request::Method::METHOD::DELETE, pattern, move(target));
+  }
+
+  /**
+   * Returns the parameters captured by the route that matched a request.
+   * @param request The request
+   * @return The parameters
+   * @throw out_of_range Thrown if the request was not routed
+   */
+  static const RouteParameters &getParameters(ServerRequest &request) {
+    return request.getAttribute(PARAMETERS);
+  }
+
+  unique_ptr<Response> process(ServerRequest &request, RequestHandler &handler) override {
+    RouteParameters parameters;
+    targets_t const *allowed = nullptr;
+    auto target = Router::match(this->root_, request.getMethod(), request.getUri().getPath(), 0,
+                                parameters, allowed);
+    if (target) {
+      request.setAttribute(PARAMETERS, move(parameters));
+      return target->process(request, handler);
+    }
+    if (!allowed) {
+      return handler.handle(request);
+    }
+    auto response = make_unique<Response>(Response::Status::METHOD_NOT_ALLOWED);
+    for (size_t i = 0; i < METHOD_COUNT; i++) {
+      Request::Method method(static_cast<Request::Method::METHOD>(i));
+      // GET targets also handle HEAD.
+      if (Router::findTarget(*allowed, method)) {
+        response->setAddedHeader("Allow", string(method));
+      }
+    }
+    return response;
+  }
+};
+} // namespace http
+
+#endif //HTTP_ROUTER_H
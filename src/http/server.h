@@ -2,66 +2,345 @@
 #define HTTP_SERVER_H
 
 #include "application.h"
+#include "async.h"
 #include "messages.h"
 #include "../net/tcp.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <list>
+#include <mutex>
+#include <optional>
 
 using namespace std;
 
 namespace http {
-class HTTPServer : public net::TCPServer, public RequestHandler {
+class HTTPServer : public net::TCPServer, public RequestHandler, public AsyncRequestHandler,
+                   public RequestDispatcher {
+public:
+  typedef function<unique_ptr<Middleware>()> middleware_factory_t;
+
 protected:
+  /**
+   * The middleware of a worker, in order: the instances shared by all the workers and the
+   * worker's own instances. A chain is kept alive by the requests it processes, so that the
+   * requests still suspended once their worker stopped can complete.
+   */
+  struct Chain : public enable_shared_from_this<Chain> {
+    struct Element {
+      Middleware *middleware;
+      /// The middleware if it is asynchronous, or nullptr.
+      AsyncMiddleware *async_middleware;
+    };
+
+    const HTTPServer *server;
+    application_middleware_t owned;
+    vector<Element> middleware;
+    /// The middleware subscribing to each phase, in order.
+    vector<Middleware *> headers_middleware;
+    vector<Middleware *> body_chunk_middleware;
+    vector<Middleware *> complete_middleware;
+
+    explicit Chain(const HTTPServer &server) : server(&server) {
+      for (const auto &entry : server.middleware_entries_) {
+        auto middleware = entry.shared;
+        if (!middleware) {
+          this->owned.push_back(entry.factory());
+          middleware = this->owned.back().get();
+        }
+        this->middleware.push_back({middleware, dynamic_cast<AsyncMiddleware *>(middleware)});
+        auto phases = middleware->getPhases();
+        if (phases & Middleware::HEADERS) {
+          this->headers_middleware.push_back(middleware);
+        }
+        if (phases & Middleware::BODY_CHUNK) {
+          this->body_chunk_middleware.push_back(middleware);
+        }
+        if (phases & Middleware::COMPLETE) {
+          this->complete_middleware.push_back(middleware);
+        }
+      }
+    }
+  };
+
+  struct MiddlewareEntry {
+    /// The instance shared by the workers, or nullptr.
+    Middleware *shared;
+    /// Creates an instance per worker otherwise.
+    middleware_factory_t factory;
+  };
+
   application_middleware_t middleware_;
+  vector<MiddlewareEntry> middleware_entries_;
+  /// The chains of the running workers.
+  list<shared_ptr<Chain>> worker_chains_;
+  mutex worker_chains_lock_;
+  /// The chain of the threads that are not workers, created on demand.
+  shared_ptr<Chain> default_chain_;
+  once_flag default_chain_created_;
+  inline static thread_local Chain *current_chain_ = nullptr;
+
   struct MiddlewareStatus {
-    application_middleware_t::const_iterator current;
-    bool process_interrupted;
+    shared_ptr<const Chain> chain;
+    size_t current;
 
-    explicit MiddlewareStatus(application_middleware_t::const_iterator &&current) :
-      current(move(current)), process_interrupted(false) {
+    explicit MiddlewareStatus(shared_ptr<const Chain> chain) : chain(move(chain)), current(0) {
     }
   };
-  inline static const string MIDDLEWARE_STATUS_ATTRIBUTE = "_middleware_status";
+  inline static const AttributeKey<MiddlewareStatus> MIDDLEWARE_STATUS{"_middleware_status"};
+  unique_ptr<utils::Executor> executor_;
+  once_flag executor_created_;
+  /// The data received from a client and the requests completed before other clients proceed.
+  size_t receive_budget_;
+  size_t request_budget_;
+  /// The time given to a request once its head is received, 0 for no limit.
+  chrono::milliseconds request_timeout_;
+  /// Maximum number of requests in progress, 0 for no limit.
+  size_t max_requests_;
+  atomic<size_t> request_count_;
+  /// Sent to the requests exceeding the limit, serialized once.
+  Response overloaded_response_;
+
+  /**
+   * Counts a request whose head is received, unless the limit is reached.
+   * @return Whether the request is accepted
+   */
+  bool admitRequest() {
+    if (this->request_count_.fetch_add(1) >= this->max_requests_ && this->max_requests_ != 0) {
+      this->request_count_--;
+      return false;
+    }
+    return true;
+  }
+
+  void releaseRequest() {
+    this->request_count_--;
+  }
+
+  /**
+   * Sets the deadline of a request whose head is received, from the timeout of the server and
+   * the deadline given by the client, if any.
+   * @return Whether the deadline is not passed already
+   */
+  bool startDeadline(ServerRequest &request) {
+    auto &cancellation = request.getCancellation();
+    if (this->request_timeout_.count() > 0) {
+      cancellation.setDeadline(Cancellation::clock_t::now() + this->request_timeout_);
+    }
+    if (request.hasHeader(DEADLINE_HEADER) && !request.getHeader(DEADLINE_HEADER).empty()) {
+      try {
+        // The deadline is absolute, so the clocks are converted. It is clamped to the next day
+        // first, as the clocks overflow with distant times.
+        auto now = chrono::duration_cast<chrono::milliseconds>(
+          chrono::system_clock::now().time_since_epoch()).count();
+        auto deadline = clamp<chrono::milliseconds::rep>(
+          stoll(request.getHeader(DEADLINE_HEADER).front()), now,
+          now + chrono::milliseconds(chrono::hours(24)).count());
+        cancellation.setDeadline(Cancellation::clock_t::now() +
+                                 chrono::milliseconds(deadline - now));
+      } catch (const logic_error &) {
+        // The header is ignored if it is invalid.
+      }
+    }
+    return !cancellation.isCancelled();
+  }
+
+  /**
+   * @return The chain of the current thread
+   */
+  Chain &getChain() {
+    auto chain = HTTPServer::current_chain_;
+    if (chain && chain->server == this) {
+      return *chain;
+    }
+    call_once(this->default_chain_created_, [this] {
+      this->default_chain_ = make_shared<Chain>(*this);
+    });
+    return *this->default_chain_;
+  }
+
+  void workerStarted(net::EventLoop &loop) override {
+    auto chain = make_shared<Chain>(*this);
+    HTTPServer::current_chain_ = chain.get();
+    this->worker_chains_lock_.lock();
+    this->worker_chains_.push_back(move(chain));
+    this->worker_chains_lock_.unlock();
+  }
+
+  void workerStopped(net::EventLoop &loop) override {
+    auto chain = HTTPServer::current_chain_;
+    HTTPServer::current_chain_ = nullptr;
+    this->worker_chains_lock_.lock();
+    this->worker_chains_.remove_if([chain](const shared_ptr<Chain> &worker_chain) {
+      return worker_chain.get() == chain;
+    });
+    this->worker_chains_lock_.unlock();
+  }
+
+  /**
+   * @return The next middleware of the chain of a request
+   */
+  const typename Chain::Element &nextMiddleware(ServerRequest &request) {
+    auto &status = request.getAttribute(MIDDLEWARE_STATUS);
+    if (status.current == status.chain->middleware.size()) {
+      throw utils::RuntimeException("Middleware stack exhausted");
+    }
+    return status.chain->middleware[status.current++];
+  }
+
+  /**
+   * Runs the middleware on a completely received request.
+   */
+  response_task_t processRequest(ServerRequest &request) {
+    request.emplaceAttribute(MIDDLEWARE_STATUS, this->getChain().shared_from_this());
+    request.dispatcher_ = this;
+    return this->handleAsync(request);
+  }
+
+  /**
+   * @return The response of a completed processing, or nullptr if it failed
+   */
+  static unique_ptr<Response> getResponse(response_task_t &task) {
+    try {
+      return task.get();
+    } catch (...) {
+      return nullptr;
+    }
+  }
+
+  unique_ptr<Response> runHeadersPhase(ServerRequest &request) {
+    for (auto middleware : this->getChain().headers_middleware) {
+      auto response = middleware->onHeaders(request);
+      if (response) {
+        return response;
+      }
+    }
+    return nullptr;
+  }
+
+  unique_ptr<Response> runBodyChunkPhase(ServerRequest &request, const char *data,
+                                         size_t length) {
+    for (auto middleware : this->getChain().body_chunk_middleware) {
+      auto response = middleware->onBodyChunk(request, data, length);
+      if (response) {
+        return response;
+      }
+    }
+    return nullptr;
+  }
+
+  void runCompletePhase(ServerRequest &request, const Response &response) {
+    for (auto middleware : this->getChain().complete_middleware) {
+      try {
+        middleware->onComplete(request, response);
+      } catch (...) {
+      }
+    }
+  }
+
+  /**
+   * Maximum time in milliseconds to wait for a client to accept more data.
+   */
+  static constexpr int SEND_TIMEOUT = 30000;
+  /**
+   * Maximum time in milliseconds to wait for a client to close a connection ended by the server.
+   */
+  static constexpr int LINGER_TIMEOUT = 2000;
+  /**
+   * Maximum data discarded from a client before a connection ended by the server is closed.
+   */
+  static constexpr size_t MAX_LINGER_DATA = 1 << 20;
 
-  void resetRequestMiddlewareStatus(ServerRequest &request) const {
-    request.setAttribute(MIDDLEWARE_STATUS_ATTRIBUTE,
-                         make_any<MiddlewareStatus>(this->middleware_.cbegin()));
+  /**
+   * @return The segments of a response, starting with its head
+   */
+  static vector<const BodySegment *> getSegments(Response &response) {
+    vector<const BodySegment *> segments;
+    segments.push_back(&response.serializeHead());
+    for (const auto &segment : response.getBodySegments()) {
+      segments.push_back(&segment);
+    }
+    return segments;
   }
 
-  unique_ptr<net::Socket> &&sendResponse(unique_ptr<Response> response,
-                                         unique_ptr<net::Socket> &&client) const {
-    auto content = response->getBody().str();
-    response->setHeader("Content-Length", to_string(content.length()));
-
-    string head = response->getProtocolVersion();
-    head += " ";
-    head += to_string(response->getStatus());
-    head += " ";
-    head += response->getReasonPhrase();
-    head += "\r\n";
-    for (const auto &header : response->getHeaders()) {
-      head += header.first + ":";
-      auto first = true;
-      for (const auto &value : header.second) {
-        if (!first) {
-          head += ',';
+  /**
+   * Sends segments until they are all sent or the client cannot accept more data for now. Files
+   * are sent without copy, and consecutive memory segments with as few calls as possible.
+   * @param next The index of the first segment not entirely sent, updated
+   * @param offset The data of that segment already sent, updated
+   * @return Whether all the segments are sent
+   */
+  static bool sendSegments(net::Socket &client, const vector<const BodySegment *> &segments,
+                           size_t &next, size_t &offset) {
+    net::SocketBuffer buffers[16];
+    while (true) {
+      while (next < segments.size() && offset == segments[next]->getLength()) {
+        next++;
+        offset = 0;
+      }
+      if (next == segments.size()) {
+        return true;
+      }
+      long int sent;
+      if (segments[next]->isFile()) {
+        auto &segment = *segments[next];
+        sent = client.sendfile(*segment.getFile(), segment.getOffset() + offset,
+                               segment.getLength() - offset);
+        if (sent == 0) {
+          throw utils::RuntimeException("File shorter than body segment");
+        }
+      } else {
+        size_t count = 0;
+        for (auto i = next; i < segments.size() && count < 16 && !segments[i]->isFile(); i++) {
+          auto skip = i == next ? offset : 0;
+          buffers[count++] = {segments[i]->getData() + skip, segments[i]->getLength() - skip};
+        }
+        sent = client.sendv(buffers, count);
+      }
+      if (sent < 0) {
+        return false;
+      }
+      for (auto remaining = static_cast<size_t>(sent); remaining > 0;) {
+        auto length = min(remaining, segments[next]->getLength() - offset);
+        offset += length;
+        remaining -= length;
+        if (offset == segments[next]->getLength()) {
+          next++;
+          offset = 0;
         }
-        head += value;
-        first = false;
       }
-      head += "\r\n";
     }
-    head += "\r\n";
+  }
+
+  /**
+   * Sends segments as far as the client accepts data without waiting, before the connection is
+   * closed.
+   */
+  static void trySend(net::Socket &client, const vector<const BodySegment *> &segments) {
+    size_t next = 0, offset = 0;
     try {
-      client->send(head.c_str(), head.length());
-      client->send(content.c_str(), content.length());
+      HTTPServer::sendSegments(client, segments, next, offset);
     } catch (...) {
-      client->close();
+      // The connection is closed anyway.
     }
-    return move(client);
   }
 
 public:
-  explicit HTTPServer(unique_ptr<net::Socket> &&socket) : TCPServer(move(socket)) {
+  /**
+   * Header giving the deadline of a request, as milliseconds since the Unix epoch, for instance
+   * set by a proxy with a timeout of its own. The request is cancelled once it is passed.
+   */
+  static constexpr const char *DEADLINE_HEADER = "X-Request-Deadline";
+
+  explicit HTTPServer(unique_ptr<net::Socket> &&socket) : TCPServer(move(socket)),
+                                                          receive_budget_(65536),
+                                                          request_budget_(16),
+                                                          request_timeout_(0),
+                                                          max_requests_(0),
+                                                          request_count_(0) {
+    this->setRequestLimit(0);
   }
 
   static unique_ptr<HTTPServer> with(int ai_family, const char *name, const char *service,
@@ -71,67 +350,239 @@ public:
                                       reuse));
   }
 
+  /**
+   * Sets the executor running the blocking work of the middleware. Must be called before the
+   * executor is used.
+   * @param thread_count The number of threads, 0 to use the number of hardware threads
+   * @param max_pending The maximum number of jobs waiting for a thread
+   */
+  void setExecutor(size_t thread_count, size_t max_pending = 1024) {
+    call_once(this->executor_created_, [this, thread_count, max_pending] {
+      this->executor_ = make_unique<utils::Executor>(thread_count, max_pending);
+    });
+  }
+
+  /**
+   * @return The executor running the blocking work of the middleware, created with default
+   *  settings if not set
+   */
+  utils::Executor &getExecutor() {
+    this->setExecutor(0);
+    return *this->executor_;
+  }
+
+  /**
+   * Runs a function on the executor of the server, from a coroutine running on a worker.
+   * @param function The blocking function
+   * @return An awaitable resuming on the worker with the result of the function
+   */
+  template<typename F>
+  auto offload(F function) {
+    return net::EventLoop::require().offload(this->getExecutor(), move(function));
+  }
+
+  /**
+   * Sets the budget of a client in a round of its worker. Once a client received that much data
+   * or completed that many requests, the other clients of the worker proceed before it continues,
+   * so that a client sending large bodies or many pipelined requests cannot monopolize a worker.
+   * Must be called before the server runs.
+   * @param receive_budget The data received, in bytes
+   * @param request_budget The requests completed
+   */
+  void setClientBudget(size_t receive_budget, size_t request_budget) {
+    this->receive_budget_ = max<size_t>(receive_budget, 1);
+    this->request_budget_ = max<size_t>(request_budget, 1);
+  }
+
+  /**
+   * Sets the time given to each request once its head is received. The request is cancelled
+   * afterwards (see ServerRequest::getCancellation), and answered with 504 Gateway Timeout if it
+   * fails meanwhile. Must be called before the server runs.
+   * @param timeout The timeout, 0 for none
+   */
+  void setRequestTimeout(chrono::milliseconds timeout) {
+    this->request_timeout_ = timeout;
+  }
+
+  /**
+   * Limits the number of requests in progress. Requests exceeding the limit are answered with a
+   * 503 Service Unavailable response as soon as their head is received, without running the
+   * middleware, and their connection is closed. Must be called before the server runs.
+   * @param max_requests The maximum number of requests, 0 for no limit
+   * @param retry_after The delay in seconds suggested to the clients by the Retry-After header
+   */
+  void setRequestLimit(size_t max_requests, unsigned retry_after = 1) {
+    this->max_requests_ = max_requests;
+    this->overloaded_response_.clear();
+    this->overloaded_response_.setProtocolVersion({1, 1});
+    this->overloaded_response_.setStatus(Response::Status::SERVICE_UNAVAILABLE);
+    this->overloaded_response_.setHeader("Retry-After", to_string(retry_after));
+    this->overloaded_response_.setHeader("Connection", "close");
+    this->overloaded_response_.serializeHead();
+  }
+
+  size_t getRequestCount() const {
+    return this->request_count_;
+  }
+
+  /**
+   * Adds a middleware shared by all the workers. Must be called before the server runs.
+   * @param middleware The middleware, which must be thread-safe
+   */
   void addMiddleware(unique_ptr<Middleware> &&middleware) {
+    this->middleware_entries_.push_back({middleware.get(), nullptr});
     this->middleware_.push_back(move(middleware));
   }
 
+  /**
+   * Adds a middleware of which each worker gets its own instance, so that its state is not shared
+   * between threads. Must be called before the server runs.
+   * @param factory Creates the instance of a worker, in the worker's thread
+   */
+  void addMiddleware(middleware_factory_t factory) {
+    this->middleware_entries_.push_back({nullptr, move(factory)});
+  }
+
+  /**
+   * Calls a function with the middleware of a type: the shared instances and the instances of the
+   * running workers, for instance to merge their statistics. The state of an instance of a
+   * running worker is read while the worker uses it, and should be atomic.
+   * @tparam M The type of the middleware
+   * @param visitor The function
+   */
+  template<typename M>
+  void visitMiddleware(const function<void(M &)> &visitor) {
+    auto visit = [&visitor](const application_middleware_t &middleware) {
+      for (const auto &instance : middleware) {
+        if (auto typed_instance = dynamic_cast<M *>(instance.get())) {
+          visitor(*typed_instance);
+        }
+      }
+    };
+    visit(this->middleware_);
+    lock_guard<mutex> guard(this->worker_chains_lock_);
+    for (const auto &chain : this->worker_chains_) {
+      visit(chain->owned);
+    }
+    if (this->default_chain_) {
+      visit(this->default_chain_->owned);
+    }
+  }
+
   unique_ptr<Response> handle(ServerRequest &request) override {
-    auto &middleware_status = any_cast<MiddlewareStatus &>(
-      request.getAttribute(MIDDLEWARE_STATUS_ATTRIBUTE));
-    auto &current_middleware = middleware_status.current;
-    if (current_middleware == this->middleware_.cend()) {
-      throw utils::RuntimeException("Middleware stack exhausted");
+    return this->nextMiddleware(request).middleware->process(request, *this);
+  }
+
+  response_task_t handleAsync(ServerRequest &request) override {
+    auto &element = this->nextMiddleware(request);
+    if (element.async_middleware) {
+      co_return co_await element.async_middleware->processAsync(request, *this);
     }
-    auto &middleware = *current_middleware;
-    ++current_middleware;
-    middleware_status.process_interrupted = false;
-    auto response = middleware->process(request, *this);
-    if (!response && !middleware_status.process_interrupted) {
-      middleware_status.process_interrupted = true;
-      --current_middleware;
+    co_return element.middleware->process(request, *this);
+  }
+
+  /**
+   * Processes the request at the end of the current iteration of the worker's event loop, or right
+   * away in a thread that is not a worker. The phase hooks of the middleware are not run.
+   */
+  void dispatch(unique_ptr<ServerRequest> request,
+                function<void(unique_ptr<Response>)> completion) override {
+    auto run = [this, request = shared_ptr<ServerRequest>(move(request)), completion] {
+      auto task = make_shared<response_task_t>(this->processRequest(*request));
+      // The task, and the request it refers to, are kept until the task completes.
+      task->start([task, request, completion] {
+        completion(HTTPServer::getResponse(*task));
+      });
+      if (task->isDone()) {
+        completion(HTTPServer::getResponse(*task));
+      }
+    };
+    if (auto loop = net::EventLoop::current()) {
+      loop->defer(move(run));
+    } else {
+      run();
     }
-    return response;
   }
 
 protected:
   class HTTPClientEventsListener : public net::ClientEventsListener {
   protected:
+    /**
+     * Size of the buffer receiving data from the client.
+     */
+    static constexpr size_t RECEIVE_BUFFER_SIZE = 16384;
+    /**
+     * Maximum length of a line of the head of a request.
+     */
+    static constexpr size_t MAX_LINE_LENGTH = 16384;
+
     HTTPServer &server_;
+    net::TCPServer::client_id_t client_id_;
     ServerRequest current_request_;
+    unique_ptr<char[]> buffer_;
+    /// Received data not processed yet, between these offsets of the buffer.
+    size_t buffer_begin_;
+    size_t buffer_end_;
     string line_;
     size_t loaded_body_size_;
     bool response_sent_;
+    /// Whether the current request is counted by the server.
+    bool admitted_;
+    /// The processing of the current request, while it is suspended.
+    optional<response_task_t> processing_;
+    /// The client, kept while the current request is suspended, while the client yields or while
+    /// it cannot accept more of the response.
+    unique_ptr<net::Socket> suspended_client_;
+    /// The response being sent, kept until the client accepted all its data.
+    unique_ptr<Response> sending_;
+    vector<const BodySegment *> unsent_segments_;
+    /// The first segment not entirely sent, and the data of that segment already sent.
+    size_t unsent_index_;
+    size_t unsent_offset_;
+    /// The data discarded since the connection was ended.
+    size_t lingered_;
+    /// Closes the kept client if it is not ready in time.
+    optional<net::EventLoop::timer_id_t> wait_timer_;
+    /// The data received and the requests completed in the current round of the client.
+    size_t round_bytes_;
+    size_t round_requests_;
 
     void resetRequestParsing(bool preserveClientAddress = false) {
       this->current_request_.clear(preserveClientAddress);
-      this->server_.resetRequestMiddlewareStatus(this->current_request_);
       this->line_.clear();
       this->loaded_body_size_ = 0;
       this->response_sent_ = false;
+      this->releaseRequest();
     }
 
-    int receiveLine(unique_ptr<net::Socket> &client) {
-      auto line_started = !this->line_.empty();
-      auto expect_lf = this->line_.back() == '\r';
-      char c;
-      while (client->recv(&c, 1) > 0) {
-        if (c == '\r') {
-          expect_lf = true;
-          continue;
-        }
-        if (expect_lf) {
-          if (c == '\n') {
-            if (line_started) {
-              return 0; // Reached end of line.
-            }
-            return 1; // Line started with CRLF.
-          }
-          throw utils::RuntimeException("Invalid request data");
-        }
-        line_started = true;
-        this->line_.push_back(c);
+    void releaseRequest() {
+      if (this->admitted_) {
+        this->admitted_ = false;
+        this->server_.releaseRequest();
+      }
+    }
+
+    /**
+     * Extracts a line of the head from the received data.
+     * @return Whether the line is complete
+     */
+    bool extractLine() {
+      auto begin = this->buffer_.get() + this->buffer_begin_;
+      auto end = this->buffer_.get() + this->buffer_end_;
+      auto lf = static_cast<char *>(memchr(begin, '\n', end - begin));
+      auto line_end = lf ? lf : end;
+      this->line_.append(begin, line_end);
+      this->buffer_begin_ = lf ? lf - this->buffer_.get() + 1 : this->buffer_end_;
+      if (this->line_.size() > MAX_LINE_LENGTH) {
+        throw utils::RuntimeException("Request line too long");
+      }
+      if (!lf) {
+        return false;
       }
-      return -1; // Line is incomplete.
+      if (!this->line_.empty() && this->line_.back() == '\r') {
+        this->line_.pop_back();
+      }
+      return true;
     }
 
     void parseRequestLine() {
@@ -140,7 +591,7 @@ protected:
         throw utils::RuntimeException("Invalid request line");
       }
       this->current_request_.setMethod(ServerRequest::Method::fromString(tokens[0]));
-      this->current_request_.setUri(Uri::fromString(tokens[1]));
+      this->current_request_.setUri(Uri::fromString(move(tokens[1])));
       this->current_request_
           .setProtocolVersion(ServerRequest::ProtocolVersion::fromString(tokens[2]));
     }
@@ -152,112 +603,403 @@ protected:
                           utils::trim(this->line_.substr(colon + 1)));
     }
 
-  public:
-    explicit HTTPClientEventsListener(HTTPServer &server) : server_(server),
-                                                            loaded_body_size_(0),
-                                                            response_sent_(false) {
+    /**
+     * Sends a response produced before the request is completely received. The rest of the body
+     * will not be read, so the connection cannot be reused.
+     */
+    unique_ptr<net::Socket> &&sendEarlyResponse(unique_ptr<Response> response,
+                                                unique_ptr<net::Socket> &&client) {
+      this->response_sent_ = true;
+      return this->send(move(response), move(client));
     }
 
-    unique_ptr<net::Socket> &&connected(unique_ptr<net::Socket> &&client) override {
-      this->resetRequestParsing();
-      this->current_request_.client_address_ = static_cast<string>(client->getAddress());
-      return move(client);
+    /**
+     * Sends a response as far as the client accepts data without waiting. Otherwise, the client is
+     * kept, without processing its data, until it accepts the rest of the response.
+     * @return The client, or an empty pointer if it is kept
+     */
+    unique_ptr<net::Socket> &&send(unique_ptr<Response> response,
+                                   unique_ptr<net::Socket> &&client) {
+      this->unsent_segments_ = HTTPServer::getSegments(*response);
+      this->unsent_index_ = 0;
+      this->unsent_offset_ = 0;
+      this->sending_ = move(response);
+      return this->flush(move(client));
     }
 
-    unique_ptr<net::Socket> &&dataAvailable(unique_ptr<net::Socket> &&client) override {
+    unique_ptr<net::Socket> &&flush(unique_ptr<net::Socket> &&client) {
       try {
-        // Data is a line of the request's head.
-        while (this->current_request_.getState() < ServerRequest::STATE::HEADERS) {
-          auto line_status = this->receiveLine(client);
-          // Line is not complete, nothing has changed since last middleware execution.
-          if (line_status == -1) {
+        if (!HTTPServer::sendSegments(*client, this->unsent_segments_, this->unsent_index_,
+                                      this->unsent_offset_)) {
+          this->suspended_client_ = move(client);
+          this->waitClient(net::EventLoop::WRITABLE, HTTPServer::SEND_TIMEOUT);
+          return move(client);
+        }
+      } catch (...) {
+        client->close();
+      }
+      return this->responseSent(move(client));
+    }
+
+    /**
+     * Ends a connection whose client may still be sending, for instance the body of a request
+     * answered early. Closing the client with unread data would reset the connection, and the
+     * response with it, so the client is told that the server sends nothing more and its data is
+     * discarded until it closes the connection too, within limits.
+     * @return The client, or an empty pointer if it is kept
+     */
+    unique_ptr<net::Socket> &&closeGracefully(unique_ptr<net::Socket> &&client) {
+      try {
+        client->shutdown(SHUT_WR);
+      } catch (...) {
+        client->close();
+        return move(client);
+      }
+      this->lingered_ = 0;
+      return this->linger(move(client));
+    }
+
+    unique_ptr<net::Socket> &&linger(unique_ptr<net::Socket> &&client) {
+      try {
+        while (this->lingered_ < HTTPServer::MAX_LINGER_DATA) {
+          auto received = client->recv(this->buffer_.get(), RECEIVE_BUFFER_SIZE);
+          if (received == 0) {
+            break;
+          }
+          if (received < 0) {
+            this->suspended_client_ = move(client);
+            this->waitClient(net::EventLoop::READABLE, HTTPServer::LINGER_TIMEOUT);
             return move(client);
           }
-          // Line is the request line.
+          this->lingered_ += static_cast<size_t>(received);
+        }
+      } catch (...) {
+        // The connection is closed anyway.
+      }
+      client->close();
+      return move(client);
+    }
+
+    /**
+     * Continues with the kept client once it is ready for some events, or closes it if it is not
+     * ready in time.
+     * @param events The events, as for net::EventLoop::watch
+     * @param timeout The time in milliseconds
+     */
+    void waitClient(unsigned events, int timeout) {
+      auto &loop = net::EventLoop::require();
+      loop.watch(this->client_id_, events, [this] {
+        this->clientReady();
+      });
+      this->wait_timer_ = loop.addTimer(chrono::milliseconds(timeout), [this] {
+        this->wait_timer_.reset();
+        net::EventLoop::require().unwatch(this->client_id_);
+        this->suspended_client_->close();
+        this->clientReady();
+      });
+    }
+
+    /**
+     * Continues sending the response, or ending the connection, of the kept client.
+     */
+    void clientReady() {
+      auto &loop = net::EventLoop::require();
+      if (this->wait_timer_) {
+        loop.cancelTimer(*this->wait_timer_);
+        this->wait_timer_.reset();
+      }
+      this->startRound();
+      auto client = move(this->suspended_client_);
+      if (this->sending_) {
+        client = this->flush(move(client));
+      } else {
+        client = this->linger(move(client));
+      }
+      if (!client) {
+        return;
+      }
+      // Processes the pipelined requests, if any.
+      client = this->receive(move(client));
+      if (client) {
+        this->server_.resumeClient(this->client_id_, move(client));
+      }
+    }
+
+    /**
+     * Completes the current request once its response is entirely sent, or failed to be.
+     */
+    unique_ptr<net::Socket> &&responseSent(unique_ptr<net::Socket> &&client) {
+      auto response = move(this->sending_);
+      this->unsent_segments_.clear();
+      this->server_.runCompletePhase(this->current_request_, *response);
+      if (this->current_request_.getState() != ServerRequest::STATE::BODY) {
+        // The rest of the body will not be read.
+        return this->closeGracefully(move(client));
+      }
+      return this->endRequest(move(client));
+    }
+
+    /**
+     * Processes the received data.
+     * @return Whether the data was consumed entirely
+     */
+    unique_ptr<net::Socket> &&processBuffer(unique_ptr<net::Socket> &&client) {
+      while (this->buffer_begin_ < this->buffer_end_ && client && !client->isInvalid() &&
+             this->round_requests_ < this->server_.request_budget_) {
+        // Data is a line of the request's head.
+        if (this->current_request_.getState() < ServerRequest::STATE::HEADERS) {
+          if (!this->extractLine()) {
+            continue;
+          }
           if (this->current_request_.getState() == ServerRequest::STATE::INVALID) {
-            // Line started with CRLF unexpectedly.
-            if (line_status == 1) {
-              continue; // Skip CRLF and retry.
-            }
-            this->parseRequestLine();
-            this->current_request_.state_ = ServerRequest::STATE::REQUEST_LINE;
-          } else { // Line is a header line or end of the head.
-            // Line started with CRLF, end of the head.
-            if (line_status == 1) {
-              // Body is empty, the request is complete.
-              auto content_length = this->current_request_.getContentLength();
-              if (content_length == 0) {
-                this->current_request_.state_ = ServerRequest::STATE::BODY;
-              } else { // Body needs to be loaded.
-                this->current_request_.state_ = ServerRequest::STATE::HEADERS;
-              }
-              break;
+            // Skips empty lines preceding the request line.
+            if (!this->line_.empty()) {
+              this->parseRequestLine();
+              this->current_request_.state_ = ServerRequest::STATE::REQUEST_LINE;
             }
-            // No need to parse if the response is already sent.
-            if (!this->response_sent_) {
-              this->parseHeaderLine();
+          } else if (!this->line_.empty()) {
+            this->parseHeaderLine();
+          } else { // End of the head.
+            this->current_request_.state_ = this->current_request_.getContentLength() == 0
+                                            ? ServerRequest::STATE::BODY
+                                            : ServerRequest::STATE::HEADERS;
+            this->admitted_ = this->server_.admitRequest();
+            if (!this->admitted_) {
+              // Sheds the request before its body is read.
+              this->response_sent_ = true;
+              // The head is serialized already, so it is only read.
+              HTTPServer::trySend(*client, {&this->server_.overloaded_response_.serializeHead()});
+              client = this->closeGracefully(move(client));
+            } else if (!this->server_.startDeadline(this->current_request_)) {
+              // The client gave up on the request already.
+              client = this->sendEarlyResponse(
+                make_unique<Response>(Response::Status::GATEWAY_TIMEOUT), move(client));
+            } else if (auto response = this->server_.runHeadersPhase(this->current_request_)) {
+              client = this->sendEarlyResponse(move(response), move(client));
             }
           }
           this->line_.clear();
-        }
-
-        // Body needs to be loaded.
-        if (this->current_request_.getState() == ServerRequest::STATE::HEADERS) {
-          auto remaining_body_size =
-            this->current_request_.getContentLength() - this->loaded_body_size_;
-          auto buf = new char[remaining_body_size + 1];
-          auto received = client->recv(buf, remaining_body_size);
-          if (received < 0) {
-            received = 0;
-          }
-          buf[received] = 0;
-          this->loaded_body_size_ += received;
-          remaining_body_size -= received;
-          this->current_request_.getBody() << buf;
-          delete[] buf;
-          // Body is complete.
-          if (remaining_body_size == 0) {
+        } else if (this->current_request_.getState() == ServerRequest::STATE::HEADERS) {
+          // Data is a part of the body.
+          auto remaining = this->current_request_.getContentLength() - this->loaded_body_size_;
+          auto length = min(remaining, this->buffer_end_ - this->buffer_begin_);
+          auto data = this->buffer_.get() + this->buffer_begin_;
+          this->buffer_begin_ += length;
+          this->loaded_body_size_ += length;
+          if (this->loaded_body_size_ == this->current_request_.getContentLength()) {
             this->current_request_.state_ = ServerRequest::STATE::BODY;
           }
+          if (!this->response_sent_) {
+            this->current_request_.getBody().write(data, static_cast<streamsize>(length));
+            auto response = this->server_.runBodyChunkPhase(this->current_request_, data, length);
+            if (response) {
+              client = this->sendEarlyResponse(move(response), move(client));
+            }
+          }
         }
-      } catch (...) {
-        client = this->server_
-                     .sendResponse(make_unique<Response>(Response::Status::BAD_REQUEST),
-                                   move(client));
-        // As parsing the request failed, the next data received from the client will be in an
-        // uncertain state. It is safer to close the connection and let the client start over.
-        // The event listener's state will be reset with the "connected" event.
-        client->close();
-        return move(client);
+
+        // Request is complete, unless an early response is still being sent.
+        if (client && this->current_request_.getState() == ServerRequest::STATE::BODY) {
+          client = this->completeRequest(move(client));
+        }
+      }
+      return move(client);
+    }
+
+    unique_ptr<net::Socket> &&completeRequest(unique_ptr<net::Socket> &&client) {
+      if (this->response_sent_) {
+        return this->endRequest(move(client));
+      }
+      auto task = this->server_.processRequest(this->current_request_);
+      task.start([this] {
+        this->resumeRequest();
+      });
+      if (task.isDone()) {
+        return this->sendResponse(HTTPServer::getResponse(task), move(client));
       }
+      // The client is kept, without processing its data, until the request resumes.
+      this->processing_.emplace(move(task));
+      this->suspended_client_ = move(client);
+      this->watchDisconnection();
+      return move(client);
+    }
 
-      if (!this->response_sent_) {
-        unique_ptr<Response> response;
+    /**
+     * Cancels the suspended request if its client disconnects meanwhile, as the server does not
+     * receive the events of the client while it is kept. A client that only shuts down its
+     * writing half still awaits the response, so the request is only cancelled once the
+     * connection fails or hangs up.
+     */
+    void watchDisconnection() {
+      auto loop = net::EventLoop::current();
+      if (!loop) {
+        return;
+      }
+      loop->watch(this->client_id_, net::EventLoop::PEER_SHUTDOWN, [this, loop] {
+        char byte;
         try {
-          response = this->server_.handle(this->current_request_);
-        } catch (...) {
-          response = make_unique<Response>(Response::Status::INTERNAL_SERVER_ERROR);
+          // Fails if the connection was reset, unlike after a half-close.
+          this->suspended_client_->recv(&byte, 1, MSG_PEEK);
+        } catch (const utils::RuntimeException &) {
+          this->current_request_.getCancellation().cancel(Cancellation::REASON::DISCONNECTED);
+          return;
         }
-        // Unable to provide a response to the request.
-        if (!response && this->current_request_.state_ == ServerRequest::STATE::BODY) {
-          response = make_unique<Response>(Response::Status::INTERNAL_SERVER_ERROR);
-        }
-        if (response) {
-          this->server_.resetRequestMiddlewareStatus(this->current_request_);
-          this->response_sent_ = true;
-          client = this->server_.sendResponse(move(response), move(client));
+        loop->watch(this->client_id_, 0, [this] {
+          this->current_request_.getCancellation().cancel(Cancellation::REASON::DISCONNECTED);
+        });
+      });
+    }
+
+    /**
+     * Continues with a request once its processing, which suspended, completes.
+     */
+    void resumeRequest() {
+      this->startRound();
+      auto task = move(*this->processing_);
+      this->processing_.reset();
+      auto client = move(this->suspended_client_);
+      net::EventLoop::require().unwatch(this->client_id_);
+      if (this->current_request_.getCancellation().getReason() ==
+          Cancellation::REASON::DISCONNECTED) {
+        // Nobody awaits the response anymore.
+        client->close();
+      } else {
+        try {
+          client = this->sendResponse(HTTPServer::getResponse(task), move(client));
+        } catch (...) {
+          client->close();
         }
       }
+      // Processes the pipelined requests, if any.
+      client = this->receive(move(client));
+      if (client) {
+        this->server_.resumeClient(this->client_id_, move(client));
+      }
+    }
 
-      // Request is complete and must have been processed.
-      if (this->current_request_.getState() == ServerRequest::STATE::BODY) {
-        if (!this->current_request_.hasHeader("keep-alive")) {
+    unique_ptr<net::Socket> &&sendResponse(unique_ptr<Response> response,
+                                           unique_ptr<net::Socket> &&client) {
+      // Unable to provide a response to the request.
+      if (!response) {
+        response = make_unique<Response>(
+          this->current_request_.getCancellation().getReason() ==
+          Cancellation::REASON::DEADLINE_EXCEEDED ? Response::Status::GATEWAY_TIMEOUT
+                                                  : Response::Status::INTERNAL_SERVER_ERROR);
+      }
+      this->response_sent_ = true;
+      return this->send(move(response), move(client));
+    }
+
+    unique_ptr<net::Socket> &&endRequest(unique_ptr<net::Socket> &&client) {
+      this->round_requests_++;
+      if (!this->current_request_.hasHeader("keep-alive")) {
+        client->close();
+      }
+      this->resetRequestParsing(true);
+      return move(client);
+    }
+
+    void startRound() {
+      this->round_bytes_ = 0;
+      this->round_requests_ = 0;
+    }
+
+    /**
+     * Lets the other clients of the worker proceed once the client used its budget. The client is
+     * kept and continues in the next round, without waiting for another event, possibly on an idle
+     * worker stealing it.
+     */
+    unique_ptr<net::Socket> &&yield(unique_ptr<net::Socket> &&client) {
+      if (!net::EventLoop::current()) {
+        this->startRound();
+        return move(client);
+      }
+      this->suspended_client_ = move(client);
+      this->server_.schedule([this] {
+        this->startRound();
+        auto client = move(this->suspended_client_);
+        client = this->receive(move(client));
+        if (client) {
+          this->server_.resumeClient(this->client_id_, move(client));
+        }
+      });
+      return move(client);
+    }
+
+    /**
+     * Processes the data left in the buffer, then the data received from the client until none
+     * is available, a request suspends or the client used its budget for the round.
+     */
+    unique_ptr<net::Socket> &&receive(unique_ptr<net::Socket> &&client) {
+      try {
+        client = this->processBuffer(move(client));
+        while (client && !client->isInvalid()) {
+          if (this->round_bytes_ >= this->server_.receive_budget_ ||
+              this->round_requests_ >= this->server_.request_budget_) {
+            client = this->yield(move(client));
+            break;
+          }
+          auto received = client->recv(this->buffer_.get(), RECEIVE_BUFFER_SIZE);
+          if (received <= 0) {
+            break;
+          }
+          this->round_bytes_ += static_cast<size_t>(received);
+          this->buffer_begin_ = 0;
+          this->buffer_end_ = static_cast<size_t>(received);
+          client = this->processBuffer(move(client));
+        }
+      } catch (...) {
+        if (!this->response_sent_ && client) {
+          Response response(Response::Status::BAD_REQUEST);
+          HTTPServer::trySend(*client, HTTPServer::getSegments(response));
+        }
+        // As parsing the request failed, the next data received from the client will be in an
+        // uncertain state. It is safer to close the connection and let the client start over.
+        // The event listener's state will be reset with the "connected" event.
+        if (client) {
           client->close();
         }
-        this->resetRequestParsing(true);
       }
       return move(client);
     }
+
+  public:
+    explicit HTTPClientEventsListener(HTTPServer &server) : server_(server),
+                                                            buffer_begin_(0),
+                                                            buffer_end_(0),
+                                                            loaded_body_size_(0),
+                                                            response_sent_(false),
+                                                            admitted_(false),
+                                                            unsent_index_(0),
+                                                            unsent_offset_(0),
+                                                            lingered_(0),
+                                                            round_bytes_(0),
+                                                            round_requests_(0) {
+    }
+
+    unique_ptr<net::Socket> &&connected(unique_ptr<net::Socket> &&client) override {
+      this->resetRequestParsing();
+      this->sending_.reset();
+      this->unsent_segments_.clear();
+      // Allocated by the worker accepting the client, as the listener of a previous client with
+      // the same descriptor may have been run by another worker.
+      this->buffer_ = make_unique<char[]>(RECEIVE_BUFFER_SIZE);
+      this->buffer_begin_ = 0;
+      this->buffer_end_ = 0;
+      this->client_id_ = client->getHandle();
+      this->current_request_.client_address_ = static_cast<string>(client->getAddress());
+      return move(client);
+    }
+
+    unique_ptr<net::Socket> &&dataAvailable(unique_ptr<net::Socket> &&client) override {
+      this->startRound();
+      return this->receive(move(client));
+    }
+
+    unique_ptr<net::Socket> &&shutdown(unique_ptr<net::Socket> &&client) override {
+      this->releaseRequest();
+      return move(client);
+    }
   };
 
   unique_ptr<net::ClientEventsListener> makeClientEventsListener() override {
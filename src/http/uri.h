@@ -1,101 +1,337 @@
 #ifndef HTTP_URI_H
 #define HTTP_URI_H
 
+#include <array>
+#include <cctype>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "../utils/exception.h"
 
 using namespace std;
 
 namespace http {
+/**
+ * A URI, as found in the target of a request. The URI is kept as received and its components are
+ * located in a single pass, without copy: component accessors return views into the URI, still
+ * percent-encoded. The decoded segments of the path are only computed when first accessed.
+ */
 class Uri {
 protected:
-  string scheme_;
-  string user_info_;
-  string host_;
+  enum COMPONENT {
+    SCHEME, USER_INFO, HOST, PATH, QUERY, FRAGMENT, COMPONENT_COUNT
+  };
+
+  struct Component {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+  };
+
+  string raw_;
+  array<Component, COMPONENT_COUNT> components_;
   unsigned port_;
-  vector<string> path_;
-  string query_;
-  string fragment_;
-public:
-  Uri() : port_(0) {
+  bool path_encoded_;
+  /// The decoded segments of the path, views into the URI or into the decoded path.
+  mutable vector<string_view> path_;
+  mutable string decoded_path_;
+  mutable bool path_loaded_;
+
+  static bool isHexDigit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
   }
 
-  static Uri fromString(const string &str) {
-    Uri uri;
-    size_t previous = 0;
-    // Scheme.
-    auto end = str.find("://");
-    if (end != string::npos) {
-      uri.setScheme(Uri::decode(str.substr(0, end - previous)));
-      previous = end + 3;
+  static int getHexValue(char c) {
+    if (c <= '9') {
+      return c - '0';
     }
+    return (c | 0x20) - 'a' + 10;
+  }
 
-    // User info.
-    end = str.find('@', previous);
-    if (end != string::npos) {
-      uri.setUserInfo(Uri::decode(str.substr(previous, end - previous)));
-      previous = end + 1;
+  static bool isUnreserved(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '.' || c == '_' || c == '~';
+  }
+
+  /**
+   * Checks a character of the URI, and its percent-encoded octet if it starts one.
+   * @return Whether the character starts a percent-encoded octet
+   */
+  bool checkCharacter(size_t position) const {
+    auto c = static_cast<unsigned char>(this->raw_[position]);
+    if (c <= ' ' || c == 0x7f) {
+      throw utils::RuntimeException("Invalid character in URI");
+    }
+    if (c != '%') {
+      return false;
     }
+    if (position + 2 >= this->raw_.size() || !Uri::isHexDigit(this->raw_[position + 1]) ||
+        !Uri::isHexDigit(this->raw_[position + 2])) {
+      throw utils::RuntimeException("Invalid percent-encoding in URI");
+    }
+    return true;
+  }
 
-    auto host_start = previous;
+  void setComponent(COMPONENT component, size_t begin, size_t end) {
+    this->components_[component] = {static_cast<uint32_t>(begin),
+                                     static_cast<uint32_t>(end - begin)};
+  }
 
-    previous = str.size() - 1;
-    // Fragment.
-    auto start = str.rfind('#');
-    if (start != string::npos) {
-      uri.setFragment(Uri::decode(str.substr(start + 1, previous - start)));
-      previous = start - 1;
+  string_view getComponent(COMPONENT component) const {
+    const auto &range = this->components_[component];
+    return string_view(this->raw_.data() + range.offset, range.length);
+  }
+
+  /**
+   * Locates the components of the URI in a single pass.
+   * @throw utils::RuntimeException Thrown if the URI is malformed
+   */
+  void parse() {
+    this->components_ = {};
+    this->port_ = 0;
+    this->path_encoded_ = false;
+    this->path_loaded_ = false;
+    const auto &str = this->raw_;
+    auto size = str.size();
+    if (size > UINT32_MAX) {
+      throw utils::RuntimeException("URI too long");
+    }
+    size_t position = 0;
+
+    if (size > 0 && str[0] != '/') {
+      // Scheme, if followed by "://".
+      if ((str[0] | 0x20) >= 'a' && (str[0] | 0x20) <= 'z') {
+        auto end = size_t(1);
+        while (end < size && (isalnum(static_cast<unsigned char>(str[end])) ||
+                              str[end] == '+' || str[end] == '-' || str[end] == '.')) {
+          end++;
+        }
+        if (end + 2 < size && str[end] == ':' && str[end + 1] == '/' && str[end + 2] == '/') {
+          this->setComponent(SCHEME, 0, end);
+          position = end + 3;
+        }
+      }
+
+      // Authority.
+      auto authority = position;
+      auto host = position;
+      auto colon = string::npos;
+      auto in_brackets = false;
+      for (; position < size; position++) {
+        auto c = str[position];
+        if (c == '/' || c == '?' || c == '#') {
+          break;
+        }
+        this->checkCharacter(position);
+        if (c == '@') {
+          this->setComponent(USER_INFO, authority, position);
+          host = position + 1;
+          colon = string::npos;
+        } else if (c == '[') {
+          in_brackets = true;
+        } else if (c == ']') {
+          in_brackets = false;
+        } else if (c == ':' && !in_brackets) {
+          colon = position;
+        }
+      }
+      if (colon != string::npos) {
+        if (colon + 1 == position || position - colon > 6) {
+          throw utils::RuntimeException("Invalid port in URI");
+        }
+        unsigned port = 0;
+        for (auto i = colon + 1; i < position; i++) {
+          if (str[i] < '0' || str[i] > '9') {
+            throw utils::RuntimeException("Invalid port in URI");
+          }
+          port = port * 10 + static_cast<unsigned>(str[i] - '0');
+        }
+        if (port > 65535) {
+          throw utils::RuntimeException("Invalid port in URI");
+        }
+        this->port_ = port;
+        this->setComponent(HOST, host, colon);
+      } else {
+        this->setComponent(HOST, host, position);
+      }
     }
 
+    // Path.
+    auto begin = position;
+    for (; position < size && str[position] != '?' && str[position] != '#'; position++) {
+      if (this->checkCharacter(position)) {
+        this->path_encoded_ = true;
+      }
+    }
+    this->setComponent(PATH, begin, position);
+
     // Query.
-    start = str.rfind('?', previous);
-    if (start != string::npos) {
-      uri.setQuery(Uri::decode(str.substr(start + 1, previous - start)));
-      previous = start - 1;
+    if (position < size && str[position] == '?') {
+      begin = ++position;
+      for (; position < size && str[position] != '#'; position++) {
+        this->checkCharacter(position);
+      }
+      this->setComponent(QUERY, begin, position);
     }
 
-    // Path.
-    start = str.find('/', host_start);
-    if (start != string::npos) {
-      uri.setPath(utils::split(Uri::decode(str.substr(start + 1, previous - start)), '/'));
-      previous = start - 1;
+    // Fragment.
+    if (position < size && str[position] == '#') {
+      begin = ++position;
+      for (; position < size; position++) {
+        this->checkCharacter(position);
+      }
+      this->setComponent(FRAGMENT, begin, position);
     }
+  }
 
-    // Port.
-    start = str.rfind(':', previous);
-    if (start != string::npos) {
-      uri.setPort(static_cast<unsigned>(::stoul(str.substr(start + 1, previous - start))));
-      previous = start - 1;
+  /**
+   * Splits the path in segments, decoding them if needed.
+   */
+  void loadPath() const {
+    this->path_.clear();
+    auto path = this->getRawPath();
+    if (this->path_encoded_) {
+      // Decoding only shrinks segments, so views into the decoded path remain valid.
+      this->decoded_path_.clear();
+      this->decoded_path_.reserve(path.size());
     }
+    size_t start = 0;
+    while (start < path.size()) {
+      auto end = path.find('/', start);
+      if (end == string_view::npos) {
+        end = path.size();
+      }
+      if (end > start) {
+        auto segment = path.substr(start, end - start);
+        if (this->path_encoded_) {
+          if (!this->decoded_path_.empty()) {
+            this->decoded_path_ += '/';
+          }
+          auto offset = this->decoded_path_.size();
+          Uri::decode(segment, this->decoded_path_);
+          segment = string_view(this->decoded_path_.data() + offset,
+                                this->decoded_path_.size() - offset);
+        }
+        this->path_.push_back(segment);
+      }
+      start = end + 1;
+    }
+    this->path_loaded_ = true;
+  }
 
-    // Host.
-    uri.setHost(Uri::decode(str.substr(host_start, previous - host_start + 1)));
+  /**
+   * Replaces a component of the URI.
+   * @param component The component
+   * @param value The new value of the component, percent-encoded
+   */
+  void replace(COMPONENT component, string_view value) {
+    array<string, COMPONENT_COUNT> parts;
+    for (size_t i = 0; i < COMPONENT_COUNT; i++) {
+      parts[i] = string(this->getComponent(static_cast<COMPONENT>(i)));
+    }
+    parts[component] = string(value);
+    this->raw_ = Uri::render(parts, this->port_);
+    this->parse();
+  }
+
+  static string render(const array<string, COMPONENT_COUNT> &parts, unsigned port) {
+    string render;
+    if (!parts[SCHEME].empty()) {
+      render += parts[SCHEME] + "://";
+    }
+    if (!parts[USER_INFO].empty()) {
+      render += parts[USER_INFO] + '@';
+    }
+    render += parts[HOST];
+    if (port != 0) {
+      render += ':';
+      render += to_string(port);
+    }
+    if (parts[PATH].empty() || parts[PATH][0] != '/') {
+      render += '/';
+    }
+    render += parts[PATH];
+    if (!parts[QUERY].empty()) {
+      render += '?';
+      render += parts[QUERY];
+    }
+    if (!parts[FRAGMENT].empty()) {
+      render += '#';
+      render += parts[FRAGMENT];
+    }
+    return render;
+  }
+
+public:
+  Uri() : raw_("/"), port_(0), path_encoded_(false), path_loaded_(false) {
+    this->parse();
+  }
+
+  Uri(const Uri &other)
+    : raw_(other.raw_), components_(other.components_), port_(other.port_),
+      path_encoded_(other.path_encoded_), path_loaded_(false) {
+  }
+
+  Uri(Uri &&other) noexcept
+    : raw_(move(other.raw_)), components_(other.components_), port_(other.port_),
+      path_encoded_(other.path_encoded_), path_loaded_(false) {
+  }
+
+  Uri &operator=(const Uri &other) {
+    if (this != &other) {
+      this->raw_ = other.raw_;
+      this->components_ = other.components_;
+      this->port_ = other.port_;
+      this->path_encoded_ = other.path_encoded_;
+      this->path_loaded_ = false;
+    }
+    return *this;
+  }
+
+  Uri &operator=(Uri &&other) noexcept {
+    this->raw_ = move(other.raw_);
+    this->components_ = other.components_;
+    this->port_ = other.port_;
+    this->path_encoded_ = other.path_encoded_;
+    this->path_loaded_ = false;
+    return *this;
+  }
+
+  /**
+   * Parses a URI.
+   * @param str The URI, percent-encoded
+   * @return The URI
+   * @throw utils::RuntimeException Thrown if the URI is malformed
+   */
+  static Uri fromString(string str) {
+    Uri uri;
+    uri.raw_ = move(str);
+    uri.parse();
     return uri;
   }
 
-  const string &getScheme() const {
-    return this->scheme_;
+  string_view getScheme() const {
+    return this->getComponent(SCHEME);
   }
 
   void setScheme(string &&scheme) {
-    this->scheme_ = move(scheme);
+    this->replace(SCHEME, scheme);
   }
 
-  const string &getUserInfo() const {
-    return this->user_info_;
+  string_view getUserInfo() const {
+    return this->getComponent(USER_INFO);
   }
 
   void setUserInfo(string &&user_info) {
-    this->user_info_ = move(user_info);
+    this->replace(USER_INFO, user_info);
   }
 
-  const string &getHost() const {
-    return this->host_;
+  string_view getHost() const {
+    return this->getComponent(HOST);
   }
 
   void setHost(string &&host) {
-    this->host_ = move(host);
+    this->replace(HOST, host);
   }
 
   unsigned getPort() const {
@@ -104,95 +340,157 @@ public:
 
   void setPort(unsigned port) {
     this->port_ = port;
+    this->replace(HOST, string(this->getHost()));
+  }
+
+  /**
+   * @return The path, percent-encoded
+   */
+  string_view getRawPath() const {
+    return this->getComponent(PATH);
   }
 
-  const vector<string> &getPath() const {
+  /**
+   * @return The decoded non-empty segments of the path, valid as long as the URI is not modified
+   */
+  const vector<string_view> &getPath() const {
+    if (!this->path_loaded_) {
+      this->loadPath();
+    }
     return this->path_;
   }
 
-  void setPath(vector<string> &&path) {
-    this->path_ = move(path);
+  /**
+   * @param path The segments of the path, which are percent-encoded
+   */
+  void setPath(const vector<string> &path) {
+    string raw;
+    for (const auto &segment : path) {
+      raw += '/';
+      raw += Uri::encode(segment);
+    }
+    this->replace(PATH, raw);
   }
 
-  const string &getQuery() const {
-    return this->query_;
+  /**
+   * @return The query, percent-encoded
+   */
+  string_view getQuery() const {
+    return this->getComponent(QUERY);
   }
 
+  /**
+   * @param query The query, already percent-encoded
+   */
   void setQuery(string &&query) {
-    this->query_ = query;
+    this->replace(QUERY, query);
   }
 
-  const string &getFragment() const {
-    return this->fragment_;
+  /**
+   * @return The fragment, percent-encoded
+   */
+  string_view getFragment() const {
+    return this->getComponent(FRAGMENT);
   }
 
+  /**
+   * @param fragment The fragment, already percent-encoded
+   */
   void setFragment(string &&fragment) {
-    this->fragment_ = move(fragment);
+    this->replace(FRAGMENT, fragment);
   }
 
   bool isValid() const {
-    if (!this->user_info_.empty() && this->host_.empty()) {
+    if (!this->getUserInfo().empty() && this->getHost().empty()) {
       return false;
     }
-    if (this->port_ != 0 && this->host_.empty()) {
+    if (this->port_ != 0 && this->getHost().empty()) {
       return false;
     }
     return true;
   }
 
+  /**
+   * @return The URI as received, percent-encoded
+   */
+  const string &getRaw() const {
+    return this->raw_;
+  }
+
   operator string() const {
     if (!this->isValid()) {
       throw utils::RuntimeException("Uri is invalid");
     }
-
-    string render;
-    if (!this->scheme_.empty()) {
-      render += Uri::encode(this->scheme_) + "://";
-    }
-    if (!this->user_info_.empty()) {
-      render += Uri::encode(this->user_info_) + '@';
-    }
-    if (!this->host_.empty()) {
-      render += Uri::encode(this->host_);
-    }
-    if (this->port_ != 0) {
-      render += ':';
-      render += to_string(this->port_);
-    }
-    for (const auto &segment : this->path_) {
-      render += '/';
-      render += Uri::encode(segment);
-    }
-    if (this->path_.empty()) {
-      render += '/';
-    }
-    if (!this->query_.empty()) {
-      render += '?';
-      render += Uri::encode(this->query_);
-    }
-    if (!this->fragment_.empty()) {
-      render += '#';
-      render += Uri::encode(this->fragment_);
-    }
-    return render;
+    return this->raw_;
   }
 
   void clear() {
-    this->scheme_.clear();
-    this->user_info_.clear();
-    this->host_.clear();
-    this->port_ = 0;
-    this->path_.clear();
-    this->query_.clear();
-    this->fragment_.clear();
+    this->raw_ = "/";
+    this->parse();
   }
 
-  static string encode(const string &str) {
-    return str;
+  /**
+   * Percent-encodes a path segment or a query value: all the characters but the unreserved ones
+   * are encoded.
+   * @param str The string to encode
+   * @return The encoded string
+   */
+  static string encode(string_view str) {
+    static const char *digits = "0123456789ABCDEF";
+    string encoded;
+    encoded.reserve(str.size());
+    for (auto c : str) {
+      if (Uri::isUnreserved(c)) {
+        encoded += c;
+      } else {
+        encoded += '%';
+        encoded += digits[static_cast<unsigned char>(c) >> 4u];
+        encoded += digits[static_cast<unsigned char>(c) & 0xfu];
+      }
+    }
+    return encoded;
+  }
+
+  /**
+   * Decodes a percent-encoded string. Malformed percent-encoded octets are kept as is.
+   * @param str The string to decode
+   * @param out The output container, to which the decoded string is appended
+   * @param plus_as_space Whether '+' is decoded as a space, as in form data
+   */
+  static void decode(string_view str, string &out, bool plus_as_space = false) {
+    size_t start = 0;
+    while (start < str.size()) {
+      auto escape = plus_as_space ? str.find_first_of("%+", start) : str.find('%', start);
+      if (escape == string_view::npos) {
+        out.append(str.data() + start, str.size() - start);
+        return;
+      }
+      out.append(str.data() + start, escape - start);
+      if (str[escape] == '+') {
+        out += ' ';
+        start = escape + 1;
+      } else if (escape + 2 < str.size() && Uri::isHexDigit(str[escape + 1]) &&
+                 Uri::isHexDigit(str[escape + 2])) {
+        out += static_cast<char>(Uri::getHexValue(str[escape + 1]) * 16 +
+                                 Uri::getHexValue(str[escape + 2]));
+        start = escape + 3;
+      } else {
+        out += '%';
+        start = escape + 1;
+      }
+    }
   }
 
-  static string decode(const string &str) {
-    return str;
+  /**
+   * Decodes a percent-encoded string.
+   * @param str The string to decode
+   * @return The decoded string
+   */
+  static string decode(string_view str) {
+    string decoded;
+    decoded.reserve(str.size());
+    Uri::decode(str, decoded);
+    return decoded;
   }
 };
 }
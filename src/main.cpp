@@ -1,7 +1,11 @@
 #include "http/exceptions.h"
 #include "http/server.h"
 #include "http/application.h"
+#include "http/cache.h"
+#include "http/compression.h"
 #include "http/messages.h"
+#include "http/pipeline.h"
+#include "http/ranges.h"
 
 using namespace std;
 
@@ -22,26 +26,35 @@ public:
 };
 
 class Logger : public http::Middleware {
-  mutex lock_;
+  string line_;
 public:
   unique_ptr<http::Response> process(http::ServerRequest &request,
                                      http::RequestHandler &handler) override {
-    auto response = handler.handle(request);
-    this->lock_.lock();
-    cout << request.getClientAddress() << " -> ";
-    cout << request.getMethod() << " " << string(request.getUri());
+    return handler.handle(request);
+  }
+
+  unsigned getPhases() const override {
+    return COMPLETE;
+  }
+
+  // Logs every response sent, including the ones produced before the body was received.
+  void onComplete(http::ServerRequest &request, const http::Response &response) override {
+    // Each worker has its own logger, lines are written at once so that they do not interleave.
+    this->line_.clear();
+    this->line_ += request.getClientAddress();
+    this->line_ += " -> ";
+    this->line_ += static_cast<const char *>(request.getMethod());
+    this->line_ += " ";
+    this->line_ += request.getUri().getRaw();
     if (request.getState() < http::ServerRequest::STATE::BODY) {
-      cout << " [PARTIAL]";
-    }
-    cout << " -> ";
-    if (response) {
-      cout << int(response->getStatus()) << " " << response->getReasonPhrase();
-    } else {
-      cout << "[NO RESPONSE]";
+      this->line_ += " [PARTIAL]";
     }
-    cout << endl;
-    this->lock_.unlock();
-    return response;
+    this->line_ += " -> ";
+    this->line_ += to_string(int(response.getStatus()));
+    this->line_ += " ";
+    this->line_ += response.getReasonPhrase();
+    this->line_ += "\n";
+    cout << this->line_ << flush;
   }
 };
 
@@ -69,9 +82,12 @@ int main() {
   net::SocketInitializer socket_initializer;
 
   auto server = http::HTTPServer::with(AF_INET, nullptr, "8080", true);
-  server->addMiddleware(make_unique<ErrorHandler>());
-  server->addMiddleware(make_unique<Logger>());
-  server->addMiddleware(make_unique<Hello>());
+  // The middleware are composed at compile time, addMiddleware also accepts any middleware instance
+  // to configure the application at runtime. Each worker thread gets its own pipeline.
+  server->addMiddleware([] {
+    return make_unique<http::Pipeline<ErrorHandler, Logger, http::RangeRequests,
+      http::Compression, http::ResponseCache, Hello>>();
+  });
   server->initialize();
   server->run();
 }
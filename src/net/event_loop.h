@@ -0,0 +1,343 @@
+#ifndef NET_EVENT_LOOP_H
+#define NET_EVENT_LOOP_H
+
+#include "sockets.h"
+#include "../utils/exception.h"
+#include "../utils/executor.h"
+#include "../utils/mpsc_queue.h"
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace net {
+/**
+ * Event loop of a worker thread. The loop waits for the readiness of file descriptors and for
+ * timers, and runs the functions posted by other threads. A loop belongs to the thread creating it:
+ * its callbacks, and thus the coroutines awaiting its events, always run on that thread.
+ *
+ * Only the post method is thread-safe. Posted functions go through a lock-free queue, and the loop
+ * is only woken up once for all the functions posted while it runs them.
+ */
+class EventLoop {
+public:
+  typedef function<void()> callback_t;
+  typedef chrono::steady_clock clock_t;
+  typedef pair<clock_t::time_point, uint64_t> timer_id_t;
+
+  enum EVENT : unsigned {
+    READABLE = 1u << 0u,
+    WRITABLE = 1u << 1u,
+    /// The peer of a socket shut down at least its writing half, also reported to readable ones.
+    PEER_SHUTDOWN = 1u << 2u
+  };
+
+protected:
+  struct Watch {
+    callback_t callback;
+    /// Distinguishes successive watches of a reused descriptor.
+    uint32_t generation;
+    bool persistent;
+  };
+
+  static thread_local EventLoop *current_;
+
+  int epoll_fd_;
+  /// Signaled when functions are posted.
+  int wake_fd_;
+  unordered_map<socket_handle_t, Watch> watches_;
+  uint32_t generation_;
+  map<timer_id_t, callback_t> timers_;
+  uint64_t timer_count_;
+  vector<callback_t> deferred_;
+  /// Called with true before the loop blocks waiting for events, and with false once it wakes up.
+  function<void(bool)> idle_handler_;
+  /// The longest time the loop polls for events before blocking, zero to always block.
+  clock_t::duration busy_poll_budget_;
+  /// The time the loop currently polls for, reduced while polling finds nothing.
+  clock_t::duration spin_budget_;
+  utils::MpscQueue<callback_t> posted_;
+  /// Whether the loop was signaled and did not run the posted functions yet.
+  atomic<bool> wake_pending_;
+  atomic<bool> stopped_;
+
+  /**
+   * @return The time in milliseconds until the next timer, -1 if there is none
+   */
+  int getTimeout(int max_timeout) const;
+
+  /**
+   * Adapts the spin budget once the loop blocked.
+   * @param useful Whether the events the loop waited for would have been found by polling
+   */
+  void adaptSpinBudget(bool useful);
+
+  void runPosted();
+
+  void runTimers();
+
+  void runDeferred();
+
+public:
+  /**
+   * Maximum number of events processed by an iteration of the loop.
+   */
+  static constexpr int MAX_EVENT = 64;
+
+  /**
+   * Creates a loop belonging to the current thread.
+   * @throw utils::RuntimeException Thrown if the thread already has a loop
+   */
+  EventLoop();
+  EventLoop(const EventLoop &other) = delete;
+  EventLoop &operator=(const EventLoop &other) = delete;
+  ~EventLoop();
+
+  /**
+   * @return The loop of the current thread, or nullptr
+   */
+  static EventLoop *current() {
+    return EventLoop::current_;
+  }
+
+  /**
+   * @return The loop of the current thread
+   * @throw utils::RuntimeException Thrown if the thread has no loop
+   */
+  static EventLoop &require() {
+    if (!EventLoop::current_) {
+      throw utils::RuntimeException("No event loop in the current thread");
+    }
+    return *EventLoop::current_;
+  }
+
+  /**
+   * Waits for the readiness of a descriptor. A descriptor can only be watched once at a time.
+   * @param handle The descriptor
+   * @param events The awaited events, a combination of EVENT values, or 0 to only wait for an
+   *  error or a hang-up
+   * @param callback Called when the descriptor is ready, or on error or hang-up
+   * @param persistent Whether the watch remains after the callback is called, otherwise the
+   *  callback is called once
+   */
+  void watch(socket_handle_t handle, unsigned events, callback_t callback,
+             bool persistent = false);
+
+  /**
+   * Stops watching a descriptor, if it is watched.
+   */
+  void unwatch(socket_handle_t handle);
+
+  /**
+   * @param delay The time before the callback is called
+   * @param callback The callback
+   * @return The ID of the timer, valid until it expires
+   */
+  timer_id_t addTimer(clock_t::duration delay, callback_t callback);
+
+  /**
+   * Cancels a timer, if it did not expire.
+   */
+  void cancelTimer(const timer_id_t &id);
+
+  /**
+   * Schedules a function at the end of the current iteration of the loop, once the ready events
+   * are processed.
+   */
+  void defer(callback_t callback) {
+    this->deferred_.push_back(move(callback));
+  }
+
+  /**
+   * Sets the function called when the loop runs out of work and is about to block, and once it
+   * wakes up. The function may schedule work, for instance with defer, in which case the loop
+   * does not block.
+   * @param handler Called with whether the loop is idle
+   */
+  void setIdleHandler(function<void(bool)> handler) {
+    this->idle_handler_ = move(handler);
+  }
+
+  /**
+   * Makes the loop poll for events for some time before blocking, which trades CPU time for the
+   * latency of waking up the thread. The time the loop polls for halves whenever polling finds
+   * nothing, so an idle loop ends up blocking right away, and grows back up to the budget when
+   * events arrive shortly after the loop blocked.
+   * @param budget The longest time the loop polls for, zero to disable polling
+   */
+  void setBusyPoll(clock_t::duration budget) {
+    this->busy_poll_budget_ = budget;
+    this->spin_budget_ = budget;
+  }
+
+  /**
+   * Schedules a function on the loop. Can be called from any thread.
+   */
+  void post(callback_t callback);
+
+  /**
+   * Waits for events and processes them once.
+   * @param max_timeout Maximum time to wait in milliseconds, -1 to wait indefinitely
+   */
+  void runOnce(int max_timeout = -1);
+
+  /**
+   * Processes events until the loop is stopped.
+   */
+  void run();
+
+  /**
+   * Stops the loop. Can be called from any thread.
+   */
+  void stop();
+
+  class EventAwaiter {
+  protected:
+    EventLoop &loop_;
+    socket_handle_t handle_;
+    unsigned events_;
+
+  public:
+    EventAwaiter(EventLoop &loop, socket_handle_t handle, unsigned events)
+      : loop_(loop), handle_(handle), events_(events) {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+      this->loop_.watch(this->handle_, this->events_, [handle] {
+        handle.resume();
+      });
+    }
+
+    void await_resume() const noexcept {
+    }
+  };
+
+  class TimerAwaiter {
+  protected:
+    EventLoop &loop_;
+    clock_t::duration delay_;
+
+  public:
+    TimerAwaiter(EventLoop &loop, clock_t::duration delay) : loop_(loop), delay_(delay) {
+    }
+
+    bool await_ready() const noexcept {
+      return this->delay_.count() <= 0;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+      this->loop_.addTimer(this->delay_, [handle] {
+        handle.resume();
+      });
+    }
+
+    void await_resume() const noexcept {
+    }
+  };
+
+  /**
+   * Runs a function on an executor, the awaiting coroutine resuming on the loop.
+   * @tparam F The type of the function
+   */
+  template<typename F>
+  class OffloadAwaiter {
+  protected:
+    typedef invoke_result_t<F> result_t;
+    typedef conditional_t<is_void_v<result_t>, bool, result_t> storage_t;
+
+    EventLoop &loop_;
+    utils::Executor &executor_;
+    F function_;
+    optional<storage_t> result_;
+    exception_ptr exception_;
+
+  public:
+    OffloadAwaiter(EventLoop &loop, utils::Executor &executor, F &&function)
+      : loop_(loop), executor_(executor), function_(move(function)) {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    /**
+     * @throw utils::RuntimeException Thrown in the coroutine if the executor is saturated
+     */
+    void await_suspend(coroutine_handle<> handle) {
+      auto accepted = this->executor_.trySubmit([this, handle] {
+        try {
+          if constexpr (is_void_v<result_t>) {
+            this->function_();
+            this->result_.emplace(true);
+          } else {
+            this->result_.emplace(this->function_());
+          }
+        } catch (...) {
+          this->exception_ = current_exception();
+        }
+        this->loop_.post([handle] {
+          handle.resume();
+        });
+      });
+      if (!accepted) {
+        throw utils::RuntimeException("Executor saturated");
+      }
+    }
+
+    result_t await_resume() {
+      if (this->exception_) {
+        rethrow_exception(this->exception_);
+      }
+      if constexpr (!is_void_v<result_t>) {
+        return move(*this->result_);
+      }
+    }
+  };
+
+  /**
+   * @return An awaitable resuming once the socket has data to receive
+   */
+  EventAwaiter readable(const Socket &socket) {
+    return EventAwaiter(*this, socket.getHandle(), READABLE);
+  }
+
+  /**
+   * @return An awaitable resuming once the socket accepts data to send
+   */
+  EventAwaiter writable(const Socket &socket) {
+    return EventAwaiter(*this, socket.getHandle(), WRITABLE);
+  }
+
+  /**
+   * @return An awaitable resuming after a delay
+   */
+  TimerAwaiter sleep(clock_t::duration delay) {
+    return TimerAwaiter(*this, delay);
+  }
+
+  /**
+   * @param executor The executor running the function
+   * @param function The blocking function
+   * @return An awaitable resuming with the result of the function once it ran on the executor
+   */
+  template<typename F>
+  OffloadAwaiter<F> offload(utils::Executor &executor, F function) {
+    return OffloadAwaiter<F>(*this, executor, move(function));
+  }
+};
+} // namespace net
+
+#endif //NET_EVENT_LOOP_H
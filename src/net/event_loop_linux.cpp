@@ -0,0 +1,236 @@
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace net {
+thread_local EventLoop *EventLoop::current_ = nullptr;
+
+EventLoop::EventLoop() : generation_(0), timer_count_(0), busy_poll_budget_(0), spin_budget_(0),
+                         wake_pending_(false), stopped_(false) {
+  if (EventLoop::current_) {
+    throw utils::RuntimeException("Thread already has an event loop");
+  }
+  this->epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+  if (this->epoll_fd_ == -1) {
+    throw utils::SystemException::fromLastError();
+  }
+  this->wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (this->wake_fd_ == -1) {
+    auto error = utils::SystemException::getLastError();
+    ::close(this->epoll_fd_);
+    throw utils::SystemException(error);
+  }
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u64 = static_cast<uint32_t>(this->wake_fd_);
+  if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, this->wake_fd_, &event) != 0) {
+    auto error = utils::SystemException::getLastError();
+    ::close(this->wake_fd_);
+    ::close(this->epoll_fd_);
+    throw utils::SystemException(error);
+  }
+  EventLoop::current_ = this;
+}
+
+EventLoop::~EventLoop() {
+  ::close(this->wake_fd_);
+  ::close(this->epoll_fd_);
+  if (EventLoop::current_ == this) {
+    EventLoop::current_ = nullptr;
+  }
+}
+
+void EventLoop::watch(socket_handle_t handle, unsigned events, callback_t callback,
+                      bool persistent) {
+  if (this->watches_.count(handle) != 0) {
+    throw utils::RuntimeException("Descriptor already watched");
+  }
+  auto generation = ++this->generation_;
+  epoll_event event{};
+  // Errors and hang-ups are always reported.
+  event.events = 0;
+  if (events & (READABLE | PEER_SHUTDOWN)) {
+    event.events |= EPOLLRDHUP;
+  }
+  if (events & READABLE) {
+    event.events |= EPOLLIN;
+  }
+  if (events & WRITABLE) {
+    event.events |= EPOLLOUT;
+  }
+  if (!persistent) {
+    event.events |= EPOLLONESHOT;
+  }
+  event.data.u64 = (static_cast<uint64_t>(generation) << 32u) | static_cast<uint32_t>(handle);
+  // A descriptor watched once before stays registered, disarmed.
+  if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, handle, &event) != 0) {
+    if (errno != EEXIST || ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_MOD, handle, &event) != 0) {
+      throw utils::SystemException::fromLastError();
+    }
+  }
+  this->watches_.emplace(handle, Watch{move(callback), generation, persistent});
+}
+
+void EventLoop::unwatch(socket_handle_t handle) {
+  if (this->watches_.erase(handle) != 0) {
+    ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, handle, nullptr);
+  }
+}
+
+EventLoop::timer_id_t EventLoop::addTimer(clock_t::duration delay, callback_t callback) {
+  timer_id_t id(clock_t::now() + delay, this->timer_count_++);
+  this->timers_.emplace(id, move(callback));
+  return id;
+}
+
+void EventLoop::cancelTimer(const timer_id_t &id) {
+  this->timers_.erase(id);
+}
+
+void EventLoop::post(callback_t callback) {
+  this->posted_.push(move(callback));
+  // The loop will run the function with the ones posted before otherwise.
+  if (!this->wake_pending_.exchange(true)) {
+    uint64_t one = 1;
+    ::write(this->wake_fd_, &one, sizeof(one));
+  }
+}
+
+int EventLoop::getTimeout(int max_timeout) const {
+  if (!this->deferred_.empty()) {
+    return 0;
+  }
+  if (this->timers_.empty()) {
+    return max_timeout;
+  }
+  auto delay = chrono::ceil<chrono::milliseconds>(this->timers_.begin()->first.first -
+                                                  clock_t::now()).count();
+  if (delay < 0) {
+    delay = 0;
+  }
+  if (max_timeout >= 0 && max_timeout < delay) {
+    return max_timeout;
+  }
+  return static_cast<int>(delay);
+}
+
+void EventLoop::runPosted() {
+  uint64_t count;
+  ::read(this->wake_fd_, &count, sizeof(count));
+  // Reset before running the functions, so that functions posted meanwhile signal the loop.
+  this->wake_pending_ = false;
+  while (auto callback = this->posted_.pop()) {
+    (*callback)();
+  }
+}
+
+void EventLoop::runTimers() {
+  auto now = clock_t::now();
+  while (!this->timers_.empty() && this->timers_.begin()->first.first <= now) {
+    auto callback = move(this->timers_.begin()->second);
+    this->timers_.erase(this->timers_.begin());
+    callback();
+  }
+}
+
+void EventLoop::runDeferred() {
+  // Functions deferred by these ones run in the next iteration.
+  auto deferred = move(this->deferred_);
+  this->deferred_.clear();
+  for (auto &callback : deferred) {
+    callback();
+  }
+}
+
+void EventLoop::adaptSpinBudget(bool useful) {
+  // Shorter polls are not worth it, so the loop stops polling until events arrive shortly again.
+  auto min_budget = this->busy_poll_budget_ / 16;
+  if (useful) {
+    this->spin_budget_ = min(max(this->spin_budget_ * 2, min_budget), this->busy_poll_budget_);
+    return;
+  }
+  this->spin_budget_ /= 2;
+  if (this->spin_budget_ < min_budget) {
+    this->spin_budget_ = clock_t::duration::zero();
+  }
+}
+
+void EventLoop::runOnce(int max_timeout) {
+  epoll_event ready[EventLoop::MAX_EVENT];
+  auto timeout = this->getTimeout(max_timeout);
+  auto idle = timeout != 0 && this->idle_handler_;
+  if (idle) {
+    this->idle_handler_(true);
+    timeout = this->getTimeout(max_timeout);
+  }
+  auto ready_count = 0;
+  if (timeout != 0 && this->spin_budget_ > clock_t::duration::zero()) {
+    // Polls for events for a while before blocking, without delaying the next timer.
+    auto spin_end = clock_t::now() + this->spin_budget_;
+    if (timeout > 0) {
+      spin_end = min(spin_end, clock_t::now() + chrono::milliseconds(timeout));
+    }
+    do {
+      ready_count = ::epoll_wait(this->epoll_fd_, ready, EventLoop::MAX_EVENT, 0);
+    } while (ready_count == 0 && clock_t::now() < spin_end);
+    if (ready_count == 0) {
+      timeout = this->getTimeout(max_timeout);
+    }
+  }
+  if (ready_count == 0) {
+    auto blocked_at = clock_t::now();
+    ready_count = ::epoll_wait(this->epoll_fd_, ready, EventLoop::MAX_EVENT, timeout);
+    if (timeout != 0 && this->busy_poll_budget_ > clock_t::duration::zero()) {
+      // Polling would have found the events that arrived shortly after the loop blocked.
+      this->adaptSpinBudget(ready_count > 0 &&
+                            clock_t::now() - blocked_at < this->busy_poll_budget_);
+    }
+  }
+  if (idle) {
+    this->idle_handler_(false);
+  }
+  if (ready_count < 0) {
+    if (errno == EINTR) {
+      return;
+    }
+    throw utils::SystemException::fromLastError();
+  }
+  for (int i = 0; i < ready_count; i++) {
+    auto handle = static_cast<socket_handle_t>(ready[i].data.u64 & 0xFFFFFFFFu);
+    auto generation = static_cast<uint32_t>(ready[i].data.u64 >> 32u);
+    if (handle == this->wake_fd_) {
+      this->runPosted();
+      continue;
+    }
+    auto position = this->watches_.find(handle);
+    // The watch was removed or replaced by a previous callback.
+    if (position == this->watches_.end() || position->second.generation != generation) {
+      continue;
+    }
+    if (position->second.persistent) {
+      // Copied, as the callback may remove the watch.
+      auto callback = position->second.callback;
+      callback();
+    } else {
+      auto callback = move(position->second.callback);
+      this->watches_.erase(position);
+      callback();
+    }
+  }
+  this->runTimers();
+  this->runDeferred();
+}
+
+void EventLoop::run() {
+  while (!this->stopped_) {
+    this->runOnce();
+  }
+}
+
+void EventLoop::stop() {
+  this->stopped_ = true;
+  uint64_t one = 1;
+  ::write(this->wake_fd_, &one, sizeof(one));
+}
+} // namespace net
@@ -0,0 +1,55 @@
+#include "event_loop.h"
+
+namespace net {
+thread_local EventLoop *EventLoop::current_ = nullptr;
+
+EventLoop::EventLoop() : epoll_fd_(-1), wake_fd_(-1), generation_(0), timer_count_(0),
+                         busy_poll_budget_(0), spin_budget_(0), wake_pending_(false),
+                         stopped_(false) {
+}
+
+EventLoop::~EventLoop() {
+}
+
+void EventLoop::watch(socket_handle_t handle, unsigned events, callback_t callback,
+                      bool persistent) {
+}
+
+void EventLoop::unwatch(socket_handle_t handle) {
+}
+
+EventLoop::timer_id_t EventLoop::addTimer(clock_t::duration delay, callback_t callback) {
+  return {};
+}
+
+void EventLoop::cancelTimer(const timer_id_t &id) {
+}
+
+void EventLoop::post(callback_t callback) {
+}
+
+int EventLoop::getTimeout(int max_timeout) const {
+  return max_timeout;
+}
+
+void EventLoop::runPosted() {
+}
+
+void EventLoop::runTimers() {
+}
+
+void EventLoop::runDeferred() {
+}
+
+void EventLoop::adaptSpinBudget(bool useful) {
+}
+
+void EventLoop::runOnce(int max_timeout) {
+}
+
+void EventLoop::run() {
+}
+
+void EventLoop::stop() {
+}
+} // namespace net
@@ -14,6 +14,7 @@
 #endif
 
 #include "../utils/exception.h"
+#include "../utils/file.h"
 #include <string>
 #include <utility>
 #include <memory>
@@ -162,6 +163,14 @@ struct SocketAddress {
   }
 };
 
+/**
+ * A buffer of data for scatter/gather operations on sockets.
+ */
+struct SocketBuffer {
+  const char *data;
+  size_t length;
+};
+
 /**
  * Wrapper for BSD sockets on Unix and Windows systems.
  */
@@ -455,6 +464,28 @@ public:
     return count;
   }
 
+  /**
+   * Sends data from multiple buffers through the socket with a single call.
+   * @param buffers The buffers of data to send, in order
+   * @param count The number of buffers
+   * @return The number of bytes sent. -1 if sending would block on an asynchronous socket
+   * @throw utils::Exception Thrown if the operation failed
+   * @see ::sendmsg
+   */
+  long int sendv(const SocketBuffer *buffers, size_t count) const;
+
+  /**
+   * Sends data from a file through the socket, without copying it to user space when the platform
+   * allows it.
+   * @param file The file to read the data from
+   * @param offset The position of the data in the file
+   * @param count The number of bytes to send
+   * @return The number of bytes sent. -1 if sending would block on an asynchronous socket
+   * @throw utils::Exception Thrown if the operation failed
+   * @see ::sendfile
+   */
+  long int sendfile(const utils::File &file, size_t offset, size_t count) const;
+
   /**
    * Shuts down all or part of the connection open on the socket.
    * @param how Determines what to shut down:
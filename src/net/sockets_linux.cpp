@@ -1,6 +1,9 @@
 #include "sockets.h"
 #include <unistd.h>
+#include <csignal>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 namespace net {
 bool Socket::isErrorEWouldBlock(long int error) {
@@ -46,11 +49,53 @@ unique_ptr<Socket> Socket::accept(bool set_non_blocking) const {
   return make_unique<Socket>(client_socket, move(socket_address));
 }
 
+long int Socket::sendv(const SocketBuffer *buffers, size_t count) const {
+  this->checkState();
+  iovec vectors[64];
+  if (count > sizeof(vectors) / sizeof(iovec)) {
+    count = sizeof(vectors) / sizeof(iovec);
+  }
+  for (size_t i = 0; i < count; i++) {
+    vectors[i].iov_base = const_cast<char *>(buffers[i].data);
+    vectors[i].iov_len = buffers[i].length;
+  }
+  msghdr message{};
+  message.msg_iov = vectors;
+  message.msg_iovlen = count;
+  auto sent = ::sendmsg(this->handle_, &message, MSG_NOSIGNAL);
+  if (sent < 0) {
+    auto error = utils::SystemException::getLastError();
+    if (Socket::isErrorEWouldBlock(error)) {
+      return -1;
+    }
+    throw utils::SystemException(error);
+  }
+  return sent;
+}
+
+long int Socket::sendfile(const utils::File &file, size_t offset, size_t count) const {
+  this->checkState();
+  auto file_offset = static_cast<off_t>(offset);
+  auto sent = ::sendfile(this->handle_, file.getHandle(), &file_offset, count);
+  if (sent < 0) {
+    auto error = utils::SystemException::getLastError();
+    if (Socket::isErrorEWouldBlock(error)) {
+      return -1;
+    }
+    throw utils::SystemException(error);
+  }
+  return sent;
+}
+
 void Socket::close() {
   ::close(this->handle_);
   this->handle_ = INVALID_SOCKET_HANDLE;
 }
 
-SocketInitializer::SocketInitializer() = default;
+SocketInitializer::SocketInitializer() {
+  // Writing to a connection reset by the peer must fail with EPIPE instead of killing the process.
+  ::signal(SIGPIPE, SIG_IGN);
+}
+
 SocketInitializer::~SocketInitializer() = default;
 } // namespace net
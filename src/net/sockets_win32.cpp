@@ -16,6 +16,39 @@ void Socket::close() {
   this->handle_ = INVALID_SOCKET_HANDLE;
 }
 
+long int Socket::sendv(const SocketBuffer *buffers, size_t count) const {
+  this->checkState();
+  WSABUF vectors[64];
+  if (count > sizeof(vectors) / sizeof(WSABUF)) {
+    count = sizeof(vectors) / sizeof(WSABUF);
+  }
+  for (size_t i = 0; i < count; i++) {
+    vectors[i].buf = const_cast<char *>(buffers[i].data);
+    vectors[i].len = static_cast<ULONG>(buffers[i].length);
+  }
+  DWORD sent = 0;
+  if (::WSASend(this->handle_, vectors, static_cast<DWORD>(count), &sent, 0, nullptr,
+                nullptr) != 0) {
+    auto error = utils::SystemException::getLastError();
+    if (Socket::isErrorEWouldBlock(error)) {
+      return -1;
+    }
+    throw utils::SystemException(error);
+  }
+  return static_cast<long int>(sent);
+}
+
+long int Socket::sendfile(const utils::File &file, size_t offset, size_t count) const {
+  this->checkState();
+  // No zero-copy equivalent for a plain file descriptor, the data goes through a buffer.
+  char buf[16384];
+  auto read = file.read(buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+  if (read == 0) {
+    return 0;
+  }
+  return this->send(buf, read);
+}
+
 void Socket::setNonBlocking() {
   u_long mode = 1;
   if (ioctlsocket(this->handle_, FIONBIO, &mode) != 0) {
@@ -2,9 +2,17 @@
 #define NET_TCP_H
 
 #include "sockets.h"
+#include "event_loop.h"
 #include "../utils/exception.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 using namespace std;
 
@@ -28,7 +36,9 @@ public:
   }
 
   /**
-   * The client has sent data.
+   * The client has sent data. The listener may keep the client, for instance while waiting for
+   * another event, by returning an empty pointer: the server then ignores the client until the
+   * listener gives it back with TCPServer::resumeClient.
    */
   virtual unique_ptr<Socket> &&dataAvailable(unique_ptr<Socket> &&client) {
     char buf[128];
@@ -51,7 +61,36 @@ public:
  * Abstract TCP server class.
  */
 class TCPServer {
+public:
+  typedef function<void()> task_t;
+
 protected:
+  /**
+   * A thread running the server.
+   */
+  struct Worker {
+    const TCPServer *server;
+    EventLoop *loop;
+    /// The CPU the worker is pinned to, -1 if none.
+    int cpu;
+    /// The number of connections accepted by the worker.
+    shared_ptr<atomic<size_t>> connections;
+    /// The tasks scheduled by the worker, run in order unless idle workers steal them.
+    deque<task_t> tasks;
+    mutex tasks_lock;
+    atomic<bool> idle;
+#if defined(_WIN32)
+#else
+    /// The EPoll instance of the clients accepted by the worker, -1 if they use the server's one.
+    int epoll_fd = -1;
+#endif
+
+    Worker(const TCPServer *server, EventLoop *loop, int cpu)
+      : server(server), loop(loop), cpu(cpu), connections(make_shared<atomic<size_t>>(0)),
+        idle(false) {
+    }
+  };
+
   /**
    * Creates a new client events listener. Used to override the default type.
    */
@@ -59,16 +98,50 @@ protected:
     return make_unique<ClientEventsListener>();
   }
 
+  /**
+   * Called in a thread running the server, before it processes events.
+   * @param loop The event loop of the thread
+   */
+  virtual void workerStarted(EventLoop &loop) {
+  }
+
+  /**
+   * Called in a thread running the server, once it stopped processing events.
+   * @param loop The event loop of the thread
+   */
+  virtual void workerStopped(EventLoop &loop) {
+  }
+
   typedef socket_handle_t client_id_t;
   unique_ptr<Socket> socket_;
   map<client_id_t, utils::UniqueLocker<Socket>> clients_;
   map<client_id_t, unique_ptr<ClientEventsListener>> client_events_listeners_;
+  /// The connection counters of the workers that accepted the clients.
+  map<client_id_t, shared_ptr<atomic<size_t>>> client_worker_connections_;
   mutex clients_lock_;
   bool initialized_;
+  /// Maximum numbers of connections, 0 for no limit.
+  size_t max_connections_;
+  size_t max_worker_connections_;
+  atomic<size_t> connection_count_;
+
+  list<Worker> workers_;
+  mutex workers_lock_;
+  atomic<size_t> idle_workers_;
+  /// The CPUs the workers are pinned to in turn, empty for no affinity.
+  vector<int> worker_cpus_;
+  /// The number of workers started, used to assign their CPUs.
+  size_t worker_count_;
+  bool steer_connections_;
+  /// The time the workers poll for events before blocking, zero to always block.
+  chrono::microseconds busy_poll_;
+  inline static thread_local Worker *current_worker_ = nullptr;
 
 #if defined(_WIN32)
 #else
   int epoll_fd_;
+  /// The EPoll instances of the clients accepted by workers having their own one.
+  map<client_id_t, int> client_epolls_;
   /**
    * Maximum number of epoll events that will be processed by a thread at the same time.
    */
@@ -79,17 +152,49 @@ protected:
    * Adds a client to the server's list. Creates an associated client events listener if necessary.
    * @param client The client's socket
    */
-  void addClient(unique_ptr<Socket> &&client) {
+  void addClient(unique_ptr<Socket> &&client,
+                 const shared_ptr<atomic<size_t>> &worker_connections) {
     auto id = client->getHandle();
-    if (this->client_events_listeners_.count(id) == 0) {
-      this->client_events_listeners_.emplace(id, this->makeClientEventsListener());
+    this->clients_lock_.lock();
+    auto &locker = this->clients_[id];
+    auto &listener = this->client_events_listeners_[id];
+    if (!listener) {
+      listener = this->makeClientEventsListener();
     }
-    client = this->client_events_listeners_.at(id)->connected(move(client));
+    this->clients_lock_.unlock();
+    // A listener closes its client before giving it back, so the descriptor may already be reused
+    // while the previous client is released by another thread, which is waited for.
+    locker.take();
+    locker.yield(listener->connected(move(client)));
     this->clients_lock_.lock();
-    this->clients_[id] = move(client);
+    this->client_worker_connections_[id] = worker_connections;
     this->clients_lock_.unlock();
   }
 
+  ClientEventsListener &getClientEventsListener(client_id_t id) {
+    lock_guard<mutex> guard(this->clients_lock_);
+    return *this->client_events_listeners_.at(id);
+  }
+
+  /**
+   * Counts a new connection, unless a limit is reached.
+   * @param worker_connections The connection counter of the accepting worker
+   * @return Whether the connection is accepted
+   */
+  bool admitConnection(atomic<size_t> &worker_connections) {
+    if (this->max_worker_connections_ != 0 &&
+        worker_connections.load(memory_order_relaxed) >= this->max_worker_connections_) {
+      return false;
+    }
+    if (this->connection_count_.fetch_add(1) >= this->max_connections_ &&
+        this->max_connections_ != 0) {
+      this->connection_count_--;
+      return false;
+    }
+    worker_connections++;
+    return true;
+  }
+
   /**
    * Notifies the events listener associated with the client.
    * @param id The ID of the client
@@ -105,17 +210,39 @@ protected:
       return false;
     }
 
-    client = this->client_events_listeners_.at(id)->dataAvailable(move(client));
+    client = this->getClientEventsListener(id).dataAvailable(move(client));
+    // The listener keeps the client for now.
+    if (!client) {
+      return false;
+    }
+    return this->releaseClient(id, move(client), shutdown);
+  }
+
+  /**
+   * Gives back a client to the server after its listener processed it.
+   * @return Whether if the client is ready to reprocessed
+   */
+  bool releaseClient(client_id_t id, unique_ptr<Socket> &&client, bool shutdown) {
     if (client->isInvalid()) {
       shutdown = true;
     }
     if (shutdown) {
-      this->client_events_listeners_.at(id)->shutdown(move(client));
+      this->getClientEventsListener(id).shutdown(move(client));
     }
 
     this->clients_lock_.lock();
     if (shutdown) {
       this->clients_[id].reset();
+      auto worker_connections = this->client_worker_connections_.find(id);
+      if (worker_connections != this->client_worker_connections_.end()) {
+        (*worker_connections->second)--;
+        this->client_worker_connections_.erase(worker_connections);
+        this->connection_count_--;
+      }
+#if defined(_WIN32)
+#else
+      this->client_epolls_.erase(id);
+#endif
     } else {
       this->clients_[id].yield(move(client));
     }
@@ -123,6 +250,175 @@ protected:
     return !shutdown;
   }
 
+  /**
+   * Gives back a client kept by its listener, which resumes receiving events. Can be called from
+   * any thread, for instance by a worker that stole the processing of the client.
+   * @param id The ID of the client
+   * @param client The client's socket
+   */
+  void resumeClient(client_id_t id, unique_ptr<Socket> &&client) {
+    if (this->releaseClient(id, move(client), false)) {
+      this->armClient(id);
+    }
+  }
+
+  /**
+   * Waits for the next event of a client.
+   * @param id The ID of the client
+   */
+  void armClient(client_id_t id);
+
+  /**
+   * Pins the current thread to a CPU. Its memory is then allocated from the NUMA node of the CPU,
+   * as long as it is first written by the thread.
+   */
+  static void pinWorker(int cpu);
+
+  /**
+   * @return The CPU the next worker is pinned to, -1 if none
+   */
+  int assignWorkerCpu() {
+    lock_guard<mutex> guard(this->workers_lock_);
+    if (this->worker_cpus_.empty()) {
+      return -1;
+    }
+    return this->worker_cpus_[this->worker_count_++ % this->worker_cpus_.size()];
+  }
+
+  Worker &addWorker(EventLoop &loop, int cpu) {
+    lock_guard<mutex> guard(this->workers_lock_);
+    auto &worker = this->workers_.emplace_back(this, &loop, cpu);
+    TCPServer::current_worker_ = &worker;
+    loop.setIdleHandler([this, &worker](bool idle) {
+      this->setIdle(worker, idle);
+    });
+    return worker;
+  }
+
+  void removeWorker(Worker &worker) {
+    worker.loop->setIdleHandler(nullptr);
+    this->setIdle(worker, false);
+    TCPServer::current_worker_ = nullptr;
+    lock_guard<mutex> guard(this->workers_lock_);
+    this->workers_.remove_if([&worker](const Worker &other) {
+      return &other == &worker;
+    });
+  }
+
+  /**
+   * Called when the event loop of a worker runs out of work, and when it wakes up. An idle worker
+   * steals a task of another worker, if any.
+   */
+  void setIdle(Worker &worker, bool idle) {
+    if (!idle) {
+      if (worker.idle.exchange(false)) {
+        this->idle_workers_--;
+      }
+      return;
+    }
+    // Marked idle before looking for tasks, so that a task scheduled meanwhile wakes the worker.
+    if (!worker.idle.exchange(true)) {
+      this->idle_workers_++;
+    }
+    auto task = this->steal(worker);
+    if (task) {
+      this->setIdle(worker, false);
+      worker.loop->defer(move(task));
+    }
+  }
+
+  /**
+   * Takes the last task of another worker.
+   * @return The task, or an empty function if there is none
+   */
+  task_t steal(const Worker &thief) {
+    lock_guard<mutex> guard(this->workers_lock_);
+    for (auto &worker : this->workers_) {
+      // Tasks are not stolen from a worker handling its own ones.
+      if (&worker == &thief || !worker.tasks_lock.try_lock()) {
+        continue;
+      }
+      task_t task;
+      if (!worker.tasks.empty()) {
+        task = move(worker.tasks.back());
+        worker.tasks.pop_back();
+      }
+      worker.tasks_lock.unlock();
+      if (task) {
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Runs a task on the worker pinned to a CPU.
+   * @return Whether there is such a worker
+   */
+  bool postToWorker(int cpu, const task_t &task) {
+    lock_guard<mutex> guard(this->workers_lock_);
+    for (auto &worker : this->workers_) {
+      if (worker.cpu == cpu) {
+        worker.loop->post(task);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Wakes up an idle worker, so that it steals a task.
+   */
+  void wakeIdleWorker() {
+    lock_guard<mutex> guard(this->workers_lock_);
+    for (auto &worker : this->workers_) {
+      if (worker.idle.exchange(false)) {
+        this->idle_workers_--;
+        worker.loop->post([] {
+        });
+        return;
+      }
+    }
+  }
+
+  /**
+   * Runs the first task of a worker, unless it was stolen.
+   */
+  void runTask(Worker &worker) {
+    worker.tasks_lock.lock();
+    if (worker.tasks.empty()) {
+      worker.tasks_lock.unlock();
+      return;
+    }
+    auto task = move(worker.tasks.front());
+    worker.tasks.pop_front();
+    worker.tasks_lock.unlock();
+    task();
+  }
+#if defined(_WIN32)
+#else
+
+  /**
+   * Processes the events ready for now in an EPoll instance.
+   * @param worker The current worker
+   * @param epoll_fd The EPoll instance of the server or of the worker
+   */
+  void processEvents(Worker &worker, int epoll_fd);
+
+  /**
+   * Adds a new client accepted for a worker, unless a connection limit is reached. The client
+   * waits for its events in the EPoll instance of the worker, if it has one.
+   * @param worker The current worker, which owns the connection
+   */
+  void acceptClient(Worker &worker, unique_ptr<Socket> &&client);
+
+  /**
+   * Hands the clients of a stopping worker over to the EPoll instance of the server, so that the
+   * other workers process them, and closes the instance of the worker.
+   */
+  void closeWorkerEpoll(Worker &worker);
+#endif
+
 public:
   /**
    * Creates a server given a socket.
@@ -141,13 +437,80 @@ public:
   TCPServer &operator=(TCPServer &&tcp_server) noexcept;
   virtual ~TCPServer() = default;
 
+  /**
+   * Limits the number of connections, connections exceeding the limits being closed as soon as
+   * they are accepted. Must be called before the server runs.
+   * @param max_connections The maximum number of connections of the server, 0 for no limit
+   * @param max_worker_connections The maximum number of connections accepted by a thread running
+   *  the server, 0 for no limit
+   */
+  void setConnectionLimits(size_t max_connections, size_t max_worker_connections = 0) {
+    this->max_connections_ = max_connections;
+    this->max_worker_connections_ = max_worker_connections;
+  }
+
+  /**
+   * Pins the threads running the server to CPUs, which also keeps the memory they allocate on the
+   * NUMA node of their CPU. Must be called before the server runs.
+   * @param cpus The CPUs, assigned in turn to the threads as they start running the server
+   * @param steer_connections Hands each accepted connection over to the thread pinned to the CPU
+   *  that received its packets, if any. Each thread then waits for the events of its connections
+   *  on its own, instead of sharing them with the other threads, and the state a listener
+   *  allocates once connected stays close to the CPU
+   */
+  void setWorkerAffinity(vector<int> cpus, bool steer_connections = false) {
+    this->worker_cpus_ = move(cpus);
+    this->steer_connections_ = steer_connections;
+  }
+
+  /**
+   * Makes the threads running the server poll for events for some time before blocking, so that
+   * they do not wait for the scheduler to wake them up when events arrive shortly. The clients'
+   * sockets also poll their device queue when they are read, if the system allows it. A thread
+   * polls for less time while it is idle, down to not polling at all, and polls for longer again
+   * once events arrive shortly after it blocked. Must be called before the server runs.
+   * @param budget The longest time a thread polls for, zero to disable polling
+   */
+  void setBusyPoll(chrono::microseconds budget) {
+    this->busy_poll_ = budget;
+  }
+
+  size_t getConnectionCount() const {
+    return this->connection_count_;
+  }
+
+  /**
+   * Schedules a task at the end of the current iteration of the worker's event loop, for instance
+   * the processing of a client that has more work than the worker should do at once. The task
+   * does not wait for the other tasks of the worker: while it waits, an idle worker may steal it
+   * and run it in its own thread, so that the load of the workers evens out. Clients and requests
+   * handed over this way must thus not depend on the thread processing them.
+   * @param task The task
+   */
+  void schedule(task_t task) {
+    auto worker = TCPServer::current_worker_;
+    if (!worker || worker->server != this) {
+      EventLoop::require().defer(move(task));
+      return;
+    }
+    worker->tasks_lock.lock();
+    worker->tasks.push_back(move(task));
+    worker->tasks_lock.unlock();
+    worker->loop->defer([this, worker] {
+      this->runTask(*worker);
+    });
+    if (this->idle_workers_ > 0) {
+      this->wakeIdleWorker();
+    }
+  }
+
   /**
    * Initializes the server.
    * @param max Maximum number of pending connection requests to the socket
    */
   void initialize(int max = SOMAXCONN);
   /**
-   * Starts processing requests.
+   * Starts processing requests, with an event loop for the current thread.
    * Can be invoked with a thread.
    */
   void run();
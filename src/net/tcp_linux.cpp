@@ -1,6 +1,9 @@
 #include <iostream>
 #include "tcp.h"
 #include "sys/epoll.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 /**
  * EPoll events:
@@ -13,7 +16,11 @@
 constexpr auto TCP_CLIENT_EVENTS = (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT);
 
 namespace net {
-TCPServer::TCPServer(unique_ptr<Socket> &&socket) : socket_(move(socket)) {
+TCPServer::TCPServer(unique_ptr<Socket> &&socket) : socket_(move(socket)), max_connections_(0),
+                                                    max_worker_connections_(0),
+                                                    connection_count_(0), idle_workers_(0),
+                                                    worker_count_(0), steer_connections_(false),
+                                                    busy_poll_(0) {
   this->initialized_ = false;
   this->epoll_fd_ = ::epoll_create1(0);
   if (this->epoll_fd_ == -1) {
@@ -21,7 +28,11 @@ TCPServer::TCPServer(unique_ptr<Socket> &&socket) : socket_(move(socket)) {
   }
 }
 
-TCPServer::TCPServer(TCPServer &&tcp_server) noexcept : socket_(move(tcp_server.socket_)) {
+TCPServer::TCPServer(TCPServer &&tcp_server) noexcept
+  : socket_(move(tcp_server.socket_)), max_connections_(tcp_server.max_connections_),
+    max_worker_connections_(tcp_server.max_worker_connections_), connection_count_(0),
+    idle_workers_(0), worker_cpus_(move(tcp_server.worker_cpus_)), worker_count_(0),
+    steer_connections_(tcp_server.steer_connections_), busy_poll_(tcp_server.busy_poll_) {
   this->initialized_ = tcp_server.initialized_;
   this->epoll_fd_ = tcp_server.epoll_fd_;
   tcp_server.epoll_fd_ = -1;
@@ -33,6 +44,11 @@ TCPServer &TCPServer::operator=(TCPServer &&tcp_server) noexcept {
   }
   this->initialized_ = tcp_server.initialized_;
   this->socket_ = move(tcp_server.socket_);
+  this->max_connections_ = tcp_server.max_connections_;
+  this->max_worker_connections_ = tcp_server.max_worker_connections_;
+  this->worker_cpus_ = move(tcp_server.worker_cpus_);
+  this->steer_connections_ = tcp_server.steer_connections_;
+  this->busy_poll_ = tcp_server.busy_poll_;
   this->epoll_fd_ = tcp_server.epoll_fd_;
   tcp_server.epoll_fd_ = -1;
   return *this;
@@ -52,59 +68,190 @@ void TCPServer::initialize(int max) {
   }
 }
 
-/**
- * EPoll based, thread-safe TCP server. Waits for events on the server socket and connected clients
- * sockets.
- */
-void TCPServer::run() {
-  if (!this->initialized_) {
-    throw utils::RuntimeException("Server not initialized");
+void TCPServer::armClient(client_id_t id) {
+  epoll_event event{};
+  // Re-arms the client after EPOLLONESHOT.
+  event.events = TCP_CLIENT_EVENTS;
+  event.data.fd = id;
+  // Locked until the client is re-armed, as a stopping worker may hand its EPoll instance over.
+  lock_guard<mutex> guard(this->clients_lock_);
+  auto client_epoll = this->client_epolls_.find(id);
+  auto epoll_fd = client_epoll != this->client_epolls_.end() ? client_epoll->second
+                                                              : this->epoll_fd_;
+  if (::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, id, &event) != 0) {
+    // The client was removed from the interest list when it shut down, while it was kept by its
+    // listener. It is added back, so that the shutdown is reported again.
+    if (errno != ENOENT || ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, id, &event) != 0) {
+      throw utils::SystemException::fromLastError();
+    }
+  }
+}
+
+void TCPServer::pinWorker(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  auto error = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpu_set_t), &cpus);
+  if (error != 0) {
+    throw utils::SystemException(error);
+  }
+}
+
+void TCPServer::acceptClient(Worker &worker, unique_ptr<Socket> &&client) {
+  // Refuses the connection.
+  if (!this->admitConnection(*worker.connections)) {
+    client.reset();
+    return;
+  }
+  auto client_fd = client->getHandle();
+  if (this->busy_poll_.count() > 0) {
+    // Best effort, as raising the polling time above the system's default requires privileges.
+    int busy_poll = static_cast<int>(this->busy_poll_.count());
+    ::setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer_busy_poll = 1;
+    ::setsockopt(client_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer_busy_poll,
+                 sizeof(prefer_busy_poll));
+#endif
+  }
+  // The client must be ready to be processed before it is added to the EPoll interest list.
+  this->addClient(move(client), worker.connections);
+  auto epoll_fd = this->epoll_fd_;
+  if (worker.epoll_fd != -1) {
+    epoll_fd = worker.epoll_fd;
+    lock_guard<mutex> guard(this->clients_lock_);
+    this->client_epolls_[client_fd] = epoll_fd;
+  }
+  epoll_event event{};
+  event.events = TCP_CLIENT_EVENTS;
+  event.data.fd = client_fd;
+  // Adds the new client to the EPoll interest list.
+  if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) != 0) {
+    throw utils::SystemException::fromLastError();
+  }
+}
+
+void TCPServer::closeWorkerEpoll(Worker &worker) {
+  if (worker.epoll_fd == -1) {
+    return;
+  }
+  lock_guard<mutex> guard(this->clients_lock_);
+  for (auto client_epoll = this->client_epolls_.begin();
+       client_epoll != this->client_epolls_.end();) {
+    if (client_epoll->second != worker.epoll_fd) {
+      ++client_epoll;
+      continue;
+    }
+    // Armed again, a client kept by its listener being ignored until it is resumed.
+    epoll_event event{};
+    event.events = TCP_CLIENT_EVENTS;
+    event.data.fd = client_epoll->first;
+    ::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, client_epoll->first, &event);
+    client_epoll = this->client_epolls_.erase(client_epoll);
   }
-  epoll_event event{}, ready[TCPServer::MAX_EVENT];
+  ::close(worker.epoll_fd);
+  worker.epoll_fd = -1;
+}
+
+void TCPServer::processEvents(Worker &worker, int epoll_fd) {
+  epoll_event ready[TCPServer::MAX_EVENT];
   int ready_count, event_fd;
   unique_ptr<Socket> client;
 
-  while (true) {
-    ready_count = ::epoll_wait(this->epoll_fd_, ready, TCPServer::MAX_EVENT, -1);
-    if (ready_count < 0) {
-      throw utils::SystemException::fromLastError();
+  ready_count = ::epoll_wait(epoll_fd, ready, TCPServer::MAX_EVENT, 0);
+  if (ready_count < 0) {
+    if (errno == EINTR) {
+      return;
     }
-    for (int i = 0; i < ready_count; i++) {
-      event_fd = ready[i].data.fd;
-      // Event is a new connection.
-      if (event_fd == this->socket_->getHandle()) {
-        client = this->socket_->accept(true);
-        if (!client) {
-          continue;
+    throw utils::SystemException::fromLastError();
+  }
+  for (int i = 0; i < ready_count; i++) {
+    event_fd = ready[i].data.fd;
+    // Event is a new connection.
+    if (event_fd == this->socket_->getHandle()) {
+      client = this->socket_->accept(true);
+      if (!client) {
+        continue;
+      }
+      if (this->steer_connections_) {
+        // The CPU that processed the packets of the connection, ignored if unknown.
+        int cpu = -1;
+        socklen_t cpu_len = sizeof(cpu);
+        if (::getsockopt(client->getHandle(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len) == 0 &&
+            cpu >= 0 && cpu != worker.cpu) {
+          auto steered = make_shared<unique_ptr<Socket>>(move(client));
+          // Accepted by the worker of the CPU, in its own thread.
+          if (this->postToWorker(cpu, [this, steered] {
+            this->acceptClient(*TCPServer::current_worker_, move(*steered));
+          })) {
+            continue;
+          }
+          client = move(*steered);
         }
-        event.events = TCP_CLIENT_EVENTS;
-        event.data.fd = client->getHandle();
-        // Adds the new client to the EPoll interest list.
-        if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, client->getHandle(), &event) != 0) {
+      }
+      this->acceptClient(worker, move(client));
+    } else { // A connected client changed state.
+      auto shutdown = false;
+      // Client won't send anymore data.
+      if ((ready[i].events & EPOLLRDHUP) == EPOLLRDHUP) {
+        if (::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event_fd, nullptr) != 0) {
           throw utils::SystemException::fromLastError();
         }
-        this->addClient(move(client));
-      } else { // A connected client changed state.
-        auto shutdown = false;
-        // Client won't send anymore data.
-        if ((ready[i].events & EPOLLRDHUP) == EPOLLRDHUP) {
-          if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, event_fd, nullptr) != 0) {
-            throw utils::SystemException::fromLastError();
-          }
-          shutdown = true;
-        }
+        shutdown = true;
+      }
 
-        if (this->processClient(event_fd, shutdown)) {
-          // Re-arms the client after EPOLLONESHOT.
-          event.events = TCP_CLIENT_EVENTS;
-          event.data.fd = event_fd;
-          if (::epoll_ctl(this->epoll_fd_, EPOLL_CTL_MOD, event_fd, &event) != 0) {
-            throw utils::SystemException::fromLastError();
-          }
-        }
+      if (this->processClient(event_fd, shutdown)) {
+        this->armClient(event_fd);
+      }
+    }
+  }
+}
+
+/**
+ * EPoll based, thread-safe TCP server. The events of the server socket and connected clients are
+ * shared by the threads running the server, unless connections are steered: each thread then has
+ * its own EPoll instance for the clients it accepted. Each thread waits for them with its own event
+ * loop, in which the clients may also wait for other events, such as timers. A thread running out
+ * of events steals the tasks scheduled by the other threads. A thread is pinned to its CPU, if any,
+ * before it allocates anything, and polls for events for a while before blocking if busy polling
+ * is enabled.
+ */
+void TCPServer::run() {
+  if (!this->initialized_) {
+    throw utils::RuntimeException("Server not initialized");
+  }
+  // Pinned first, so that the memory of the worker is allocated on the node of its CPU.
+  auto cpu = this->assignWorkerCpu();
+  if (cpu >= 0) {
+    TCPServer::pinWorker(cpu);
+  }
+  EventLoop loop;
+  loop.setBusyPoll(this->busy_poll_);
+  auto &worker = this->addWorker(loop, cpu);
+  this->workerStarted(loop);
+  try {
+    if (this->steer_connections_) {
+      worker.epoll_fd = ::epoll_create1(0);
+      if (worker.epoll_fd == -1) {
+        throw utils::SystemException::fromLastError();
       }
+      loop.watch(worker.epoll_fd, EventLoop::READABLE, [this, &worker] {
+        this->processEvents(worker, worker.epoll_fd);
+      }, true);
     }
+    loop.watch(this->epoll_fd_, EventLoop::READABLE, [this, &worker] {
+      this->processEvents(worker, this->epoll_fd_);
+    }, true);
+    loop.run();
+  } catch (...) {
+    this->workerStopped(loop);
+    this->closeWorkerEpoll(worker);
+    this->removeWorker(worker);
+    throw;
   }
+  this->workerStopped(loop);
+  this->closeWorkerEpoll(worker);
+  this->removeWorker(worker);
 }
 
 } // namespace net
@@ -1,11 +1,19 @@
 #include "tcp.h"
 
 namespace net {
-TCPServer::TCPServer(unique_ptr<Socket> &&socket) : socket_(move(socket)) {
+TCPServer::TCPServer(unique_ptr<Socket> &&socket) : socket_(move(socket)), max_connections_(0),
+                                                    max_worker_connections_(0),
+                                                    connection_count_(0), idle_workers_(0),
+                                                    worker_count_(0), steer_connections_(false),
+                                                    busy_poll_(0) {
 
 }
 
-TCPServer::TCPServer(TCPServer &&tcp_server) noexcept : socket_(move(tcp_server.socket_)) {
+TCPServer::TCPServer(TCPServer &&tcp_server) noexcept
+  : socket_(move(tcp_server.socket_)), max_connections_(tcp_server.max_connections_),
+    max_worker_connections_(tcp_server.max_worker_connections_), connection_count_(0),
+    idle_workers_(0), worker_cpus_(move(tcp_server.worker_cpus_)), worker_count_(0),
+    steer_connections_(tcp_server.steer_connections_), busy_poll_(tcp_server.busy_poll_) {
 
 }
 
@@ -14,6 +22,11 @@ TCPServer &TCPServer::operator=(TCPServer &&tcp_server) noexcept {
     return *this;
   }
   this->socket_ = move(tcp_server.socket_);
+  this->max_connections_ = tcp_server.max_connections_;
+  this->max_worker_connections_ = tcp_server.max_worker_connections_;
+  this->worker_cpus_ = move(tcp_server.worker_cpus_);
+  this->steer_connections_ = tcp_server.steer_connections_;
+  this->busy_poll_ = tcp_server.busy_poll_;
   return *this;
 }
 
@@ -21,6 +34,14 @@ void TCPServer::initialize(int max) {
 
 }
 
+void TCPServer::armClient(client_id_t id) {
+
+}
+
+void TCPServer::pinWorker(int cpu) {
+
+}
+
 void TCPServer::run() {
 
 }
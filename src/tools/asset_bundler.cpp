@@ -0,0 +1,28 @@
+#include "../http/assets.h"
+#include <iostream>
+
+using namespace std;
+
+/**
+ * Packs the files of a directory into an asset bundle served by http::StaticAssets.
+ *
+ * Usage: asset_bundler <input-directory> <output-file> [--cache-control <value>]
+ */
+int main(int argc, char *argv[]) {
+  if (argc != 3 && !(argc == 5 && string(argv[3]) == "--cache-control")) {
+    cerr << "Usage: " << argv[0] << " <input-directory> <output-file> [--cache-control <value>]"
+         << endl;
+    return 2;
+  }
+  try {
+    http::AssetBundleWriter writer(argc == 5 ? argv[4] : "");
+    writer.addDirectory(argv[1]);
+    writer.write(argv[2]);
+    http::AssetBundle bundle(argv[2]);
+    cout << bundle.getCount() << " assets written to " << argv[2] << endl;
+  } catch (exception &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "compression.h"
+#include "exception.h"
+
+#if defined(UTILS_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(UTILS_HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+namespace utils {
+#if defined(UTILS_HAVE_ZLIB)
+/**
+ * Deflate compression with a gzip wrapper.
+ */
+class GzipEncoder : public Encoder {
+protected:
+  z_stream stream_{};
+
+  void compress(const char *data, size_t length, string &out, int flush) {
+    char buffer[16384];
+    this->stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    this->stream_.avail_in = static_cast<uInt>(length);
+    do {
+      this->stream_.next_out = reinterpret_cast<Bytef *>(buffer);
+      this->stream_.avail_out = sizeof(buffer);
+      auto result = ::deflate(&this->stream_, flush);
+      if (result == Z_STREAM_ERROR) {
+        throw RuntimeException("Gzip compression failed");
+      }
+      out.append(buffer, sizeof(buffer) - this->stream_.avail_out);
+    } while (this->stream_.avail_out == 0);
+  }
+
+public:
+  explicit GzipEncoder(int level) {
+    // 16 added to the window bits selects the gzip wrapper.
+    if (::deflateInit2(&this->stream_, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED,
+                       15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw RuntimeException("Cannot initialize gzip compression");
+    }
+  }
+
+  ~GzipEncoder() override {
+    ::deflateEnd(&this->stream_);
+  }
+
+  void write(const char *data, size_t length, string &out) override {
+    // Input is given in parts that fit zlib's 32 bits counters.
+    while (length > 0) {
+      auto part = length > (1u << 30u) ? static_cast<size_t>(1u << 30u) : length;
+      this->compress(data, part, out, Z_NO_FLUSH);
+      data += part;
+      length -= part;
+    }
+  }
+
+  void finish(string &out) override {
+    this->compress(nullptr, 0, out, Z_FINISH);
+  }
+};
+#endif
+
+#if defined(UTILS_HAVE_BROTLI)
+/**
+ * Brotli compression.
+ */
+class BrotliEncoder : public Encoder {
+protected:
+  BrotliEncoderState *state_;
+
+  void compress(const char *data, size_t length, string &out, BrotliEncoderOperation operation) {
+    auto next_in = reinterpret_cast<const uint8_t *>(data);
+    auto available_in = length;
+    do {
+      size_t available_out = 0;
+      if (!::BrotliEncoderCompressStream(this->state_, operation, &available_in, &next_in,
+                                         &available_out, nullptr, nullptr)) {
+        throw RuntimeException("Brotli compression failed");
+      }
+      size_t output_length = 0;
+      auto output = ::BrotliEncoderTakeOutput(this->state_, &output_length);
+      out.append(reinterpret_cast<const char *>(output), output_length);
+    } while (available_in > 0 || ::BrotliEncoderHasMoreOutput(this->state_) ||
+             (operation == BROTLI_OPERATION_FINISH && !::BrotliEncoderIsFinished(this->state_)));
+  }
+
+public:
+  explicit BrotliEncoder(int level) {
+    this->state_ = ::BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!this->state_) {
+      throw RuntimeException("Cannot initialize brotli compression");
+    }
+    // The default quality of the library is meant for offline compression.
+    ::BrotliEncoderSetParameter(this->state_, BROTLI_PARAM_QUALITY,
+                                static_cast<uint32_t>(level < 0 ? 5 : level));
+  }
+
+  ~BrotliEncoder() override {
+    ::BrotliEncoderDestroyInstance(this->state_);
+  }
+
+  void write(const char *data, size_t length, string &out) override {
+    this->compress(data, length, out, BROTLI_OPERATION_PROCESS);
+  }
+
+  void finish(string &out) override {
+    this->compress(nullptr, 0, out, BROTLI_OPERATION_FINISH);
+  }
+};
+#endif
+
+unique_ptr<Encoder> Encoder::create(const string &coding, int level) {
+#if defined(UTILS_HAVE_ZLIB)
+  if (coding == "gzip") {
+    return make_unique<GzipEncoder>(level);
+  }
+#endif
+#if defined(UTILS_HAVE_BROTLI)
+  if (coding == "br") {
+    return make_unique<BrotliEncoder>(level);
+  }
+#endif
+  return nullptr;
+}
+
+bool Encoder::isSupported(const string &coding) {
+#if defined(UTILS_HAVE_ZLIB)
+  if (coding == "gzip") {
+    return true;
+  }
+#endif
+#if defined(UTILS_HAVE_BROTLI)
+  if (coding == "br") {
+    return true;
+  }
+#endif
+  return false;
+}
+
+string Encoder::compress(const string &coding, const string &data, int level) {
+  auto encoder = Encoder::create(coding, level);
+  if (!encoder) {
+    throw RuntimeException("Unsupported content coding %s", coding.c_str());
+  }
+  string out;
+  encoder->write(data.data(), data.size(), out);
+  encoder->finish(out);
+  return out;
+}
+} // namespace utils
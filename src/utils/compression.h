@@ -0,0 +1,61 @@
+#ifndef UTILS_COMPRESSION_H
+#define UTILS_COMPRESSION_H
+
+#include <memory>
+#include <string>
+
+using namespace std;
+
+namespace utils {
+/**
+ * Streaming compressor for an HTTP content coding. The input is given in chunks and the compressed
+ * output is produced as the input goes, so that a large input never has to be held in memory.
+ * Available codings depend on the libraries found at build time: "gzip" requires zlib and "br"
+ * requires the Brotli encoder.
+ */
+class Encoder {
+public:
+  virtual ~Encoder() = default;
+
+  /**
+   * Compresses a chunk of input.
+   * @param data The chunk
+   * @param length The length of the chunk
+   * @param out The output container, to which compressed data is appended
+   * @throw RuntimeException Thrown if the compression failed
+   */
+  virtual void write(const char *data, size_t length, string &out) = 0;
+
+  /**
+   * Terminates the compressed stream. The encoder cannot be used anymore.
+   * @param out The output container, to which the remaining compressed data is appended
+   * @throw RuntimeException Thrown if the compression failed
+   */
+  virtual void finish(string &out) = 0;
+
+  /**
+   * Creates an encoder.
+   * @param coding The name of the content coding
+   * @param level The compression level, -1 for the default level of the coding
+   * @return The encoder, or nullptr if the coding is not supported
+   */
+  static unique_ptr<Encoder> create(const string &coding, int level = -1);
+
+  /**
+   * @param coding The name of a content coding
+   * @return Whether an encoder can be created for the coding
+   */
+  static bool isSupported(const string &coding);
+
+  /**
+   * Compresses a whole buffer at once.
+   * @param coding The name of the content coding, which must be supported
+   * @param data The data to compress
+   * @param level The compression level, -1 for the default level of the coding
+   * @return The compressed data
+   */
+  static string compress(const string &coding, const string &data, int level = -1);
+};
+} // namespace utils
+
+#endif //UTILS_COMPRESSION_H
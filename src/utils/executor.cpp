@@ -0,0 +1,56 @@
+#include "executor.h"
+#include <algorithm>
+
+namespace utils {
+Executor::Executor(size_t thread_count, size_t max_pending) : max_pending_(max_pending),
+                                                              stopped_(false) {
+  if (thread_count == 0) {
+    thread_count = max(1u, thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    this->threads_.emplace_back(&Executor::work, this);
+  }
+}
+
+Executor::~Executor() {
+  {
+    lock_guard<mutex> guard(this->lock_);
+    this->stopped_ = true;
+    this->jobs_.clear();
+  }
+  this->available_.notify_all();
+  for (auto &thread : this->threads_) {
+    thread.join();
+  }
+}
+
+bool Executor::trySubmit(function<void()> job) {
+  {
+    lock_guard<mutex> guard(this->lock_);
+    if (this->stopped_ || this->jobs_.size() >= this->max_pending_) {
+      return false;
+    }
+    this->jobs_.push_back(move(job));
+  }
+  this->available_.notify_one();
+  return true;
+}
+
+void Executor::work() {
+  while (true) {
+    function<void()> job;
+    {
+      unique_lock<mutex> guard(this->lock_);
+      this->available_.wait(guard, [this] {
+        return this->stopped_ || !this->jobs_.empty();
+      });
+      if (this->stopped_) {
+        return;
+      }
+      job = move(this->jobs_.front());
+      this->jobs_.pop_front();
+    }
+    job();
+  }
+}
+} // namespace utils
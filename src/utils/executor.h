@@ -0,0 +1,56 @@
+#ifndef UTILS_EXECUTOR_H
+#define UTILS_EXECUTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace utils {
+/**
+ * A fixed pool of threads running blocking or CPU-heavy jobs, away from the threads multiplexing
+ * connections. The number of pending jobs is bounded, so that an overloaded executor rejects jobs
+ * instead of queuing them indefinitely.
+ */
+class Executor {
+protected:
+  mutex lock_;
+  condition_variable available_;
+  deque<function<void()>> jobs_;
+  size_t max_pending_;
+  bool stopped_;
+  vector<thread> threads_;
+
+  void work();
+
+public:
+  /**
+   * @param thread_count The number of threads, 0 to use the number of hardware threads
+   * @param max_pending The maximum number of jobs waiting for a thread
+   */
+  explicit Executor(size_t thread_count = 0, size_t max_pending = 1024);
+  Executor(const Executor &other) = delete;
+  Executor &operator=(const Executor &other) = delete;
+  /**
+   * Waits for the running jobs and drops the pending ones.
+   */
+  ~Executor();
+
+  /**
+   * Schedules a job. Can be called from any thread.
+   * @param job The job, which must not throw
+   * @return Whether the job was accepted, false if too many jobs are pending
+   */
+  bool trySubmit(function<void()> job);
+
+  size_t getThreadCount() const {
+    return this->threads_.size();
+  }
+};
+} // namespace utils
+
+#endif //UTILS_EXECUTOR_H
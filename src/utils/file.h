@@ -0,0 +1,150 @@
+#ifndef UTILS_FILE_H
+#define UTILS_FILE_H
+
+#include "exception.h"
+#include <string>
+
+using namespace std;
+
+namespace utils {
+/// Common type for the actual file.
+typedef int file_handle_t;
+/// Common value for an invalid file.
+const file_handle_t INVALID_FILE_HANDLE = -1;
+
+/**
+ * Wrapper for an open file descriptor.
+ */
+class File {
+protected:
+  file_handle_t handle_;
+  string path_;
+
+public:
+  /**
+   * Opens a file.
+   * @param path The path of the file
+   * @param writable Opens the file for reading and writing, creating it if necessary
+   * @throw SystemException Thrown if the file cannot be opened
+   */
+  explicit File(const string &path, bool writable = false);
+
+  /**
+   * Prevents the copy of a wrapper instance.
+   */
+  File(const File &file) = delete;
+
+  File(File &&file) noexcept : handle_(file.handle_), path_(move(file.path_)) {
+    file.handle_ = INVALID_FILE_HANDLE;
+  }
+
+  /**
+   * Prevents the copy of a wrapper instance.
+   */
+  File &operator=(const File &file) = delete;
+
+  File &operator=(File &&file) noexcept {
+    if (this == &file) {
+      return *this;
+    }
+    this->close();
+    this->handle_ = file.handle_;
+    file.handle_ = INVALID_FILE_HANDLE;
+    this->path_ = move(file.path_);
+    return *this;
+  }
+
+  /**
+   * Closes the file before destructing the wrapper.
+   */
+  ~File() {
+    this->close();
+  }
+
+  /**
+   * @return The actual handle for the file
+   */
+  file_handle_t getHandle() const {
+    return this->handle_;
+  }
+
+  /**
+   * @return The path used to open the file
+   */
+  const string &getPath() const {
+    return this->path_;
+  }
+
+  /**
+   * @return The size of the file in bytes
+   * @throw SystemException Thrown if the operation failed
+   */
+  size_t getSize() const;
+
+  /**
+   * @return The time of the last modification of the file, in seconds since the epoch
+   * @throw SystemException Thrown if the operation failed
+   */
+  long long getModificationTime() const;
+
+  /**
+   * Reads data at a given position without changing the file offset.
+   * @param buf The buffer to store the data
+   * @param len The length of the buffer
+   * @param offset The position in the file
+   * @return The number of bytes written to the buffer, 0 at the end of the file
+   * @throw SystemException Thrown if the operation failed
+   * @see ::pread
+   */
+  size_t read(char *buf, size_t len, size_t offset) const;
+
+  /**
+   * Truncates or extends the file.
+   * @param size The new size of the file in bytes
+   * @throw SystemException Thrown if the operation failed
+   */
+  void resize(size_t size);
+
+  /**
+   * Closes the file handle.
+   */
+  void close();
+};
+
+/**
+ * Shared memory mapping of the beginning of a file, unmapped on destruction.
+ */
+class FileMapping {
+protected:
+  char *data_;
+  size_t length_;
+#if defined(_WIN32)
+  void *mapping_handle_;
+#endif
+
+public:
+  /**
+   * Maps a file in memory.
+   * @param file The file, which can be closed once mapped
+   * @param length The length of the mapping, from the start of the file
+   * @param writable Allows writing to the mapping, which requires a writable file
+   * @throw SystemException Thrown if the operation failed
+   */
+  FileMapping(const File &file, size_t length, bool writable = false);
+
+  FileMapping(const FileMapping &mapping) = delete;
+  FileMapping &operator=(const FileMapping &mapping) = delete;
+
+  ~FileMapping();
+
+  char *getData() const {
+    return this->data_;
+  }
+
+  size_t getLength() const {
+    return this->length_;
+  }
+};
+} // namespace utils
+
+#endif //UTILS_FILE_H
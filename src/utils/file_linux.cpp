@@ -0,0 +1,64 @@
+#include "file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace utils {
+File::File(const string &path, bool writable) : path_(path) {
+  auto flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+  this->handle_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+  if (this->handle_ == INVALID_FILE_HANDLE) {
+    throw SystemException::fromLastError();
+  }
+}
+
+size_t File::getSize() const {
+  struct stat info{};
+  if (::fstat(this->handle_, &info) != 0) {
+    throw SystemException::fromLastError();
+  }
+  return static_cast<size_t>(info.st_size);
+}
+
+long long File::getModificationTime() const {
+  struct stat info{};
+  if (::fstat(this->handle_, &info) != 0) {
+    throw SystemException::fromLastError();
+  }
+  return static_cast<long long>(info.st_mtime);
+}
+
+size_t File::read(char *buf, size_t len, size_t offset) const {
+  auto count = ::pread(this->handle_, buf, len, static_cast<off_t>(offset));
+  if (count < 0) {
+    throw SystemException::fromLastError();
+  }
+  return static_cast<size_t>(count);
+}
+
+void File::resize(size_t size) {
+  if (::ftruncate(this->handle_, static_cast<off_t>(size)) != 0) {
+    throw SystemException::fromLastError();
+  }
+}
+
+void File::close() {
+  if (this->handle_ != INVALID_FILE_HANDLE) {
+    ::close(this->handle_);
+  }
+  this->handle_ = INVALID_FILE_HANDLE;
+}
+FileMapping::FileMapping(const File &file, size_t length, bool writable) : length_(length) {
+  auto protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  auto data = ::mmap(nullptr, length, protection, MAP_SHARED, file.getHandle(), 0);
+  if (data == MAP_FAILED) {
+    throw SystemException::fromLastError();
+  }
+  this->data_ = static_cast<char *>(data);
+}
+
+FileMapping::~FileMapping() {
+  ::munmap(this->data_, this->length_);
+}
+} // namespace utils
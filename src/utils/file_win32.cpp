@@ -0,0 +1,80 @@
+#include "file.h"
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+
+namespace utils {
+File::File(const string &path, bool writable) : path_(path) {
+  auto flags = writable ? _O_RDWR | _O_CREAT : _O_RDONLY;
+  this->handle_ = ::_open(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+  if (this->handle_ == INVALID_FILE_HANDLE) {
+    throw SystemException(errno);
+  }
+}
+
+size_t File::getSize() const {
+  struct _stat64 info{};
+  if (::_fstat64(this->handle_, &info) != 0) {
+    throw SystemException(errno);
+  }
+  return static_cast<size_t>(info.st_size);
+}
+
+long long File::getModificationTime() const {
+  struct _stat64 info{};
+  if (::_fstat64(this->handle_, &info) != 0) {
+    throw SystemException(errno);
+  }
+  return static_cast<long long>(info.st_mtime);
+}
+
+size_t File::read(char *buf, size_t len, size_t offset) const {
+  if (::_lseeki64(this->handle_, static_cast<__int64>(offset), SEEK_SET) < 0) {
+    throw SystemException(errno);
+  }
+  auto count = ::_read(this->handle_, buf, static_cast<unsigned int>(len));
+  if (count < 0) {
+    throw SystemException(errno);
+  }
+  return static_cast<size_t>(count);
+}
+
+void File::resize(size_t size) {
+  auto error = ::_chsize_s(this->handle_, static_cast<__int64>(size));
+  if (error != 0) {
+    throw SystemException(error);
+  }
+}
+
+void File::close() {
+  if (this->handle_ != INVALID_FILE_HANDLE) {
+    ::_close(this->handle_);
+  }
+  this->handle_ = INVALID_FILE_HANDLE;
+}
+FileMapping::FileMapping(const File &file, size_t length, bool writable) : length_(length) {
+  auto file_handle = reinterpret_cast<HANDLE>(::_get_osfhandle(file.getHandle()));
+  auto size = static_cast<unsigned long long>(length);
+  this->mapping_handle_ = ::CreateFileMappingA(file_handle, nullptr,
+                                               writable ? PAGE_READWRITE : PAGE_READONLY,
+                                               static_cast<DWORD>(size >> 32u),
+                                               static_cast<DWORD>(size), nullptr);
+  if (this->mapping_handle_ == nullptr) {
+    throw SystemException::fromLastError();
+  }
+  auto data = ::MapViewOfFile(this->mapping_handle_, writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                              0, 0, length);
+  if (data == nullptr) {
+    auto error = SystemException::fromLastError();
+    ::CloseHandle(this->mapping_handle_);
+    throw error;
+  }
+  this->data_ = static_cast<char *>(data);
+}
+
+FileMapping::~FileMapping() {
+  ::UnmapViewOfFile(this->data_);
+  ::CloseHandle(this->mapping_handle_);
+}
+} // namespace utils
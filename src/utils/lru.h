@@ -0,0 +1,158 @@
+#ifndef UTILS_LRU_H
+#define UTILS_LRU_H
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace utils {
+/**
+ * A thread-safe least recently used cache bounded by the total cost of its entries. Entries are
+ * distributed between independently locked shards according to the hash of their key, so that
+ * threads working on different keys rarely contend for the same lock.
+ * @tparam K The type of the keys
+ * @tparam V The type of the values, copied out of the cache on lookups
+ * @tparam Hash The hash function for the keys
+ */
+template<typename K, typename V, typename Hash = hash<K>>
+class ShardedLruCache {
+protected:
+  struct Entry {
+    K key;
+    V value;
+    size_t cost;
+  };
+
+  struct Shard {
+    mutex lock_;
+    /// Most recently used entries first.
+    list<Entry> entries_;
+    unordered_map<K, typename list<Entry>::iterator, Hash> index_;
+    size_t cost_ = 0;
+  };
+
+  unique_ptr<Shard[]> shards_;
+  size_t shard_count_;
+  size_t shard_capacity_;
+  Hash hash_;
+
+  Shard &getShard(const K &key) const {
+    // The low bits of the hash are used by the shard's table, the high bits select the shard.
+    auto hash = this->hash_(key);
+    return this->shards_[(hash >> 16u) % this->shard_count_];
+  }
+
+  /**
+   * Removes an entry. The shard must be locked.
+   */
+  static void eraseEntry(Shard &shard, typename list<Entry>::iterator entry) {
+    shard.cost_ -= entry->cost;
+    shard.index_.erase(entry->key);
+    shard.entries_.erase(entry);
+  }
+
+public:
+  /**
+   * @param capacity The maximum total cost of the entries
+   * @param shard_count The number of shards, each holding at most its share of the capacity
+   */
+  explicit ShardedLruCache(size_t capacity, size_t shard_count = 16)
+    : shards_(new Shard[shard_count == 0 ? 1 : shard_count]),
+      shard_count_(shard_count == 0 ? 1 : shard_count) {
+    this->shard_capacity_ = capacity / this->shard_count_;
+  }
+
+  ShardedLruCache(const ShardedLruCache &other) = delete;
+  ShardedLruCache &operator=(const ShardedLruCache &other) = delete;
+
+  /**
+   * Looks up an entry and marks it as the most recently used.
+   * @param key The key of the entry
+   * @param out The output container for the value
+   * @return Whether the entry exists
+   */
+  bool get(const K &key, V &out) {
+    auto &shard = this->getShard(key);
+    lock_guard<mutex> guard(shard.lock_);
+    auto position = shard.index_.find(key);
+    if (position == shard.index_.end()) {
+      return false;
+    }
+    shard.entries_.splice(shard.entries_.begin(), shard.entries_, position->second);
+    out = position->second->value;
+    return true;
+  }
+
+  /**
+   * Inserts or replaces an entry, evicting the least recently used entries of the shard if its
+   * capacity is exceeded. An entry costing more than a shard's capacity is not inserted.
+   * @param key The key of the entry
+   * @param value The value of the entry
+   * @param cost The cost of the entry
+   * @return Whether the entry was inserted
+   */
+  bool put(const K &key, V value, size_t cost) {
+    if (cost > this->shard_capacity_) {
+      return false;
+    }
+    auto &shard = this->getShard(key);
+    lock_guard<mutex> guard(shard.lock_);
+    auto position = shard.index_.find(key);
+    if (position != shard.index_.end()) {
+      ShardedLruCache::eraseEntry(shard, position->second);
+    }
+    while (!shard.entries_.empty() && shard.cost_ + cost > this->shard_capacity_) {
+      ShardedLruCache::eraseEntry(shard, prev(shard.entries_.end()));
+    }
+    shard.entries_.push_front({key, move(value), cost});
+    shard.index_.emplace(key, shard.entries_.begin());
+    shard.cost_ += cost;
+    return true;
+  }
+
+  /**
+   * Removes an entry if it exists.
+   * @param key The key of the entry
+   */
+  void erase(const K &key) {
+    auto &shard = this->getShard(key);
+    lock_guard<mutex> guard(shard.lock_);
+    auto position = shard.index_.find(key);
+    if (position != shard.index_.end()) {
+      ShardedLruCache::eraseEntry(shard, position->second);
+    }
+  }
+
+  /**
+   * Removes an entry if it still holds a given value.
+   * @param key The key of the entry
+   * @param value The expected value
+   */
+  void erase(const K &key, const V &value) {
+    auto &shard = this->getShard(key);
+    lock_guard<mutex> guard(shard.lock_);
+    auto position = shard.index_.find(key);
+    if (position != shard.index_.end() && position->second->value == value) {
+      ShardedLruCache::eraseEntry(shard, position->second);
+    }
+  }
+
+  /**
+   * @return The total cost of the entries
+   */
+  size_t getCost() const {
+    size_t cost = 0;
+    for (size_t i = 0; i < this->shard_count_; i++) {
+      lock_guard<mutex> guard(this->shards_[i].lock_);
+      cost += this->shards_[i].cost_;
+    }
+    return cost;
+  }
+};
+} // namespace utils
+
+#endif //UTILS_LRU_H
@@ -0,0 +1,81 @@
+#ifndef UTILS_MPSC_QUEUE_H
+#define UTILS_MPSC_QUEUE_H
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+using namespace std;
+
+namespace utils {
+/**
+ * A lock-free, unbounded, multiple producers single consumer queue: a linked list whose producers
+ * only exchange the head pointer, and whose consumer owns the tail (D. Vyukov's algorithm).
+ * An element pushed while the consumer is popping may only become visible once its producer
+ * returns from push.
+ * @tparam T The type of the elements
+ */
+template<typename T>
+class MpscQueue {
+protected:
+  struct Node {
+    atomic<Node *> next;
+    optional<T> value;
+
+    Node() : next(nullptr) {
+    }
+
+    explicit Node(T &&value) : next(nullptr), value(move(value)) {
+    }
+  };
+
+  /// The last pushed node, shared by the producers.
+  alignas(64) atomic<Node *> head_;
+  /// A node whose value was already consumed, owned by the consumer.
+  alignas(64) Node *tail_;
+
+public:
+  MpscQueue() {
+    auto stub = new Node();
+    this->head_.store(stub, memory_order_relaxed);
+    this->tail_ = stub;
+  }
+
+  MpscQueue(const MpscQueue &other) = delete;
+  MpscQueue &operator=(const MpscQueue &other) = delete;
+
+  ~MpscQueue() {
+    while (this->pop()) {
+    }
+    delete this->tail_;
+  }
+
+  /**
+   * Appends an element. Can be called from any thread.
+   */
+  void push(T value) {
+    auto node = new Node(move(value));
+    auto previous = this->head_.exchange(node, memory_order_acq_rel);
+    previous->next.store(node, memory_order_release);
+  }
+
+  /**
+   * Removes the first element. Must only be called from the consumer thread.
+   * @return The element, or nothing if the queue is empty
+   */
+  optional<T> pop() {
+    auto tail = this->tail_;
+    auto next = tail->next.load(memory_order_acquire);
+    if (!next) {
+      return nullopt;
+    }
+    optional<T> value(move(next->value));
+    next->value.reset();
+    this->tail_ = next;
+    delete tail;
+    return value;
+  }
+};
+} // namespace utils
+
+#endif //UTILS_MPSC_QUEUE_H
@@ -0,0 +1,196 @@
+#ifndef UTILS_TASK_H
+#define UTILS_TASK_H
+
+#include "exception.h"
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+using namespace std;
+
+namespace utils {
+template<typename T>
+class Task;
+
+namespace task {
+/**
+ * State shared by the promises of all tasks.
+ */
+class PromiseBase {
+  template<typename T> friend
+  class utils::Task;
+
+protected:
+  exception_ptr exception_;
+  /// The coroutine awaiting the task, if any.
+  coroutine_handle<> continuation_;
+  /// Called when a started task completes after having been suspended.
+  function<void()> completion_;
+
+  struct FinalAwaiter {
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    template<typename Promise>
+    coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept {
+      auto &promise = handle.promise();
+      if (promise.continuation_) {
+        return promise.continuation_;
+      }
+      if (promise.completion_) {
+        // The completion may destroy the task, and the function with it.
+        auto completion = move(promise.completion_);
+        completion();
+      }
+      return noop_coroutine();
+    }
+
+    void await_resume() const noexcept {
+    }
+  };
+
+public:
+  suspend_always initial_suspend() const noexcept {
+    return {};
+  }
+
+  FinalAwaiter final_suspend() const noexcept {
+    return {};
+  }
+
+  void unhandled_exception() {
+    this->exception_ = current_exception();
+  }
+};
+
+template<typename T>
+class Promise : public PromiseBase {
+  template<typename U> friend
+  class utils::Task;
+
+protected:
+  optional<T> value_;
+
+public:
+  Task<T> get_return_object();
+
+  template<typename U>
+  void return_value(U &&value) {
+    this->value_.emplace(forward<U>(value));
+  }
+};
+
+template<>
+class Promise<void> : public PromiseBase {
+public:
+  Task<void> get_return_object();
+
+  void return_void() {
+  }
+};
+} // namespace task
+
+/**
+ * A lazily started coroutine producing a value. A task either is awaited by another coroutine,
+ * which resumes once the task completes, or is started by a non-coroutine caller with a completion
+ * function. A task resumes on the thread resuming the event it awaits, which is the thread
+ * running its event loop.
+ * @tparam T The type of the value
+ */
+template<typename T = void>
+class Task {
+public:
+  typedef task::Promise<T> promise_type;
+
+protected:
+  coroutine_handle<promise_type> handle_;
+
+public:
+  explicit Task(coroutine_handle<promise_type> handle) : handle_(handle) {
+  }
+
+  Task(const Task &other) = delete;
+
+  Task(Task &&other) noexcept : handle_(exchange(other.handle_, nullptr)) {
+  }
+
+  Task &operator=(const Task &other) = delete;
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (this->handle_) {
+        this->handle_.destroy();
+      }
+      this->handle_ = exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  ~Task() {
+    if (this->handle_) {
+      this->handle_.destroy();
+    }
+  }
+
+  /**
+   * Runs the task until it completes or suspends.
+   * @param completion Called once the task completes, only if it suspended
+   */
+  void start(function<void()> completion = nullptr) {
+    this->handle_.resume();
+    if (!this->handle_.done()) {
+      this->handle_.promise().completion_ = move(completion);
+    }
+  }
+
+  bool isDone() const {
+    return this->handle_.done();
+  }
+
+  /**
+   * @return The value of the completed task
+   * @throw exception Rethrows the exception escaping the task
+   */
+  T get() {
+    if (!this->handle_.done()) {
+      throw RuntimeException("Task not completed");
+    }
+    auto &promise = this->handle_.promise();
+    if (promise.exception_) {
+      rethrow_exception(promise.exception_);
+    }
+    if constexpr (!is_void_v<T>) {
+      return move(*promise.value_);
+    }
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  coroutine_handle<> await_suspend(coroutine_handle<> continuation) noexcept {
+    this->handle_.promise().continuation_ = continuation;
+    return this->handle_;
+  }
+
+  T await_resume() {
+    return this->get();
+  }
+};
+
+namespace task {
+template<typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(coroutine_handle<Promise<void>>::from_promise(*this));
+}
+} // namespace task
+} // namespace utils
+
+#endif //UTILS_TASK_H
@@ -41,3 +41,12 @@ string utils::trim(const string &str) {
   trim(str, out);
   return out;
 }
+
+uint64_t utils::hash64(const char *data, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
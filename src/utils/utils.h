@@ -1,10 +1,14 @@
 #ifndef UTILS_UTILS_H
 #define UTILS_UTILS_H
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <locale>
+#include <memory>
 #include <sstream>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #if defined(_WIN32)
@@ -62,16 +66,45 @@ void trim(const string &str, string &out);
  */
 string trim(const string &str);
 
+/**
+ * Computes the 64 bits FNV-1a hash of a sequence of bytes. The hash is stable across runs and
+ * platforms, so it can be stored.
+ * @param data The bytes
+ * @param length The number of bytes
+ * @return The hash
+ */
+uint64_t hash64(const char *data, size_t length);
+
 /**
  * A shareable container that allows only one owner for the data it holds. Used to prevent threads
- * from taking ownership of the same data concurrently.
+ * from taking ownership of the same data concurrently. The owner may hand the data over to another
+ * thread, which then yields it back.
  * @tparam T The type of the data which is stored in a unique pointer
  */
 template<typename T>
 class UniqueLocker {
 protected:
-  mutex lock_;
+  /// Whether the data is out of the locker. Unlike a mutex, it can be released by any thread.
+  atomic<bool> taken_ = false;
   unique_ptr<T> data_;
+
+  /// The number of times a thread retries to take the data before blocking until it is yielded.
+  static constexpr int SPIN_COUNT = 16;
+
+  void lock() {
+    for (int i = 0; this->taken_.exchange(true, memory_order_acquire); i++) {
+      if (i < UniqueLocker::SPIN_COUNT) {
+        this_thread::yield();
+      } else {
+        this->taken_.wait(true, memory_order_relaxed);
+      }
+    }
+  }
+
+  void unlock() {
+    this->taken_.store(false, memory_order_release);
+    this->taken_.notify_all();
+  }
 public:
   /**
    * Default constructor.
@@ -105,9 +138,9 @@ public:
    * @param data The data
    */
   UniqueLocker &operator=(unique_ptr<T> &&data) {
-    this->lock_.lock();
+    this->lock();
     this->data_ = move(data);
-    this->lock_.unlock();
+    this->unlock();
     return *this;
   }
 
@@ -138,7 +171,7 @@ public:
    * @return The data
    */
   unique_ptr<T> take() {
-    this->lock_.lock();
+    this->lock();
     return move(this->data_);
   }
 
@@ -149,20 +182,21 @@ public:
    * @return The data or an empty pointer
    */
   unique_ptr<T> try_take() {
-    if (!this->lock_.try_lock()) {
+    if (this->taken_.exchange(true, memory_order_acquire)) {
       return nullptr;
     }
     return move(this->data_);
   }
 
   /**
-   * Yields back ownership of the data. The data can be different from the original.
+   * Yields back ownership of the data. The data can be different from the original, and can be
+   * yielded by another thread than the one that took it.
    * Behavior is undefined if called without ownership.
    * @param data The data
    */
   void yield(unique_ptr<T> &&data) {
     this->data_ = move(data);
-    this->lock_.unlock();
+    this->unlock();
   }
 
   /**
@@ -171,7 +205,7 @@ public:
    */
   void reset() {
     this->data_.reset();
-    this->lock_.unlock();
+    this->unlock();
   }
 };
 